@@ -0,0 +1,22 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+#extension GL_EXT_nonuniform_qualifier : require
+
+#include "shading.glsl"
+
+// Every texture is its own image, viewed as sRGB at twice its index and as
+// linear after that. Partially bound, so only what materials index has to be
+// there.
+layout(binding = 10) uniform texture2D textures[];
+layout(binding = 11) uniform sampler textureSampler;
+
+// Indirect draws vary the material within a draw call
+vec4 tex(uint index) {
+  return texture(sampler2D(textures[nonuniformEXT(index * 2)], textureSampler),
+                 fragTexCoord);
+}
+vec4 data(uint index) {
+  return texture(
+      sampler2D(textures[nonuniformEXT(index * 2 + 1)], textureSampler),
+      fragTexCoord);
+}
@@ -0,0 +1,12 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "transform.glsl"
+
+// Only the position stream is bound
+layout(location = 0) in vec3 inPosition;
+
+void main() {
+  gl_Position = camera.proj * camera.eye * instanceMatrix() *
+                vec4(inPosition, 1);
+}
@@ -0,0 +1,24 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "transform.glsl"
+
+// The geometry heap's vertex streams, fetched here instead of by vertex
+// input. gl_VertexIndex already includes the draw's vertex offset.
+layout(binding = 8, std430) readonly buffer Positions { float positions[]; };
+// VertexAttributes in rendering.hpp: normal, texcoord, tangent
+const uint kAttributeFloats = 9;
+layout(binding = 9, std430) readonly buffer Attributes {
+  float attributes[];
+};
+
+void main() {
+  uint p = gl_VertexIndex * 3;
+  vec3 position = vec3(positions[p], positions[p + 1], positions[p + 2]);
+  uint a = gl_VertexIndex * kAttributeFloats;
+  vec3 normal = vec3(attributes[a], attributes[a + 1], attributes[a + 2]);
+  vec2 texCoord = vec2(attributes[a + 3], attributes[a + 4]);
+  vec4 tangent = vec4(attributes[a + 5], attributes[a + 6], attributes[a + 7],
+                      attributes[a + 8]);
+  transform(position, normal, tangent, texCoord);
+}
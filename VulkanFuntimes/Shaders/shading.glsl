@@ -0,0 +1,102 @@
+// Shared by the fragment shaders, which differ only in how textures are
+// bound. Included after #version.
+
+struct Material {
+  vec4 baseColorFactor;
+  uint baseColorTexture, normalTexture, metallicRoughnessTexture;
+  float metallicFactor, roughnessFactor;
+};
+
+// Set from the pipeline key, so variants compile out the sampling their
+// materials don't need. All true but kDoubleSided shades any material, by
+// checking for kNoTexture.
+layout(constant_id = 0) const bool kBaseColorTexture = true;
+layout(constant_id = 1) const bool kNormalTexture = true;
+layout(constant_id = 2) const bool kMetallicRoughnessTexture = true;
+layout(constant_id = 3) const bool kDoubleSided = false;
+
+const uint kNoTexture = 0xFFFFFFFF;
+
+layout(binding = 7, std430) readonly buffer Materials {
+  Material materials[];
+};
+
+layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) in vec3 fragNormal;
+layout(location = 3) in vec4 fragTangent;
+layout(location = 4) in vec3 fragView;
+layout(location = 5) flat in uint fragMaterial;
+
+layout(location = 0) out vec4 outColor;
+
+const float dielectricSpecular = 0.04;
+const float PI = 3.1415926535897932384626433832795;
+
+// Sample a texture by its index in the material, as sRGB colors or as linear
+// data. Defined by the shader that includes this, for how it binds textures.
+vec4 tex(uint index);
+vec4 data(uint index);
+
+vec3 tone(vec3 value, float exposure) {
+  return value/(value + exposure);
+}
+
+void main() {
+  Material material = materials[fragMaterial];
+  vec4 baseColor = material.baseColorFactor;
+  if (kBaseColorTexture && material.baseColorTexture != kNoTexture)
+    baseColor *= tex(material.baseColorTexture);
+  float metallic = material.metallicFactor;
+  float roughness = material.roughnessFactor;
+  if (kMetallicRoughnessTexture &&
+      material.metallicRoughnessTexture != kNoTexture) {
+    vec4 metallicRoughness = data(material.metallicRoughnessTexture);
+    metallic *= metallicRoughness.b;
+    roughness *= metallicRoughness.g;
+  }
+
+  vec3 normal;
+  if (kNormalTexture && material.normalTexture != kNoTexture) {
+    // Cooked normals only keep x and y, so z is always rebuilt
+    vec2 xy = data(material.normalTexture).rg * 2 - 1;
+    vec3 tnormal = vec3(xy, sqrt(max(1 - dot(xy, xy), 0)));
+    vec3 binormal = fragTangent.w * cross(fragNormal, fragTangent.xyz);
+    normal = normalize(tnormal.x * fragTangent.xyz + tnormal.y * binormal +
+                       tnormal.z * fragNormal);
+  } else {
+    normal = normalize(fragNormal);
+  }
+  if (kDoubleSided && !gl_FrontFacing) normal = -normal;
+
+  vec3 light = normalize(vec3(1, 1, 1));
+  float intensity = 100.;
+  vec3 view = normalize(fragView);
+  vec3 H = normalize(light + view);
+
+  float VdotN = max(dot(view, normal), 0.0);
+  float LdotN = max(dot(light, normal), 0.0);
+  float NdotH = max(dot(normal, H), 0.0);
+  float VdotH = max(dot(view, H), 1e-6);
+
+  vec3 f0 =
+      mix(vec3(dielectricSpecular), /*fresColor**/ baseColor.rgb, metallic);
+  vec3 F = f0 + (1 - f0) * pow(1 - VdotH, 5);
+  //  vec3 F = f0 + (max(vec3(1.0 - roughness), f0) - f0) * pow(1 - VdotH, 5);
+
+  vec3 color = baseColor.rgb * (1 - dielectricSpecular) * (1 - metallic);
+  vec3 diffuse = (1 - F) * color / PI;
+
+  float a = roughness * roughness;
+  float a2 = a * a;
+  float D = a2 / (PI * pow((a2 - 1) * NdotH * NdotH + 1, 2));
+
+  float k = a * sqrt(2 / PI);
+  float G = VdotN / (VdotN * (1 - k) + k) * LdotN / (LdotN * (1 - k) + k);
+
+  vec3 specular = F * D * G / (4 * VdotN * LdotN + 1e-6);
+
+  vec3 value = (diffuse + specular) * LdotN * intensity;
+  outColor.rgb = tone(value, 6);
+  // Only blended variants use it
+  outColor.a = baseColor.a;
+}
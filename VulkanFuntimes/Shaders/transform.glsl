@@ -0,0 +1,44 @@
+// Shared by the vertex shaders, which differ only in where their vertices
+// come from. Included after #version.
+
+layout(constant_id = 0) const bool kIndirect = false;
+
+layout(binding = 0) uniform Camera {
+  mat4 eye;
+  mat4 proj;
+}
+camera;
+struct DrawData {
+  uint model, material;
+};
+layout(binding = 5, std430) readonly buffer Draws { DrawData draws[]; };
+layout(binding = 6, std430) readonly buffer Models { mat4 models[]; };
+// Direct draws push their material
+layout(push_constant) uniform DrawConstants { uint material; }
+drawConstants;
+
+layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) out vec3 fragNormal;
+layout(location = 3) out vec4 fragTangent;
+layout(location = 4) out vec3 fragView;
+layout(location = 5) flat out uint fragMaterial;
+// The depth prepass and the shading pass after it have to agree exactly
+invariant gl_Position;
+
+mat4 instanceMatrix() {
+  // Direct draws index the instance matrices themselves
+  return models[kIndirect ? draws[gl_InstanceIndex].model : gl_InstanceIndex];
+}
+
+void transform(vec3 position, vec3 normal, vec4 tangent, vec2 texCoord) {
+  mat4 modelMatrix = instanceMatrix();
+  fragMaterial =
+      kIndirect ? draws[gl_InstanceIndex].material : drawConstants.material;
+
+  gl_Position = camera.proj * camera.eye * modelMatrix * vec4(position, 1);
+  fragNormal = (modelMatrix * vec4(normal, 0)).xyz;
+  fragTangent = vec4((modelMatrix * vec4(tangent.xyz, 0)).xyz, tangent.w);
+  vec4 eyeWorld = vec4(camera.eye[3].xyz, 0);
+  fragView = (modelMatrix * vec4(position, 1) - eyeWorld * camera.eye).xyz;
+  fragTexCoord = texCoord;
+}
@@ -0,0 +1,215 @@
+#include "animation.hpp"
+
+#include <algorithm>
+#include <cmath>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/type_ptr.hpp"
+#include "glm/geometric.hpp"
+
+namespace {
+
+struct Channel {
+  uint32_t target;
+  Animations::Path path;
+  Animations::Interpolation interpolation;
+  float duration;
+  std::vector<float> times, values;
+  // Channels are grouped by how they're sampled, so each pass of update runs
+  // over one contiguous range
+  int pass() const {
+    if (interpolation == Animations::Interpolation::kCubicSpline) return 2;
+    if (interpolation == Animations::Interpolation::kLinear &&
+        path == Animations::Path::kRotation)
+      return 1;
+    return 0;
+  }
+};
+
+}  // namespace
+
+Animations::Animations(const Gltf& gltf) {
+  std::vector<Channel> channels;
+  std::vector<uint32_t> nodeTarget(gltf.data_.nodes_size(), UINT32_MAX);
+  for (const gltf::Animation& animation : gltf.data_.animations()) {
+    size_t first = channels.size();
+    float duration = 0;
+    for (const gltf::Animation::Channel& channel : animation.channels()) {
+      Channel result;
+      switch (channel.target().path()) {
+        case gltf::Animation::Channel::Target::TRANSLATION:
+          result.path = Path::kTranslation;
+          break;
+        case gltf::Animation::Channel::Target::ROTATION:
+          result.path = Path::kRotation;
+          break;
+        case gltf::Animation::Channel::Target::SCALE:
+          result.path = Path::kScale;
+          break;
+        default:  // Morph target weights aren't supported
+          continue;
+      }
+      const gltf::Animation::Sampler& sampler =
+          animation.samplers(channel.sampler());
+      switch (sampler.interpolation()) {
+        case gltf::Animation::Sampler::STEP:
+          result.interpolation = Interpolation::kStep;
+          break;
+        case gltf::Animation::Sampler::CUBICSPLINE:
+          result.interpolation = Interpolation::kCubicSpline;
+          break;
+        default:
+          result.interpolation = Interpolation::kLinear;
+      }
+      result.times = gltf.readFloats(sampler.input());
+      result.values = gltf.readFloats(sampler.output());
+      if (result.times.empty()) continue;
+      duration = std::max(duration, result.times.back());
+
+      uint32_t node = channel.target().node();
+      if (nodeTarget[node] == UINT32_MAX) {
+        // Channels that don't cover every path keep the node's own values
+        nodeTarget[node] = static_cast<uint32_t>(node_.size());
+        node_.push_back(node);
+        const gltf::Node& data = gltf.data_.nodes(node);
+        translation_.push_back(data.translation_size() == 3
+                                   ? glm::make_vec3(data.translation().data())
+                                   : glm::vec3(0));
+        rotation_.push_back(data.rotation_size() == 4
+                                ? glm::make_quat(data.rotation().data())
+                                : glm::quat(1, 0, 0, 0));
+        scale_.push_back(data.scale_size() == 3
+                             ? glm::make_vec3(data.scale().data())
+                             : glm::vec3(1));
+      }
+      result.target = nodeTarget[node];
+      channels.push_back(std::move(result));
+    }
+    // Channels of an animation loop together
+    for (size_t i = first; i < channels.size(); ++i)
+      channels[i].duration = duration;
+  }
+  std::stable_sort(channels.begin(), channels.end(),
+                   [](const Channel& l, const Channel& r) {
+                     return l.pass() < r.pass();
+                   });
+
+  for (const Channel& channel : channels) {
+    target_.push_back(channel.target);
+    path_.push_back(channel.path);
+    interpolation_.push_back(channel.interpolation);
+    duration_.push_back(channel.duration);
+    firstKey_.push_back(static_cast<uint32_t>(times_.size()));
+    keyCount_.push_back(static_cast<uint32_t>(channel.times.size()));
+    times_.insert(times_.end(), channel.times.begin(), channel.times.end());
+    firstValue_.push_back(static_cast<uint32_t>(values_.size()));
+    size_t components = channel.path == Path::kRotation ? 4 : 3;
+    for (size_t i = 0; i + components <= channel.values.size();
+         i += components)
+      values_.emplace_back(channel.values[i], channel.values[i + 1],
+                           channel.values[i + 2],
+                           components == 4 ? channel.values[i + 3] : 0);
+  }
+  auto pass = [&](int pass) {
+    return static_cast<uint32_t>(
+        std::partition_point(channels.begin(), channels.end(),
+                             [&](const Channel& c) { return c.pass() < pass; }) -
+        channels.begin());
+  };
+  slerpBegin_ = pass(1);
+  cubicBegin_ = pass(2);
+  cursor_.resize(target_.size());
+  from_.resize(target_.size());
+  blend_.resize(target_.size());
+  sampled_.resize(target_.size());
+}
+
+void Animations::update(float seconds, Transforms& transforms) {
+  uint32_t channels = static_cast<uint32_t>(target_.size());
+  if (!channels) return;
+
+  // Find the keys around each channel's time, starting where the last frame
+  // left off
+  for (uint32_t c = 0; c < channels; ++c) {
+    const float* times = &times_[firstKey_[c]];
+    uint32_t count = keyCount_[c];
+    float time = duration_[c] > 0 ? std::fmod(seconds, duration_[c]) : 0;
+    uint32_t& cursor = cursor_[c];
+    if (time < times[cursor]) cursor = 0;  // Looped
+    while (cursor + 1 < count && times[cursor + 1] <= time) ++cursor;
+    from_[c] = cursor;
+    if (cursor + 1 >= count || time <= times[cursor] ||
+        interpolation_[c] == Interpolation::kStep)
+      blend_[c] = 0;
+    else
+      blend_[c] =
+          (time - times[cursor]) / (times[cursor + 1] - times[cursor]);
+  }
+
+  // Translations, scales and steps
+  for (uint32_t c = 0; c < slerpBegin_; ++c) {
+    uint32_t next = std::min(from_[c] + 1, keyCount_[c] - 1);
+    const glm::vec4& from = values_[firstValue_[c] + from_[c]];
+    const glm::vec4& to = values_[firstValue_[c] + next];
+#if defined(__SSE__)
+    __m128 a = _mm_loadu_ps(&from.x);
+    __m128 b = _mm_loadu_ps(&to.x);
+    __m128 blend = _mm_set1_ps(blend_[c]);
+    _mm_storeu_ps(&sampled_[c].x,
+                  _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), blend)));
+#else
+    sampled_[c] = from + (to - from) * blend_[c];
+#endif
+  }
+
+  // Linear rotations
+  for (uint32_t c = slerpBegin_; c < cubicBegin_; ++c) {
+    uint32_t next = std::min(from_[c] + 1, keyCount_[c] - 1);
+    const glm::vec4& from = values_[firstValue_[c] + from_[c]];
+    const glm::vec4& to = values_[firstValue_[c] + next];
+    glm::quat rotation =
+        glm::slerp(glm::quat(from.w, from.x, from.y, from.z),
+                   glm::quat(to.w, to.x, to.y, to.z), blend_[c]);
+    sampled_[c] = glm::vec4(rotation.x, rotation.y, rotation.z, rotation.w);
+  }
+
+  // Hermite splines between each key's value and tangents
+  for (uint32_t c = cubicBegin_; c < channels; ++c) {
+    uint32_t key = from_[c];
+    const glm::vec4* values = &values_[firstValue_[c]];
+    glm::vec4 result = values[key * 3 + 1];
+    if (key + 1 < keyCount_[c]) {
+      const float* times = &times_[firstKey_[c]];
+      float delta = times[key + 1] - times[key];
+      float s = blend_[c], s2 = s * s, s3 = s2 * s;
+      result = (2 * s3 - 3 * s2 + 1) * values[key * 3 + 1] +
+               (s3 - 2 * s2 + s) * delta * values[key * 3 + 2] +
+               (-2 * s3 + 3 * s2) * values[key * 3 + 4] +
+               (s3 - s2) * delta * values[key * 3 + 3];
+    }
+    if (path_[c] == Path::kRotation) result = glm::normalize(result);
+    sampled_[c] = result;
+  }
+
+  for (uint32_t c = 0; c < channels; ++c) {
+    const glm::vec4& value = sampled_[c];
+    switch (path_[c]) {
+      case Path::kTranslation:
+        translation_[target_[c]] = glm::vec3(value);
+        break;
+      case Path::kRotation:
+        rotation_[target_[c]] = glm::quat(value.w, value.x, value.y, value.z);
+        break;
+      case Path::kScale:
+        scale_[target_[c]] = glm::vec3(value);
+        break;
+    }
+  }
+  for (uint32_t i = 0; i < node_.size(); ++i)
+    transforms.setLocal(node_[i],
+                        glm::translate(glm::mat4(1), translation_[i]) *
+                            glm::mat4_cast(rotation_[i]) *
+                            glm::scale(glm::mat4(1), scale_[i]));
+}
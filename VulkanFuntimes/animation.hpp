@@ -0,0 +1,54 @@
+#ifndef animation_hpp
+#define animation_hpp
+
+#include <vector>
+#include "glm/gtc/quaternion.hpp"
+#include "glm/vec3.hpp"
+#include "glm/vec4.hpp"
+
+#include "gltf.hpp"
+#include "transforms.hpp"
+
+// Every channel of every animation in the gltf, sampled together each frame.
+// Keyframes are copied out of the gltf at load into shared arrays, and
+// everything per channel is in its own array.
+struct Animations {
+  enum class Path : uint8_t { kTranslation, kRotation, kScale };
+  enum class Interpolation : uint8_t { kLinear, kStep, kCubicSpline };
+
+  explicit Animations(const Gltf& gltf);
+  // Samples every channel at the time, each animation looping on its own,
+  // and sets the local matrices of the nodes they move
+  void update(float seconds, Transforms& transforms);
+
+  // Per channel
+  std::vector<uint32_t> target_;  // Into the animated nodes
+  std::vector<Path> path_;
+  std::vector<Interpolation> interpolation_;
+  // Channels are sorted into those that lerp, then linear rotations that
+  // slerp, then cubic splines
+  uint32_t slerpBegin_ = 0, cubicBegin_ = 0;
+  std::vector<uint32_t> firstKey_, keyCount_;
+  std::vector<float> duration_;  // Of the animation it's in
+  // The key before the last time sampled, so each lookup starts there
+  std::vector<uint32_t> cursor_;
+
+  // Shared by all channels. Cubic splines have three values per key: in
+  // tangent, value, out tangent.
+  std::vector<float> times_;
+  std::vector<uint32_t> firstValue_;  // Per channel, into values_
+  std::vector<glm::vec4> values_;
+
+  // Per animated node
+  std::vector<uint32_t> node_;
+  std::vector<glm::vec3> translation_, scale_;
+  std::vector<glm::quat> rotation_;
+
+ private:
+  // Per channel, filled in by the first pass of update
+  std::vector<uint32_t> from_;
+  std::vector<float> blend_;
+  std::vector<glm::vec4> sampled_;
+};
+
+#endif /* animation_hpp */
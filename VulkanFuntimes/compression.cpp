@@ -0,0 +1,622 @@
+#include "compression.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <thread>
+
+#include "driver.hpp"
+
+uint32_t mipLevels(vk::Extent3D extent) {
+  uint32_t levels = 1;
+  while (std::max(extent.width, extent.height) >> levels) ++levels;
+  return levels;
+}
+
+vk::Extent3D mipExtent(vk::Extent3D extent, uint32_t level) {
+  return {std::max(extent.width >> level, 1u),
+          std::max(extent.height >> level, 1u), 1};
+}
+
+std::vector<unsigned char> boxFilterMips(const Pixels &pixels, bool srgb,
+                                         uint32_t levels) {
+  static const std::array<float, 256> toLinear = [] {
+    std::array<float, 256> table;
+    for (int i = 0; i < 256; ++i) {
+      float c = i / 255.f;
+      table[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f,
+                                                       2.4f);
+    }
+    return table;
+  }();
+  // Fine enough that every sRGB value survives the round trip
+  constexpr uint32_t kEncodeSteps = 1 << 16;
+  static const std::vector<unsigned char> toSrgb = [] {
+    std::vector<unsigned char> table(kEncodeSteps);
+    for (uint32_t i = 0; i < kEncodeSteps; ++i) {
+      float l = i / float(kEncodeSteps - 1);
+      float c = l <= 0.0031308f ? l * 12.92f
+                                : 1.055f * std::pow(l, 1 / 2.4f) - 0.055f;
+      table[i] = static_cast<unsigned char>(c * 255 + 0.5f);
+    }
+    return table;
+  }();
+
+  vk::Extent3D extent = pixels.extent();
+  size_t size = 0;
+  for (uint32_t level = 1; level < levels; ++level)
+    size += mipExtent(extent, level).width * mipExtent(extent, level).height *
+            4;
+  std::vector<unsigned char> result(size);
+  const unsigned char *above = pixels.data_.get();
+  unsigned char *out = result.data();
+  for (uint32_t level = 1; level < levels; ++level) {
+    vk::Extent3D from = mipExtent(extent, level - 1);
+    vk::Extent3D to = mipExtent(extent, level);
+    for (uint32_t y = 0; y < to.height; ++y) {
+      const unsigned char *row0 = above + 2 * y * from.width * 4;
+      const unsigned char *row1 =
+          above + std::min(2 * y + 1, from.height - 1) * from.width * 4;
+      for (uint32_t x = 0; x < to.width; ++x) {
+        uint32_t x0 = 2 * x * 4, x1 = std::min(2 * x + 1, from.width - 1) * 4;
+        for (uint32_t c = 0; c < 4; ++c) {
+          // Alpha is coverage, which is already linear
+          if (srgb && c < 3) {
+            float sum = toLinear[row0[x0 + c]] + toLinear[row0[x1 + c]] +
+                        toLinear[row1[x0 + c]] + toLinear[row1[x1 + c]];
+            *out++ = toSrgb[static_cast<uint32_t>(sum / 4 *
+                                                      (kEncodeSteps - 1) +
+                                                  0.5f)];
+          } else {
+            *out++ = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] +
+                      row1[x1 + c] + 2) /
+                     4;
+          }
+        }
+      }
+    }
+    above = out - to.width * to.height * 4;
+  }
+  return result;
+}
+
+const BlockFormat &blockFormat(BlockFormatId id) {
+  using Compressed = gltf::Image::Compressed;
+  static const std::array<BlockFormat, 6> formats = {{
+      {Compressed::BC1, vk::Format::eBc1RgbSrgbBlock,
+       vk::Format::eBc1RgbUnormBlock, 8},
+      {Compressed::BC5, vk::Format::eBc5UnormBlock,
+       vk::Format::eBc5UnormBlock, 16},
+      {Compressed::BC7, vk::Format::eBc7SrgbBlock, vk::Format::eBc7UnormBlock,
+       16},
+      {Compressed::ETC2_RGB, vk::Format::eEtc2R8G8B8SrgbBlock,
+       vk::Format::eEtc2R8G8B8UnormBlock, 8},
+      {Compressed::ETC2_RGBA, vk::Format::eEtc2R8G8B8A8SrgbBlock,
+       vk::Format::eEtc2R8G8B8A8UnormBlock, 16},
+      {Compressed::EAC_RG, vk::Format::eEacR11G11UnormBlock,
+       vk::Format::eEacR11G11UnormBlock, 16},
+  }};
+  for (const BlockFormat &format : formats)
+    if (format.id == id) return format;
+  throw std::runtime_error("Unknown block format");
+}
+
+bool blockFormatSupported(BlockFormatId id) {
+  using Compressed = gltf::Image::Compressed;
+  bool bc = id == Compressed::BC1 || id == Compressed::BC5 ||
+            id == Compressed::BC7;
+  if (!(bc ? gEnabledFeatures.textureCompressionBC
+           : gEnabledFeatures.textureCompressionETC2))
+    return false;
+  const BlockFormat &format = blockFormat(id);
+  vk::FormatFeatureFlags needed =
+      vk::FormatFeatureFlagBits::eSampledImage |
+      vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+  for (vk::Format view : {format.srgb, format.unorm})
+    if ((gPhysicalDevice.getFormatProperties(view).optimalTilingFeatures &
+         needed) != needed)
+      return false;
+  return true;
+}
+
+vk::DeviceSize blockLevelSize(const BlockFormat &format, vk::Extent3D extent) {
+  return vk::DeviceSize((extent.width + 3) / 4) * ((extent.height + 3) / 4) *
+         format.blockBytes;
+}
+
+std::optional<BlockImage> readKtx2(const std::vector<char> &file) {
+  static constexpr unsigned char kIdentifier[12] = {
+      0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+  // The identifier, header and index, up to the level index
+  constexpr size_t kLevelIndex = 80;
+  if (file.size() < kLevelIndex ||
+      std::memcmp(file.data(), kIdentifier, sizeof(kIdentifier)))
+    throw std::runtime_error("Not a KTX2 file");
+  std::array<uint32_t, 9> header;
+  std::memcpy(header.data(), file.data() + sizeof(kIdentifier),
+              sizeof(header));
+  auto [vkFormat, typeSize, width, height, depth, layers, faces, levelCount,
+        supercompression] = header;
+  if (depth > 1 || layers > 1 || faces != 1)
+    throw std::runtime_error("KTX2 arrays, cubes and volumes aren't supported");
+  if (supercompression != 0) return std::nullopt;
+
+  using Compressed = gltf::Image::Compressed;
+  const BlockFormat *format = nullptr;
+  for (BlockFormatId id :
+       {Compressed::BC1, Compressed::BC5, Compressed::BC7,
+        Compressed::ETC2_RGB, Compressed::ETC2_RGBA, Compressed::EAC_RG}) {
+    const BlockFormat &candidate = blockFormat(id);
+    if (vk::Format(vkFormat) == candidate.srgb ||
+        vk::Format(vkFormat) == candidate.unorm)
+      format = &candidate;
+  }
+  if (!format || !blockFormatSupported(format->id)) return std::nullopt;
+
+  // 0 asks for mips to be made at load, which blocks can't be blitted into
+  uint32_t levels = std::max(levelCount, 1u);
+  if (file.size() < kLevelIndex + levels * 3 * sizeof(uint64_t))
+    throw std::runtime_error("KTX2 level index is truncated");
+  BlockImage result{format, {width, height, 1}, levels, {}};
+  for (uint32_t level = 0; level < levels; ++level) {
+    // Offset, length and uncompressed length, largest level first
+    std::array<uint64_t, 3> entry;
+    std::memcpy(entry.data(),
+                file.data() + kLevelIndex + level * sizeof(entry),
+                sizeof(entry));
+    if (entry[1] != blockLevelSize(*format, mipExtent(result.extent, level)) ||
+        entry[0] + entry[1] > file.size())
+      throw std::runtime_error("KTX2 level is the wrong size");
+    result.blocks.insert(result.blocks.end(), file.begin() + entry[0],
+                         file.begin() + entry[0] + entry[1]);
+  }
+  return result;
+}
+
+std::vector<BlockFormatId> cookFormats(ImageRole role, const Pixels &pixels) {
+  using Compressed = gltf::Image::Compressed;
+  if (role == ImageRole::kNormal) return {Compressed::BC5, Compressed::EAC_RG};
+  if (role == ImageRole::kData) return {Compressed::BC7, Compressed::ETC2_RGB};
+  const unsigned char *data = pixels.data_.get();
+  bool opaque = true;
+  for (size_t i = 3; i < pixels.size() && opaque; i += 4)
+    opaque = data[i] == 255;
+  if (opaque) return {Compressed::BC1, Compressed::ETC2_RGB};
+  return {Compressed::BC7, Compressed::ETC2_RGBA};
+}
+
+namespace {
+// 4x4 texels, row by row, with the image's last row and column repeated past
+// its edges
+using Block = std::array<std::array<uint8_t, 4>, 16>;
+
+Block readBlock(const unsigned char *level, vk::Extent3D extent, uint32_t bx,
+                uint32_t by) {
+  Block block;
+  for (uint32_t y = 0; y < 4; ++y) {
+    uint32_t sy = std::min(by * 4 + y, extent.height - 1);
+    for (uint32_t x = 0; x < 4; ++x) {
+      uint32_t sx = std::min(bx * 4 + x, extent.width - 1);
+      std::copy_n(level + (sy * extent.width + sx) * 4, 4,
+                  block[y * 4 + x].data());
+    }
+  }
+  return block;
+}
+
+// The ends of the block's first N channels along their principal axis, low
+// then high, which the block's palette is interpolated between
+template <int N>
+std::pair<std::array<float, N>, std::array<float, N>> principalEndpoints(
+    const Block &block) {
+  std::array<float, N> mean{};
+  for (const auto &texel : block)
+    for (int c = 0; c < N; ++c) mean[c] += texel[c] / 16.f;
+  std::array<std::array<float, N>, N> covariance{};
+  for (const auto &texel : block)
+    for (int i = 0; i < N; ++i)
+      for (int j = 0; j < N; ++j)
+        covariance[i][j] += (texel[i] - mean[i]) * (texel[j] - mean[j]);
+
+  // Power iteration converges quickly enough for 16 texels. Starts from the
+  // most varied channel's row, which is rarely orthogonal to the axis.
+  int widest = 0;
+  for (int i = 1; i < N; ++i)
+    if (covariance[i][i] > covariance[widest][widest]) widest = i;
+  std::array<float, N> axis = covariance[widest];
+  for (int iteration = 0; iteration < 8; ++iteration) {
+    std::array<float, N> next{};
+    for (int i = 0; i < N; ++i)
+      for (int j = 0; j < N; ++j) next[i] += covariance[i][j] * axis[j];
+    float length = 0;
+    for (float v : next) length += v * v;
+    length = std::sqrt(length);
+    // Every texel is the same
+    if (length < 1e-6f) return {mean, mean};
+    for (int i = 0; i < N; ++i) axis[i] = next[i] / length;
+  }
+
+  float low = INFINITY, high = -INFINITY;
+  for (const auto &texel : block) {
+    float t = 0;
+    for (int c = 0; c < N; ++c) t += (texel[c] - mean[c]) * axis[c];
+    low = std::min(low, t);
+    high = std::max(high, t);
+  }
+  std::array<float, N> lowEnd, highEnd;
+  for (int c = 0; c < N; ++c) {
+    lowEnd[c] = std::clamp(mean[c] + axis[c] * low, 0.f, 255.f);
+    highEnd[c] = std::clamp(mean[c] + axis[c] * high, 0.f, 255.f);
+  }
+  return {lowEnd, highEnd};
+}
+
+template <int N>
+int nearest(const std::array<uint8_t, 4> &texel,
+            const std::array<int, 4> *palette, int count) {
+  int best = 0, bestError = INT32_MAX;
+  for (int i = 0; i < count; ++i) {
+    int error = 0;
+    for (int c = 0; c < N; ++c)
+      error += (texel[c] - palette[i][c]) * (texel[c] - palette[i][c]);
+    if (error < bestError) {
+      best = i;
+      bestError = error;
+    }
+  }
+  return best;
+}
+
+void storeLittleEndian(uint64_t value, int bytes, uint8_t *out) {
+  for (int i = 0; i < bytes; ++i) out[i] = uint8_t(value >> (8 * i));
+}
+void storeBigEndian(uint64_t value, uint8_t *out) {
+  for (int i = 0; i < 8; ++i) out[i] = uint8_t(value >> (56 - 8 * i));
+}
+
+uint16_t to565(const std::array<float, 3> &color) {
+  auto quantize = [](float value, int max) {
+    return std::clamp(int(std::lround(value * max / 255)), 0, max);
+  };
+  return uint16_t(quantize(color[0], 31) << 11 | quantize(color[1], 63) << 5 |
+                  quantize(color[2], 31));
+}
+std::array<int, 4> from565(uint16_t color) {
+  int r = color >> 11, g = (color >> 5) & 63, b = color & 31;
+  return {r << 3 | r >> 2, g << 2 | g >> 4, b << 3 | b >> 2, 255};
+}
+
+void encodeBc1(const Block &block, uint8_t *out) {
+  auto [low, high] = principalEndpoints<3>(block);
+  uint16_t color0 = to565(high), color1 = to565(low);
+  // Only color0 > color1 has four colors
+  if (color0 < color1) std::swap(color0, color1);
+  uint32_t indices = 0;
+  if (color0 != color1) {
+    std::array<int, 4> palette[4] = {from565(color0), from565(color1)};
+    for (int c = 0; c < 3; ++c) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+    for (int i = 0; i < 16; ++i)
+      indices |= uint32_t(nearest<3>(block[i], palette, 4)) << (2 * i);
+  }
+  storeLittleEndian(color0, 2, out);
+  storeLittleEndian(color1, 2, out + 2);
+  storeLittleEndian(indices, 4, out + 4);
+}
+
+// One channel, in the eight value mode
+void encodeBc4(const Block &block, int channel, uint8_t *out) {
+  int high = 0, low = 255;
+  for (const auto &texel : block) {
+    high = std::max<int>(high, texel[channel]);
+    low = std::min<int>(low, texel[channel]);
+  }
+  uint64_t indices = 0;
+  if (high != low) {
+    std::array<int, 4> palette[8] = {{high}, {low}};
+    for (int i = 2; i < 8; ++i)
+      palette[i][0] = ((8 - i) * high + (i - 1) * low) / 7;
+    for (int i = 0; i < 16; ++i) {
+      std::array<uint8_t, 4> value = {block[i][channel]};
+      indices |= uint64_t(nearest<1>(value, palette, 8)) << (3 * i);
+    }
+  }
+  out[0] = uint8_t(high);
+  out[1] = uint8_t(low);
+  storeLittleEndian(indices, 6, out + 2);
+}
+
+void encodeBc5(const Block &block, uint8_t *out) {
+  encodeBc4(block, 0, out);
+  encodeBc4(block, 1, out + 8);
+}
+
+// Least significant bit first
+struct BitWriter {
+  uint8_t *out;
+  int position = 0;
+  void write(uint32_t value, int bits) {
+    for (int i = 0; i < bits; ++i, ++position)
+      if (value >> i & 1) out[position / 8] |= uint8_t(1 << position % 8);
+  }
+};
+
+// Only mode 6: one subset of RGBA endpoints with 7 bits and a shared low
+// bit each, and 4 bit indices. Plenty for smooth color and data.
+void encodeBc7(const Block &block, uint8_t *out) {
+  auto [low, high] = principalEndpoints<4>(block);
+  auto quantize = [](const std::array<float, 4> &end,
+                     std::array<int, 4> &bits, int &pBit) {
+    float bestError = INFINITY;
+    for (int p = 0; p < 2; ++p) {
+      std::array<int, 4> q;
+      float error = 0;
+      for (int c = 0; c < 4; ++c) {
+        q[c] = std::clamp(int(std::lround((end[c] - p) / 2)), 0, 127);
+        float decoded = q[c] * 2 + p;
+        error += (decoded - end[c]) * (decoded - end[c]);
+      }
+      if (error < bestError) {
+        bestError = error;
+        bits = q;
+        pBit = p;
+      }
+    }
+  };
+  std::array<int, 4> bits0, bits1;
+  int p0, p1;
+  quantize(low, bits0, p0);
+  quantize(high, bits1, p1);
+
+  static constexpr int kWeights[16] = {0,  4,  9,  13, 17, 21, 26, 30,
+                                       34, 38, 43, 47, 51, 55, 60, 64};
+  std::array<int, 4> palette[16];
+  for (int i = 0; i < 16; ++i)
+    for (int c = 0; c < 4; ++c)
+      palette[i][c] = ((64 - kWeights[i]) * (bits0[c] * 2 + p0) +
+                       kWeights[i] * (bits1[c] * 2 + p1) + 32) >>
+                      6;
+  std::array<int, 16> indices;
+  for (int i = 0; i < 16; ++i) indices[i] = nearest<4>(block[i], palette, 16);
+  // The first index has no top bit, so it has to be in the lower half
+  if (indices[0] & 8) {
+    std::swap(bits0, bits1);
+    std::swap(p0, p1);
+    for (int &index : indices) index = 15 - index;
+  }
+
+  std::fill_n(out, 16, 0);
+  BitWriter writer{out};
+  writer.write(1 << 6, 7);
+  for (int c = 0; c < 4; ++c) {
+    writer.write(bits0[c], 7);
+    writer.write(bits1[c], 7);
+  }
+  writer.write(p0, 1);
+  writer.write(p1, 1);
+  writer.write(indices[0], 3);
+  for (int i = 1; i < 16; ++i) writer.write(indices[i], 4);
+}
+
+// ETC texels are numbered column by column
+int etcTexel(int index) { return index % 4 * 4 + index / 4; }
+
+// Only the ETC1 individual and differential modes, and never a differential
+// that overflows, which ETC2 would read as one of its other modes
+void encodeEtc2Rgb(const Block &block, uint8_t *out) {
+  static constexpr int kModifiers[8][2] = {{2, 8},   {5, 17},  {9, 29},
+                                           {13, 42}, {18, 60}, {24, 80},
+                                           {33, 106}, {47, 183}};
+  uint64_t best = 0, bestError = UINT64_MAX;
+  for (int flip = 0; flip < 2; ++flip) {
+    // Side by side 2x4 halves, or flipped to 4x2 ones on top of each other
+    auto half = [flip](int index) {
+      int x = index / 4, y = index % 4;
+      return flip ? y >= 2 : x >= 2;
+    };
+    std::array<float, 3> average[2] = {};
+    for (int index = 0; index < 16; ++index)
+      for (int c = 0; c < 3; ++c)
+        average[half(index)][c] += block[etcTexel(index)][c] / 8.f;
+
+    for (int differential = 1; differential >= 0; --differential) {
+      int max = differential ? 31 : 15;
+      std::array<int, 3> base[2], color[2];
+      bool fits = true;
+      for (int h = 0; h < 2; ++h)
+        for (int c = 0; c < 3; ++c) {
+          base[h][c] =
+              std::clamp(int(std::lround(average[h][c] * max / 255)), 0, max);
+          color[h][c] = differential ? base[h][c] << 3 | base[h][c] >> 2
+                                     : base[h][c] << 4 | base[h][c];
+        }
+      for (int c = 0; c < 3 && differential; ++c)
+        fits = fits && base[1][c] - base[0][c] >= -4 &&
+               base[1][c] - base[0][c] <= 3;
+      if (!fits) continue;
+
+      uint64_t error = 0;
+      uint32_t table[2], msb[2], lsb[2];
+      for (int h = 0; h < 2; ++h) {
+        uint64_t bestTableError = UINT64_MAX;
+        for (int t = 0; t < 8; ++t) {
+          const int modifiers[4] = {kModifiers[t][0], kModifiers[t][1],
+                                    -kModifiers[t][0], -kModifiers[t][1]};
+          uint64_t tableError = 0;
+          uint32_t tableMsb = 0, tableLsb = 0;
+          for (int index = 0; index < 16; ++index) {
+            if (half(index) != h) continue;
+            const auto &texel = block[etcTexel(index)];
+            int bestModifier = 0, bestModifierError = INT32_MAX;
+            for (int m = 0; m < 4; ++m) {
+              int modifierError = 0;
+              for (int c = 0; c < 3; ++c) {
+                int d = std::clamp(color[h][c] + modifiers[m], 0, 255) -
+                        texel[c];
+                modifierError += d * d;
+              }
+              if (modifierError < bestModifierError) {
+                bestModifier = m;
+                bestModifierError = modifierError;
+              }
+            }
+            tableError += bestModifierError;
+            tableMsb |= uint32_t(bestModifier >> 1) << index;
+            tableLsb |= uint32_t(bestModifier & 1) << index;
+          }
+          if (tableError < bestTableError) {
+            bestTableError = tableError;
+            table[h] = t;
+            msb[h] = tableMsb;
+            lsb[h] = tableLsb;
+          }
+        }
+        error += bestTableError;
+      }
+      if (error >= bestError) continue;
+
+      uint64_t bits = 0;
+      for (int c = 0; c < 3; ++c) {
+        int shift = 59 - 8 * c;
+        if (differential)
+          bits |= uint64_t(base[0][c]) << shift |
+                  uint64_t((base[1][c] - base[0][c]) & 7) << (shift - 3);
+        else
+          bits |= uint64_t(base[0][c]) << (shift + 1) |
+                  uint64_t(base[1][c]) << (shift - 3);
+      }
+      bits |= uint64_t(table[0]) << 37 | uint64_t(table[1]) << 34 |
+              uint64_t(differential) << 33 | uint64_t(flip) << 32 |
+              uint64_t(msb[0] | msb[1]) << 16 | lsb[0] | lsb[1];
+      best = bits;
+      bestError = error;
+    }
+  }
+  storeBigEndian(best, out);
+}
+
+// One channel of 8 bit values, as EAC alpha or, with eleven, as EAC R11
+void encodeEac(const Block &block, int channel, bool eleven, uint8_t *out) {
+  static constexpr int kModifiers[16][8] = {
+      {-3, -6, -9, -15, 2, 5, 8, 14}, {-3, -7, -10, -13, 2, 6, 9, 12},
+      {-2, -5, -8, -13, 1, 4, 7, 12}, {-2, -4, -6, -13, 1, 3, 5, 12},
+      {-3, -6, -8, -12, 2, 5, 7, 11}, {-3, -7, -9, -11, 2, 6, 8, 10},
+      {-4, -7, -8, -11, 3, 6, 7, 10}, {-3, -5, -8, -11, 2, 4, 7, 10},
+      {-2, -6, -8, -10, 1, 5, 7, 9},  {-2, -5, -8, -10, 1, 4, 7, 9},
+      {-2, -4, -8, -10, 1, 3, 7, 9},  {-2, -5, -7, -10, 1, 4, 6, 9},
+      {-3, -4, -7, -10, 2, 3, 6, 9},  {-1, -2, -3, -10, 0, 1, 2, 9},
+      {-4, -6, -8, -9, 3, 5, 7, 8},   {-3, -5, -7, -9, 2, 4, 6, 8}};
+  // Compared at the decoded precision
+  auto target = [&](int index) {
+    int value = block[etcTexel(index)][channel];
+    return eleven ? value * 2047 / 255 : value;
+  };
+  auto decode = [eleven](int base, int multiplier, int modifier) {
+    return eleven ? std::clamp(base * 8 + 4 + modifier * multiplier * 8, 0,
+                               2047)
+                  : std::clamp(base + modifier * multiplier, 0, 255);
+  };
+  int low = 255, high = 0;
+  for (const auto &texel : block) {
+    low = std::min<int>(low, texel[channel]);
+    high = std::max<int>(high, texel[channel]);
+  }
+
+  uint64_t best = 0;
+  int bestError = INT32_MAX;
+  for (int t = 0; t < 16; ++t) {
+    const int *modifiers = kModifiers[t];
+    int spread = modifiers[7] - modifiers[3];
+    int multiplier = std::clamp((high - low + spread - 1) / spread, 1, 15);
+    int centered = std::clamp(low - modifiers[3] * multiplier, 0, 255);
+    for (int base = std::max(centered - 1, 0);
+         base <= std::min(centered + 1, 255); ++base) {
+      int error = 0;
+      uint64_t indices = 0;
+      for (int index = 0; index < 16; ++index) {
+        int bestModifier = 0, bestModifierError = INT32_MAX;
+        for (int m = 0; m < 8; ++m) {
+          int d = decode(base, multiplier, modifiers[m]) - target(index);
+          if (d * d < bestModifierError) {
+            bestModifier = m;
+            bestModifierError = d * d;
+          }
+        }
+        error += bestModifierError;
+        indices |= uint64_t(bestModifier) << (45 - 3 * index);
+      }
+      if (error < bestError) {
+        bestError = error;
+        best = uint64_t(base) << 56 | uint64_t(multiplier) << 52 |
+               uint64_t(t) << 48 | indices;
+      }
+    }
+  }
+  storeBigEndian(best, out);
+}
+
+void encodeBlock(BlockFormatId format, const Block &block, uint8_t *out) {
+  using Compressed = gltf::Image::Compressed;
+  switch (format) {
+    case Compressed::BC1:
+      return encodeBc1(block, out);
+    case Compressed::BC5:
+      return encodeBc5(block, out);
+    case Compressed::BC7:
+      return encodeBc7(block, out);
+    case Compressed::ETC2_RGB:
+      return encodeEtc2Rgb(block, out);
+    case Compressed::ETC2_RGBA:
+      encodeEac(block, 3, /*eleven=*/false, out);
+      return encodeEtc2Rgb(block, out + 8);
+    case Compressed::EAC_RG:
+      encodeEac(block, 0, /*eleven=*/true, out);
+      return encodeEac(block, 1, /*eleven=*/true, out + 8);
+    default:
+      throw std::runtime_error("Unknown block format");
+  }
+}
+}  // namespace
+
+std::vector<char> compressImage(const Pixels &pixels, ImageRole role,
+                                BlockFormatId format) {
+  const BlockFormat &blocks = blockFormat(format);
+  vk::Extent3D extent = pixels.extent();
+  uint32_t levels = mipLevels(extent);
+  std::vector<unsigned char> mips =
+      boxFilterMips(pixels, role == ImageRole::kColor, levels);
+  vk::DeviceSize size = 0;
+  for (uint32_t level = 0; level < levels; ++level)
+    size += blockLevelSize(blocks, mipExtent(extent, level));
+  std::vector<char> result(size);
+
+  const unsigned char *texels = pixels.data_.get();
+  auto *out = (uint8_t *)result.data();
+  uint32_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+  for (uint32_t level = 0; level < levels; ++level) {
+    vk::Extent3D levelExtent = mipExtent(extent, level);
+    uint32_t width = (levelExtent.width + 3) / 4;
+    uint32_t height = (levelExtent.height + 3) / 4;
+    // Rows of blocks are encoded in parallel
+    uint32_t rowsEach = (height + threads - 1) / threads;
+    std::vector<std::future<void>> encoding;
+    for (uint32_t first = 0; first < height; first += rowsEach)
+      encoding.push_back(std::async(std::launch::async, [&, first] {
+        for (uint32_t by = first; by < std::min(first + rowsEach, height);
+             ++by)
+          for (uint32_t bx = 0; bx < width; ++bx)
+            encodeBlock(format, readBlock(texels, levelExtent, bx, by),
+                        out + (by * width + bx) * blocks.blockBytes);
+      }));
+    for (std::future<void> &rows : encoding) rows.get();
+
+    out += blockLevelSize(blocks, levelExtent);
+    texels = level == 0 ? mips.data()
+                        : texels + levelExtent.width * levelExtent.height * 4;
+  }
+  return result;
+}
@@ -0,0 +1,61 @@
+#ifndef compression_hpp
+#define compression_hpp
+
+#include <optional>
+#include <vector>
+#include "vulkan/vulkan.hpp"
+
+#include "gltf.hpp"
+
+// Mip chains and block compression for textures. The cooker compresses, and
+// mips are also made here at load for images that weren't cooked. KTX2 files
+// are read here too.
+
+uint32_t mipLevels(vk::Extent3D extent);
+vk::Extent3D mipExtent(vk::Extent3D extent, uint32_t level);
+
+// Levels after the first, packed one after the other. Each level is a 2x2
+// box filter of the one above, with the last row and column repeated when
+// it's odd. Colors are averaged in linear light, and data as it is.
+std::vector<unsigned char> boxFilterMips(const Pixels& pixels, bool srgb,
+                                         uint32_t levels);
+
+using BlockFormatId = gltf::Image::Compressed::Format;
+struct BlockFormat {
+  BlockFormatId id;
+  // The same for formats that are only data
+  vk::Format srgb, unorm;
+  uint32_t blockBytes;  // Per 4x4 texels
+};
+const BlockFormat& blockFormat(BlockFormatId id);
+// Whether the device can sample it, with the feature its family needs
+bool blockFormatSupported(BlockFormatId id);
+vk::DeviceSize blockLevelSize(const BlockFormat& format, vk::Extent3D extent);
+
+// A cooked image as it's read from the file, see Textures::add
+struct BlockImage {
+  const BlockFormat* format;
+  vk::Extent3D extent;
+  uint32_t levels;
+  std::vector<char> blocks;
+};
+
+// Its levels, packed like a cooked image, if it holds raw blocks in one of
+// the block formats and the device supports it. There's no Basis Universal
+// transcoder, so the BasisLZ and UASTC payloads KHR_texture_basisu asks for
+// are nullopt, as are zstd and zlib supercompressed files and any other
+// format. Throws if the file isn't a 2D KTX2 texture.
+std::optional<BlockImage> readKtx2(const std::vector<char>& file);
+
+// What the cooker writes for an image, best first: a BC format for desktop
+// GPUs and an ETC2 one for mobile ones. Color is BC1 or ETC2 RGB when it's
+// opaque, and BC7 or ETC2 RGBA when it isn't. Normals only keep x and y, in
+// BC5 or EAC RG. Data is BC7 or ETC2 RGB.
+std::vector<BlockFormatId> cookFormats(ImageRole role, const Pixels& pixels);
+
+// Every mip level of the pixels, mips filtered with boxFilterMips and each
+// level compressed in 4x4 blocks, packed like Image.Compressed
+std::vector<char> compressImage(const Pixels& pixels, ImageRole role,
+                                BlockFormatId format);
+
+#endif /* compression_hpp */
@@ -0,0 +1,488 @@
+#include "culling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "glm/common.hpp"
+#include "glm/geometric.hpp"
+
+#include "util.hpp"
+#include "driver.hpp"
+#include "swapchain.hpp"
+
+bool compactDraws() {
+  return gCmdDrawIndexedIndirectCount && gEnabledFeatures.multiDrawIndirect;
+}
+
+vk::Pipeline makeComputePipeline(const std::string& filename,
+                                 vk::PipelineLayout layout) {
+  vk::ShaderModule shader = readShader(filename);
+  vk::ResultValue<std::vector<vk::Pipeline>> pipelines_or =
+      gDevice.createComputePipelines(
+          gPipelineCache,
+          {{/*flags=*/{},
+            {/*flags=*/{}, vk::ShaderStageFlagBits::eCompute, shader,
+             /*pName=*/"main"},
+            layout}});
+  gDevice.destroy(shader);
+
+  throwFail("vkCreateComputePipelines", pipelines_or.result);
+  if (pipelines_or.value.empty())
+    throw std::runtime_error("No pipeline returned???");
+  return pipelines_or.value[0];
+}
+
+GpuCulling::GpuCulling(const IndirectDraws& draws,
+                       const DescriptorPool& descriptorPool)
+    : draws_(draws), descriptorPool_(descriptorPool) {
+  // Pyramid texels are read individually
+  vk::SamplerCreateInfo samplerCreate(
+      /*flags=*/{}, vk::Filter::eNearest, vk::Filter::eNearest,
+      vk::SamplerMipmapMode::eNearest, vk::SamplerAddressMode::eClampToEdge,
+      vk::SamplerAddressMode::eClampToEdge,
+      vk::SamplerAddressMode::eClampToEdge);
+  samplerCreate.setMaxLod(VK_LOD_CLAMP_NONE);
+  sampler_ = gDevice.createSampler(samplerCreate);
+
+  auto storage = [](uint32_t binding) {
+    return vk::DescriptorSetLayoutBinding(
+        binding, vk::DescriptorType::eStorageBuffer,
+        /*descriptorCount=*/1, vk::ShaderStageFlagBits::eCompute,
+        /*immutableSamplers=*/nullptr);
+  };
+  std::initializer_list<vk::DescriptorSetLayoutBinding> cullBindings = {
+      {/*binding=*/0, vk::DescriptorType::eUniformBuffer,
+       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eCompute,
+       /*immutableSamplers=*/nullptr},
+      storage(1),  // commands
+      storage(2),  // bounds
+      storage(3),  // draw data
+      storage(4),  // models
+      storage(5),  // culled commands
+      storage(6),  // culled count
+      storage(7),  // visibility
+      {/*binding=*/8, vk::DescriptorType::eCombinedImageSampler,
+       vk::ShaderStageFlagBits::eCompute, /*immutableSamplers=*/sampler_},
+      storage(9),  // runs
+  };
+  cullSetLayout_ =
+      gDevice.createDescriptorSetLayout({/*flags=*/{}, cullBindings});
+  std::initializer_list<vk::DescriptorSetLayoutBinding> reduceBindings = {
+      {/*binding=*/0, vk::DescriptorType::eCombinedImageSampler,
+       vk::ShaderStageFlagBits::eCompute, /*immutableSamplers=*/sampler_},
+      {/*binding=*/1, vk::DescriptorType::eStorageImage,
+       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eCompute,
+       /*immutableSamplers=*/nullptr},
+  };
+  reduceSetLayout_ =
+      gDevice.createDescriptorSetLayout({/*flags=*/{}, reduceBindings});
+
+  vk::PushConstantRange cullConstants(vk::ShaderStageFlagBits::eCompute,
+                                      /*offset=*/0, sizeof(CullConstants));
+  cullLayout_ = gDevice.createPipelineLayout(
+      {/*flags=*/{}, cullSetLayout_, cullConstants});
+  // srcSize, dstSize, srcLod
+  vk::PushConstantRange reduceConstants(vk::ShaderStageFlagBits::eCompute,
+                                        /*offset=*/0, 5 * sizeof(int32_t));
+  reduceLayout_ = gDevice.createPipelineLayout(
+      {/*flags=*/{}, reduceSetLayout_, reduceConstants});
+
+  cullPipeline_ = makeComputePipeline("cull.comp", cullLayout_);
+  reducePipeline_ = makeComputePipeline("depthreduce.comp", reduceLayout_);
+
+  resizeToSwapchain();
+}
+
+uint32_t previousPow2(uint32_t v) {
+  uint32_t result = 1;
+  while (result * 2 <= v) result *= 2;
+  return result;
+}
+
+void GpuCulling::resizeToSwapchain() {
+  if (pyramid_)
+    retire([pyramid = pyramid_, memory = pyramidMemory_, view = pyramidView_,
+            levelViews = std::move(levelViews_), pool = pool_] {
+      for (vk::ImageView levelView : levelViews) gDevice.destroy(levelView);
+      gDevice.destroy(view);
+      gDevice.destroy(pool);
+      gDevice.destroy(pyramid);
+      gDevice.free(memory);
+    });
+  levelViews_.clear();
+  reduceSets_.clear();
+  pyramidInitialized_ = false;
+
+  // Power of two sizes so every level halves exactly
+  pyramidExtent_ = vk::Extent2D(previousPow2(gSwapchainExtent.width),
+                                previousPow2(gSwapchainExtent.height));
+  pyramidLevels_ = 1;
+  while ((std::max(pyramidExtent_.width, pyramidExtent_.height) >>
+          pyramidLevels_) > 0)
+    ++pyramidLevels_;
+
+  pyramid_ = gDevice.createImage(
+      {/*flags=*/{}, vk::ImageType::e2D, vk::Format::eR32Sfloat,
+       vk::Extent3D(pyramidExtent_, 1), pyramidLevels_, /*arrayLayers=*/1,
+       vk::SampleCountFlagBits::e1, vk::ImageTiling::eOptimal,
+       vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled,
+       vk::SharingMode::eExclusive, /*queueFamilyIndices=*/{}});
+  vk::MemoryRequirements requirements =
+      gDevice.getImageMemoryRequirements(pyramid_);
+  pyramidMemory_ = gDevice.allocateMemory(
+      {requirements.size,
+       getMemoryFor(requirements, vk::MemoryPropertyFlagBits::eDeviceLocal)});
+  gDevice.bindImageMemory(pyramid_, pyramidMemory_, /*offset=*/0);
+
+  vk::ImageSubresourceRange wholeImage(vk::ImageAspectFlagBits::eColor,
+                                       /*baseMip=*/0, pyramidLevels_,
+                                       /*baseLayer=*/0, /*layerCount=*/1);
+  pyramidView_ = gDevice.createImageView(
+      {/*flags=*/{}, pyramid_, vk::ImageViewType::e2D, vk::Format::eR32Sfloat,
+       /*componentMapping=*/{}, wholeImage});
+  for (uint32_t level = 0; level < pyramidLevels_; ++level) {
+    vk::ImageSubresourceRange oneLevel(vk::ImageAspectFlagBits::eColor, level,
+                                       /*levelCount=*/1, /*baseLayer=*/0,
+                                       /*layerCount=*/1);
+    levelViews_.push_back(gDevice.createImageView(
+        {/*flags=*/{}, pyramid_, vk::ImageViewType::e2D,
+         vk::Format::eR32Sfloat, /*componentMapping=*/{}, oneLevel}));
+  }
+
+  std::initializer_list<vk::DescriptorPoolSize> sizes = {
+      {vk::DescriptorType::eUniformBuffer, /*count=*/1},
+      {vk::DescriptorType::eStorageBuffer, /*count=*/8},
+      {vk::DescriptorType::eCombinedImageSampler, 1 + pyramidLevels_},
+      {vk::DescriptorType::eStorageImage, pyramidLevels_}};
+  pool_ = gDevice.createDescriptorPool(
+      {/*flags=*/{}, /*maxSets=*/1 + pyramidLevels_, sizes});
+  cullSet_ = gDevice.allocateDescriptorSets({pool_, cullSetLayout_})[0];
+  std::vector<vk::DescriptorSetLayout> reduceLayouts(pyramidLevels_,
+                                                     reduceSetLayout_);
+  reduceSets_ = gDevice.allocateDescriptorSets({pool_, reduceLayouts});
+
+  std::vector<vk::DescriptorBufferInfo> buffers = {
+      {descriptorPool_.camera_, /*offset=*/0, VK_WHOLE_SIZE},
+      {draws_.commands_, /*offset=*/0, VK_WHOLE_SIZE},
+      {draws_.bounds_, /*offset=*/0, VK_WHOLE_SIZE},
+      {draws_.drawData_, /*offset=*/0, VK_WHOLE_SIZE},
+      {descriptorPool_.scene_, /*offset=*/0, VK_WHOLE_SIZE},
+      {draws_.culled_, /*offset=*/0, VK_WHOLE_SIZE},
+      {draws_.culledCount_, /*offset=*/0, VK_WHOLE_SIZE},
+      {draws_.visibility_, /*offset=*/0, VK_WHOLE_SIZE}};
+  std::vector<vk::WriteDescriptorSet> writes;
+  for (uint32_t binding = 0; binding < buffers.size(); ++binding)
+    writes.emplace_back(cullSet_, binding, /*arrayElement=*/0,
+                        /*descriptorCount=*/1,
+                        binding ? vk::DescriptorType::eStorageBuffer
+                                : vk::DescriptorType::eUniformBuffer,
+                        /*imageInfo=*/nullptr, &buffers[binding]);
+
+  vk::DescriptorImageInfo pyramidInfo(/*sampler=*/nullptr, pyramidView_,
+                                      vk::ImageLayout::eGeneral);
+  writes.emplace_back(cullSet_, /*binding=*/8, /*arrayElement=*/0,
+                      /*descriptorCount=*/1,
+                      vk::DescriptorType::eCombinedImageSampler, &pyramidInfo);
+  vk::DescriptorBufferInfo runsInfo(draws_.runs_, /*offset=*/0,
+                                    VK_WHOLE_SIZE);
+  writes.emplace_back(cullSet_, /*binding=*/9, /*arrayElement=*/0,
+                      /*descriptorCount=*/1,
+                      vk::DescriptorType::eStorageBuffer,
+                      /*imageInfo=*/nullptr, &runsInfo);
+
+  // Each level reads the one before it, and the first reads depth
+  vk::DescriptorImageInfo depthInfo(/*sampler=*/nullptr, gDepthImageView,
+                                    vk::ImageLayout::eDepthStencilReadOnlyOptimal);
+  std::vector<vk::DescriptorImageInfo> levelInfos;
+  levelInfos.reserve(pyramidLevels_);
+  for (uint32_t level = 0; level < pyramidLevels_; ++level)
+    levelInfos.emplace_back(/*sampler=*/nullptr, levelViews_[level],
+                            vk::ImageLayout::eGeneral);
+  for (uint32_t level = 0; level < pyramidLevels_; ++level) {
+    writes.emplace_back(reduceSets_[level], /*binding=*/0, /*arrayElement=*/0,
+                        /*descriptorCount=*/1,
+                        vk::DescriptorType::eCombinedImageSampler,
+                        level ? &pyramidInfo : &depthInfo);
+    writes.emplace_back(reduceSets_[level], /*binding=*/1, /*arrayElement=*/0,
+                        /*descriptorCount=*/1,
+                        vk::DescriptorType::eStorageImage, &levelInfos[level]);
+  }
+  gDevice.updateDescriptorSets(writes, /*copies=*/{});
+}
+
+GpuCulling::~GpuCulling() {
+  for (vk::ImageView levelView : levelViews_) gDevice.destroy(levelView);
+  gDevice.destroy(pyramidView_);
+  gDevice.destroy(pool_);
+  gDevice.destroy(pyramid_);
+  gDevice.free(pyramidMemory_);
+  gDevice.destroy(cullPipeline_);
+  gDevice.destroy(reducePipeline_);
+  gDevice.destroy(cullLayout_);
+  gDevice.destroy(reduceLayout_);
+  gDevice.destroy(cullSetLayout_);
+  gDevice.destroy(reduceSetLayout_);
+  gDevice.destroy(sampler_);
+}
+
+void GpuCulling::cull(vk::CommandBuffer buf, bool late) {
+  // The previous pass or frame may still be drawing from the culled buffers,
+  // and the previous late cull's visibility writes have to be seen
+  vk::MemoryBarrier drawn(vk::AccessFlagBits::eIndirectCommandRead |
+                              vk::AccessFlagBits::eShaderWrite,
+                          vk::AccessFlagBits::eShaderRead |
+                              vk::AccessFlagBits::eShaderWrite |
+                              vk::AccessFlagBits::eTransferWrite);
+  buf.pipelineBarrier(vk::PipelineStageFlagBits::eDrawIndirect |
+                          vk::PipelineStageFlagBits::eComputeShader,
+                      vk::PipelineStageFlagBits::eTransfer |
+                          vk::PipelineStageFlagBits::eComputeShader,
+                      /*dependencyFlags=*/{}, drawn, {}, {});
+  // The cull set describes the pyramid as general, so it has to be general
+  // before the first cull uses the set, even if that's an early cull, which
+  // doesn't sample it
+  if (!pyramidInitialized_) {
+    vk::ImageMemoryBarrier toGeneral(
+        /*srcAccess=*/{},
+        /*dstAccess=*/vk::AccessFlagBits::eShaderRead |
+            vk::AccessFlagBits::eShaderWrite,
+        /*oldLayout=*/vk::ImageLayout::eUndefined,
+        /*newLayout=*/vk::ImageLayout::eGeneral, VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED, pyramid_,
+        vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor,
+                                  /*baseMip=*/0, pyramidLevels_,
+                                  /*baseLayer=*/0, /*layerCount=*/1));
+    buf.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        /*dependencyFlags=*/{}, {}, {}, toGeneral);
+    pyramidInitialized_ = true;
+  }
+  if (compactDraws()) {
+    buf.fillBuffer(draws_.culledCount_, /*offset=*/0, VK_WHOLE_SIZE, 0);
+    vk::MemoryBarrier cleared(
+        vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    buf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        /*dependencyFlags=*/{}, cleared, {}, {});
+  }
+
+  // Camera is a lookAt and a perspective, see getCamera
+  Camera camera = descriptorPool_.currentCamera_;
+  CullConstants constants;
+  constants.P00 = camera.proj[0][0];
+  constants.P11 = -camera.proj[1][1];  // Flipped for Vulkan
+  constants.P22 = camera.proj[2][2];
+  constants.P32 = camera.proj[3][2];
+  constants.znear = constants.P32 / constants.P22;
+  constants.zfar = constants.P32 / (constants.P22 + 1);
+  constants.pyramidWidth = pyramidExtent_.width;
+  constants.pyramidHeight = pyramidExtent_.height;
+  constants.drawCount = draws_.size_;
+  constants.late = late;
+  constants.compact = compactDraws();
+
+  buf.bindPipeline(vk::PipelineBindPoint::eCompute, cullPipeline_);
+  buf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, cullLayout_,
+                         /*firstSet=*/0, cullSet_, /*dynamicOffsets=*/{});
+  buf.pushConstants(cullLayout_, vk::ShaderStageFlagBits::eCompute,
+                    /*offset=*/0, sizeof(CullConstants), &constants);
+  buf.dispatch((draws_.size_ + 63) / 64, 1, 1);
+
+  vk::MemoryBarrier culled(vk::AccessFlagBits::eShaderWrite,
+                           vk::AccessFlagBits::eIndirectCommandRead);
+  buf.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                      vk::PipelineStageFlagBits::eDrawIndirect,
+                      /*dependencyFlags=*/{}, culled, {}, {});
+}
+
+void GpuCulling::buildPyramid(vk::CommandBuffer buf) {
+  vk::ImageSubresourceRange wholeImage(vk::ImageAspectFlagBits::eColor,
+                                       /*baseMip=*/0, pyramidLevels_,
+                                       /*baseLayer=*/0, /*layerCount=*/1);
+  // The previous frame's late cull may still be reading it. It's been
+  // general since the first cull.
+  vk::ImageMemoryBarrier read(
+      /*srcAccess=*/vk::AccessFlagBits::eShaderRead,
+      /*dstAccess=*/vk::AccessFlagBits::eShaderWrite,
+      /*oldLayout=*/vk::ImageLayout::eGeneral,
+      /*newLayout=*/vk::ImageLayout::eGeneral, VK_QUEUE_FAMILY_IGNORED,
+      VK_QUEUE_FAMILY_IGNORED, pyramid_, wholeImage);
+  buf.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                      vk::PipelineStageFlagBits::eComputeShader,
+                      /*dependencyFlags=*/{}, {}, {}, read);
+
+  buf.bindPipeline(vk::PipelineBindPoint::eCompute, reducePipeline_);
+  vk::Extent2D src = gSwapchainExtent;
+  for (uint32_t level = 0; level < pyramidLevels_; ++level) {
+    vk::Extent2D dst(std::max(pyramidExtent_.width >> level, 1u),
+                     std::max(pyramidExtent_.height >> level, 1u));
+    int32_t constants[5] = {int32_t(src.width), int32_t(src.height),
+                            int32_t(dst.width), int32_t(dst.height),
+                            level ? int32_t(level - 1) : 0};
+    buf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, reduceLayout_,
+                           /*firstSet=*/0, reduceSets_[level],
+                           /*dynamicOffsets=*/{});
+    buf.pushConstants(reduceLayout_, vk::ShaderStageFlagBits::eCompute,
+                      /*offset=*/0, sizeof(constants), constants);
+    buf.dispatch((dst.width + 7) / 8, (dst.height + 7) / 8, 1);
+
+    vk::MemoryBarrier reduced(vk::AccessFlagBits::eShaderWrite,
+                              vk::AccessFlagBits::eShaderRead);
+    buf.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        /*dependencyFlags=*/{}, reduced, {}, {});
+    src = dst;
+  }
+}
+
+void GpuCulling::draw(vk::CommandBuffer buf, uint32_t run, uint32_t first,
+                      uint32_t count) const {
+  constexpr uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand);
+  if (compactDraws())
+    gCmdDrawIndexedIndirectCount(buf, draws_.culled_, first * stride,
+                                 draws_.culledCount_,
+                                 /*countOffset=*/run * sizeof(uint32_t),
+                                 /*maxDrawCount=*/count, stride);
+  else if (gEnabledFeatures.multiDrawIndirect)
+    buf.drawIndexedIndirect(draws_.culled_, first * stride, count, stride);
+  else
+    for (uint32_t i = first; i < first + count; ++i)
+      buf.drawIndexedIndirect(draws_.culled_, i * stride, /*drawCount=*/1,
+                              stride);
+}
+
+void CpuCulling::update(const std::vector<glm::mat4>& matrices,
+                        const DrawList& draws) {
+  size_ = static_cast<uint32_t>(draws.size());
+  size_t padded = (size_ + kLanes - 1) / kLanes * kLanes;
+  for (std::vector<float>* component :
+       {&centerX_, &centerY_, &centerZ_, &extentX_, &extentY_, &extentZ_,
+        &radius_})
+    component->assign(padded, 0.f);
+
+  for (uint32_t i = 0; i < size_; ++i) {
+    glm::vec4 sphere = draws.bounds_[i];
+    glm::vec3 extent = draws.extents_[i];
+    if (!std::isfinite(sphere.w)) {
+      // No bounds, never culled
+      extentX_[i] = extentY_[i] = extentZ_[i] = radius_[i] = INFINITY;
+      continue;
+    }
+
+    // The box around every instance's transformed box
+    glm::vec3 min(INFINITY), max(-INFINITY);
+    for (uint32_t j = 0; j < draws.instanceCount_[i]; ++j) {
+      const glm::mat4& matrix = matrices[draws.firstInstance_[i] + j];
+      glm::vec3 center = matrix * glm::vec4(glm::vec3(sphere), 1);
+      glm::vec3 worldExtent = glm::abs(glm::vec3(matrix[0])) * extent.x +
+                              glm::abs(glm::vec3(matrix[1])) * extent.y +
+                              glm::abs(glm::vec3(matrix[2])) * extent.z;
+      min = glm::min(min, center - worldExtent);
+      max = glm::max(max, center + worldExtent);
+    }
+    glm::vec3 center = (min + max) / 2.f;
+    // And the sphere around every instance's sphere
+    float radius = 0;
+    for (uint32_t j = 0; j < draws.instanceCount_[i]; ++j) {
+      const glm::mat4& matrix = matrices[draws.firstInstance_[i] + j];
+      float scale = std::max({glm::length(glm::vec3(matrix[0])),
+                              glm::length(glm::vec3(matrix[1])),
+                              glm::length(glm::vec3(matrix[2]))});
+      glm::vec3 instanceCenter = matrix * glm::vec4(glm::vec3(sphere), 1);
+      radius = std::max(radius, glm::length(instanceCenter - center) +
+                                    sphere.w * scale);
+    }
+
+    centerX_[i] = center.x;
+    centerY_[i] = center.y;
+    centerZ_[i] = center.z;
+    extentX_[i] = (max.x - min.x) / 2;
+    extentY_[i] = (max.y - min.y) / 2;
+    extentZ_[i] = (max.z - min.z) / 2;
+    radius_[i] = radius;
+  }
+}
+
+// Draws are outside a plane if either their sphere or their box is, since
+// both enclose them, so the nearer reach of the two is used. Boxes with
+// infinite extents give NaN radii, which fall back to the sphere.
+#if defined(__SSE__)
+uint32_t CpuCulling::testBatch(const glm::vec4 planes[6],
+                               uint32_t first) const {
+  __m128 centerX = _mm_loadu_ps(&centerX_[first]);
+  __m128 centerY = _mm_loadu_ps(&centerY_[first]);
+  __m128 centerZ = _mm_loadu_ps(&centerZ_[first]);
+  __m128 extentX = _mm_loadu_ps(&extentX_[first]);
+  __m128 extentY = _mm_loadu_ps(&extentY_[first]);
+  __m128 extentZ = _mm_loadu_ps(&extentZ_[first]);
+  __m128 radius = _mm_loadu_ps(&radius_[first]);
+  __m128 zero = _mm_setzero_ps();
+  __m128 inside = _mm_cmpeq_ps(zero, zero);
+  for (int p = 0; p < 6; ++p) {
+    const glm::vec4& plane = planes[p];
+    __m128 distance = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), centerX),
+                   _mm_mul_ps(_mm_set1_ps(plane.y), centerY)),
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), centerZ),
+                   _mm_set1_ps(plane.w)));
+    __m128 boxRadius = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::abs(plane.x)), extentX),
+                   _mm_mul_ps(_mm_set1_ps(std::abs(plane.y)), extentY)),
+        _mm_mul_ps(_mm_set1_ps(std::abs(plane.z)), extentZ));
+    // Takes the second operand if either is NaN
+    __m128 reach = _mm_min_ps(boxRadius, radius);
+    inside = _mm_and_ps(inside,
+                        _mm_cmpge_ps(_mm_add_ps(distance, reach), zero));
+  }
+  return _mm_movemask_ps(inside);
+}
+#else
+// Written lane by lane so the compiler can vectorize it
+uint32_t CpuCulling::testBatch(const glm::vec4 planes[6],
+                               uint32_t first) const {
+  bool inside[kLanes] = {true, true, true, true};
+  for (int p = 0; p < 6; ++p) {
+    const glm::vec4& plane = planes[p];
+    for (uint32_t lane = 0; lane < kLanes; ++lane) {
+      uint32_t i = first + lane;
+      float distance = plane.x * centerX_[i] + plane.y * centerY_[i] +
+                       plane.z * centerZ_[i] + plane.w;
+      float boxRadius = std::abs(plane.x) * extentX_[i] +
+                        std::abs(plane.y) * extentY_[i] +
+                        std::abs(plane.z) * extentZ_[i];
+      float reach = std::min(radius_[i], boxRadius);
+      inside[lane] = inside[lane] && distance + reach >= 0;
+    }
+  }
+  uint32_t mask = 0;
+  for (uint32_t lane = 0; lane < kLanes; ++lane) mask |= inside[lane] << lane;
+  return mask;
+}
+#endif
+
+void CpuCulling::cull(const Camera& camera) {
+  // Planes are sums of the view projection's rows, with depth from 0 to 1
+  glm::mat4 viewProj = camera.proj * camera.eye;
+  glm::vec4 rows[4];
+  for (int i = 0; i < 4; ++i)
+    rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i],
+                        viewProj[3][i]);
+  glm::vec4 planes[6] = {rows[3] + rows[0], rows[3] - rows[0],
+                         rows[3] + rows[1], rows[3] - rows[1],
+                         rows[2],           rows[3] - rows[2]};
+  for (glm::vec4& plane : planes) plane /= glm::length(glm::vec3(plane));
+
+  visible_.clear();
+  for (uint32_t first = 0; first < size_; first += kLanes) {
+    uint32_t mask = testBatch(planes, first);
+    while (mask) {
+      uint32_t i = first + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (i < size_) visible_.push_back(i);
+    }
+  }
+  stats_ = {size_, static_cast<uint32_t>(visible_.size())};
+}
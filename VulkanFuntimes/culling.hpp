@@ -0,0 +1,90 @@
+#ifndef culling_hpp
+#define culling_hpp
+
+#include "vulkan/vulkan.hpp"
+#include "rendering.hpp"
+#include "gltf.hpp"
+
+// Matches the push constants in cull.comp
+struct CullConstants {
+  float P00, P11, P22, P32;
+  float znear, zfar;
+  float pyramidWidth, pyramidHeight;
+  uint32_t drawCount;
+  uint32_t late;
+  uint32_t compact;
+};
+
+vk::Pipeline makeComputePipeline(const std::string& filename,
+                                 vk::PipelineLayout layout);
+// Whether culled draws are compacted to the front of their pipeline run,
+// with a count per run. Otherwise every draw is written in place, with 0
+// instances if culled.
+bool compactDraws();
+
+// Culls IndirectDraws on the GPU before they're drawn. Draws visible last
+// frame are drawn first, then a depth pyramid is built from what they wrote,
+// and everything else is tested against it and drawn in a second pass.
+struct GpuCulling {
+  const IndirectDraws& draws_;
+  const DescriptorPool& descriptorPool_;
+  vk::Sampler sampler_;
+  vk::DescriptorSetLayout cullSetLayout_, reduceSetLayout_;
+  vk::PipelineLayout cullLayout_, reduceLayout_;
+  vk::Pipeline cullPipeline_, reducePipeline_;
+
+  // Sized to the swapchain
+  vk::Extent2D pyramidExtent_;
+  uint32_t pyramidLevels_ = 0;
+  vk::Image pyramid_;
+  vk::DeviceMemory pyramidMemory_;
+  vk::ImageView pyramidView_;
+  std::vector<vk::ImageView> levelViews_;
+  vk::DescriptorPool pool_;
+  vk::DescriptorSet cullSet_;
+  std::vector<vk::DescriptorSet> reduceSets_;
+  bool pyramidInitialized_ = false;
+
+  GpuCulling(const IndirectDraws& draws, const DescriptorPool& descriptorPool);
+  ~GpuCulling();
+  void resizeToSwapchain();
+
+  // Writes the draws for one pass into the culled buffers
+  void cull(vk::CommandBuffer buf, bool late);
+  // Builds the depth pyramid from the depth attachment
+  void buildPyramid(vk::CommandBuffer buf);
+  // Draws what survived of one of the draw list's pipeline runs
+  void draw(vk::CommandBuffer buf, uint32_t run, uint32_t first,
+            uint32_t count) const;
+};
+
+// World space bounds of a DrawList, one array per component so the frustum
+// test runs on a batch of draws at once. For when draws aren't indirect and
+// can't be culled on the GPU.
+struct CpuCulling {
+  static constexpr uint32_t kLanes = 4;
+  CpuCulling(const std::vector<glm::mat4>& instances, const DrawList& draws) {
+    update(instances, draws);
+  }
+  // Has to be called whenever the draw list or the instance matrices change
+  void update(const std::vector<glm::mat4>& instances, const DrawList& draws);
+  // Fills visible_ with the indices of draws that touch the frustum
+  void cull(const Camera& camera);
+
+  // Padded to a multiple of kLanes. Spheres and boxes share centers.
+  std::vector<float> centerX_, centerY_, centerZ_;
+  std::vector<float> extentX_, extentY_, extentZ_;
+  std::vector<float> radius_;
+  uint32_t size_ = 0;
+  std::vector<uint32_t> visible_;
+  // From the last cull
+  struct Stats {
+    uint32_t tested, visible;
+  } stats_ = {};
+
+ private:
+  // A bit per lane, set if the draw is inside all the planes
+  uint32_t testBatch(const glm::vec4 planes[6], uint32_t first) const;
+};
+
+#endif /* culling_hpp */
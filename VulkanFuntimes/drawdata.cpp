@@ -1,46 +1,100 @@
 #include "drawdata.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <future>
+#include <iostream>
+
 #include "driver.hpp"
+#include "rendering.hpp"
+#include "swapchain.hpp"
 
 TransferManager *gTransferManager;
 TransferManager::TransferManager() {
+  // Command buffers are reset one at a time when they're begun again
   transferCommandPool_ = gDevice.createCommandPool(
-      {vk::CommandPoolCreateFlagBits::eTransient, gGraphicsQueueFamilyIndex});
+      {vk::CommandPoolCreateFlagBits::eTransient |
+           vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+       gGraphicsQueueFamilyIndex});
   gTransferManager = this;
 }
 
 Transfer TransferManager::newTransfer(vk::DeviceSize size) {
   Transfer ret;
-  ret.buffer_ = gDevice.createBuffer({/*flags=*/{}, size,
-                                      vk::BufferUsageFlagBits::eTransferSrc,
-                                      vk::SharingMode::eExclusive});
-
-  uint32_t stagingMemoryType =
-      getMemoryFor(gDevice.getBufferMemoryRequirements(ret.buffer_),
-                   vk::MemoryPropertyFlagBits::eHostVisible |
-                       vk::MemoryPropertyFlagBits::eHostCoherent);
-  ret.memory_ = gDevice.allocateMemory({size, stagingMemoryType});
-  gDevice.bindBufferMemory(ret.buffer_, ret.memory_, /*offset=*/0);
-  ret.pointer_ = (char *)gDevice.mapMemory(ret.memory_, /*offset=*/0, size);
-
-  ret.cmd_ = gDevice.allocateCommandBuffers(
-      {transferCommandPool_, vk::CommandBufferLevel::ePrimary, 1})[0];
+  if (freeCommandBuffers_.empty()) {
+    ret.cmd_ = gDevice.allocateCommandBuffers(
+        {transferCommandPool_, vk::CommandBufferLevel::ePrimary, 1})[0];
+  } else {
+    ret.cmd_ = freeCommandBuffers_.back();
+    freeCommandBuffers_.pop_back();
+  }
   ret.cmd_.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-  ret.done_ = gDevice.createFence({});
+  if (freeFences_.empty()) {
+    ret.done_ = gDevice.createFence({});
+  } else {
+    ret.done_ = freeFences_.back();
+    freeFences_.pop_back();
+  }
+  ret.pointer_ = nullptr;
+  if (!size) {
+    inFlight_.push_back({StagingBuffer(), ret.cmd_, ret.done_});
+    return ret;
+  }
+
+  // The smallest free buffer that fits
+  auto best = freeBuffers_.end();
+  for (auto it = freeBuffers_.begin(); it != freeBuffers_.end(); ++it)
+    if (it->capacity_ >= size &&
+        (best == freeBuffers_.end() || it->capacity_ < best->capacity_))
+      best = it;
+  if (best != freeBuffers_.end()) {
+    static_cast<StagingBuffer &>(ret) = *best;
+    freeBuffers_.erase(best);
+  } else {
+    // Rounded up so later transfers of about the same size fit
+    vk::DeviceSize capacity = 1 << 16;
+    while (capacity < size) capacity *= 2;
+    ret.buffer_ = gDevice.createBuffer({/*flags=*/{}, capacity,
+                                        vk::BufferUsageFlagBits::eTransferSrc,
+                                        vk::SharingMode::eExclusive});
+
+    vk::MemoryRequirements requirements =
+        gDevice.getBufferMemoryRequirements(ret.buffer_);
+    uint32_t stagingMemoryType =
+        getMemoryFor(requirements,
+                     vk::MemoryPropertyFlagBits::eHostVisible |
+                         vk::MemoryPropertyFlagBits::eHostCoherent);
+    ret.memory_ =
+        gDevice.allocateMemory({requirements.size, stagingMemoryType});
+    gDevice.bindBufferMemory(ret.buffer_, ret.memory_, /*offset=*/0);
+    ret.capacity_ = capacity;
+    ret.mapping_ =
+        (char *)gDevice.mapMemory(ret.memory_, /*offset=*/0, VK_WHOLE_SIZE);
+  }
+  ret.pointer_ = ret.mapping_;
 
-  currentBuffers_.push_back(ret);
+  inFlight_.push_back({ret, ret.cmd_, ret.done_});
   return ret;
 }
 
 void Transfer::copy(vk::Buffer from, vk::Buffer to, vk::DeviceSize size,
                     vk::PipelineStageFlags dstStage,
                     vk::AccessFlags dstAccess) {
-  cmd_.copyBuffer(from, to, vk::BufferCopy(/*src=*/0, /*dst=*/0, size));
+  copy(from, to, vk::BufferCopy(/*src=*/0, /*dst=*/0, size), dstStage,
+       dstAccess);
+}
+
+void Transfer::copy(vk::Buffer from, vk::Buffer to,
+                    vk::ArrayProxy<const vk::BufferCopy> regions,
+                    vk::PipelineStageFlags dstStage,
+                    vk::AccessFlags dstAccess) {
+  cmd_.copyBuffer(from, to, regions);
 
   vk::BufferMemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite, dstAccess,
                                   gGraphicsQueueFamilyIndex,
                                   gGraphicsQueueFamilyIndex, to,
-                                  /*offset=*/0, size);
+                                  /*offset=*/0, VK_WHOLE_SIZE);
   cmd_.pipelineBarrier(
       /*srcStage=*/vk::PipelineStageFlagBits::eTransfer, dstStage,
       /*dependencyFlags=*/{}, {}, barrier, {});
@@ -51,121 +105,549 @@ Transfer::~Transfer() {
   vk::SubmitInfo submit;
   submit.setCommandBuffers(cmd_);
   gGraphicsQueue.submit(submit, done_);
-  gDevice.unmapMemory(memory_);
 }
 
 void TransferManager::collectGarbage() {
-  for (auto it = currentBuffers_.begin(); it != currentBuffers_.end();) {
-    if (gDevice.getFenceStatus(it->done_) == vk::Result::eSuccess) {
-      gDevice.destroy(it->done_);
-      gDevice.destroy(it->buffer_);
-      gDevice.free(it->memory_);
-      it = currentBuffers_.erase(it);
+  std::vector<vk::Fence> done;
+  for (auto it = inFlight_.begin(); it != inFlight_.end();) {
+    if (gDevice.getFenceStatus(it->done) == vk::Result::eSuccess) {
+      done.push_back(it->done);
+      freeCommandBuffers_.push_back(it->cmd);
+      if (it->staging.buffer_) freeBuffers_.push_back(it->staging);
+      it = inFlight_.erase(it);
     } else
       ++it;
   }
-  if (currentBuffers_.empty()) gDevice.resetCommandPool(transferCommandPool_);
+  if (done.empty()) return;
+  gDevice.resetFences(done);
+  freeFences_.insert(freeFences_.end(), done.begin(), done.end());
 }
 
 TransferManager::~TransferManager() {
+  // Only once the queue is idle
+  for (const InFlight &transfer : inFlight_) {
+    gDevice.destroy(transfer.done);
+    gDevice.destroy(transfer.staging.buffer_);
+    gDevice.free(transfer.staging.memory_);
+  }
+  for (const StagingBuffer &buffer : freeBuffers_) {
+    gDevice.destroy(buffer.buffer_);
+    gDevice.free(buffer.memory_);
+  }
+  for (vk::Fence fence : freeFences_) gDevice.destroy(fence);
   gDevice.destroy(transferCommandPool_);
   gTransferManager = nullptr;
 }
 
-VertexBuffers::VertexBuffers(const Gltf &model) {
-  vk::DeviceSize size = model.bufferSize();
-  Transfer transfer = gTransferManager->newTransfer(size);
-  model.readBuffers(transfer.pointer_);
+std::optional<uint32_t> RangeAllocator::allocate(uint32_t count) {
+  if (!count) return 0;
+  for (auto it = free_.begin(); it != free_.end(); ++it) {
+    auto [offset, size] = *it;
+    if (size < count) continue;
+    free_.erase(it);
+    if (size > count) free_[offset + count] = size - count;
+    return offset;
+  }
+  return std::nullopt;
+}
 
-  buffer_ = gDevice.createBuffer({/*flags=*/{}, size,
-                                  vk::BufferUsageFlagBits::eIndexBuffer |
-                                      vk::BufferUsageFlagBits::eVertexBuffer |
-                                      vk::BufferUsageFlagBits::eTransferDst,
-                                  vk::SharingMode::eExclusive});
+void RangeAllocator::free(uint32_t offset, uint32_t count) {
+  if (!count) return;
+  auto next = free_.lower_bound(offset);
+  if (next != free_.end() && next->first == offset + count) {
+    count += next->second;
+    next = free_.erase(next);
+  }
+  if (next != free_.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += count;
+      return;
+    }
+  }
+  free_[offset] = count;
+}
+
+void RangeAllocator::reset(uint32_t capacity, uint32_t used) {
+  capacity_ = capacity;
+  free_.clear();
+  if (used < capacity) free_[used] = capacity - used;
+}
+
+std::pair<vk::Buffer, vk::DeviceMemory> makeDeviceBuffer(
+    vk::DeviceSize size, vk::BufferUsageFlags usage) {
+  vk::Buffer buffer = gDevice.createBuffer(
+      {/*flags=*/{}, size,
+       usage | vk::BufferUsageFlagBits::eTransferSrc |
+           vk::BufferUsageFlagBits::eTransferDst,
+       vk::SharingMode::eExclusive});
+  vk::MemoryRequirements requirements =
+      gDevice.getBufferMemoryRequirements(buffer);
+  vk::DeviceMemory memory = gDevice.allocateMemory(
+      {requirements.size,
+       getMemoryFor(requirements, vk::MemoryPropertyFlagBits::eDeviceLocal)});
+  gDevice.bindBufferMemory(buffer, memory, /*offset=*/0);
+  return {buffer, memory};
+}
+
+uint32_t GeometryHeap::load(const Gltf &model) {
+  uint32_t vertexCount = model.vertexCount(), indexCount = model.indexCount();
+  std::optional<uint32_t> firstVertex = vertices_.allocate(vertexCount);
+  std::optional<uint32_t> firstIndex = indices_.allocate(indexCount);
+  if (!firstVertex || !firstIndex) {
+    if (firstVertex) vertices_.free(*firstVertex, vertexCount);
+    if (firstIndex) indices_.free(*firstIndex, indexCount);
+    compact(vertexCount, indexCount);
+    firstVertex = vertices_.allocate(vertexCount);
+    firstIndex = indices_.allocate(indexCount);
+  }
+
+  // Loaded interleaved, and split into the two streams while staging
+  std::vector<Vertex> vertices(vertexCount);
+  vk::DeviceSize positionSize = vertexCount * sizeof(VertexPosition);
+  vk::DeviceSize attributeSize = vertexCount * sizeof(VertexAttributes);
+  vk::DeviceSize indexSize = indexCount * sizeof(Index);
+  Transfer transfer =
+      gTransferManager->newTransfer(positionSize + attributeSize + indexSize);
+  auto *positions = (VertexPosition *)transfer.pointer_;
+  auto *attributes = (VertexAttributes *)(transfer.pointer_ + positionSize);
+  char *indices = transfer.pointer_ + positionSize + attributeSize;
+  model.readBuffers((char *)vertices.data(), indices);
+  for (const Vertex &vertex : vertices) {
+    *positions++ = vertex.position;
+    *attributes++ = {vertex.normal, vertex.texcoord, vertex.tangent};
+  }
+
+  if (vertexCount) {
+    transfer.copy(transfer.buffer_, positionBuffer_,
+                  vk::BufferCopy(/*src=*/0,
+                                 *firstVertex * sizeof(VertexPosition),
+                                 positionSize),
+                  vk::PipelineStageFlagBits::eVertexInput,
+                  vk::AccessFlagBits::eVertexAttributeRead);
+    transfer.copy(transfer.buffer_, attributeBuffer_,
+                  vk::BufferCopy(/*src=*/positionSize,
+                                 *firstVertex * sizeof(VertexAttributes),
+                                 attributeSize),
+                  vk::PipelineStageFlagBits::eVertexInput,
+                  vk::AccessFlagBits::eVertexAttributeRead);
+  }
+  if (indexSize)
+    transfer.copy(transfer.buffer_, indexBuffer_,
+                  vk::BufferCopy(/*src=*/positionSize + attributeSize,
+                                 *firstIndex * sizeof(Index), indexSize),
+                  vk::PipelineStageFlagBits::eVertexInput,
+                  vk::AccessFlagBits::eIndexRead);
+
+  Model loaded = {true, *firstVertex, vertexCount, *firstIndex, indexCount};
+  for (uint32_t i = 0; i < models_.size(); ++i) {
+    if (models_[i].loaded) continue;
+    models_[i] = loaded;
+    return i;
+  }
+  models_.push_back(loaded);
+  return static_cast<uint32_t>(models_.size() - 1);
+}
+
+void GeometryHeap::unload(uint32_t model) {
+  Model &unloaded = models_[model];
+  unloaded.loaded = false;
+  // Frames in flight may still draw it. Compacting drops the range anyway.
+  retire([this, unloaded, generation = generation_] {
+    if (generation != generation_) return;
+    vertices_.free(unloaded.firstVertex, unloaded.vertexCount);
+    indices_.free(unloaded.firstIndex, unloaded.indexCount);
+  });
+}
 
-  uint32_t memoryType =
-      getMemoryFor(gDevice.getBufferMemoryRequirements(buffer_),
-                   vk::MemoryPropertyFlagBits::eDeviceLocal);
-  memory_ = gDevice.allocateMemory({size, memoryType});
-  gDevice.bindBufferMemory(buffer_, memory_, /*offset=*/0);
+void GeometryHeap::compact(uint32_t extraVertices, uint32_t extraIndices) {
+  uint32_t usedVertices = 0, usedIndices = 0;
+  for (const Model &model : models_) {
+    if (!model.loaded) continue;
+    usedVertices += model.vertexCount;
+    usedIndices += model.indexCount;
+  }
+  // Grow geometrically so that loading many models doesn't copy every time
+  uint32_t vertexCapacity = vertices_.capacity_;
+  if (usedVertices + extraVertices > vertexCapacity)
+    vertexCapacity = std::max(2 * vertexCapacity, usedVertices + extraVertices);
+  uint32_t indexCapacity = indices_.capacity_;
+  if (usedIndices + extraIndices > indexCapacity)
+    indexCapacity = std::max(2 * indexCapacity, usedIndices + extraIndices);
+
+  vk::BufferUsageFlags vertexUsage =
+      vk::BufferUsageFlagBits::eVertexBuffer |
+      vk::BufferUsageFlagBits::eStorageBuffer;
+  auto [positionBuffer, positionMemory] = makeDeviceBuffer(
+      std::max(vertexCapacity, 1u) * sizeof(VertexPosition), vertexUsage);
+  auto [attributeBuffer, attributeMemory] = makeDeviceBuffer(
+      std::max(vertexCapacity, 1u) * sizeof(VertexAttributes), vertexUsage);
+  auto [indexBuffer, indexMemory] =
+      makeDeviceBuffer(std::max(indexCapacity, 1u) * sizeof(Index),
+                       vk::BufferUsageFlagBits::eIndexBuffer);
+
+  std::vector<vk::BufferCopy> positionCopies, attributeCopies, indexCopies;
+  uint32_t nextVertex = 0, nextIndex = 0;
+  for (Model &model : models_) {
+    if (!model.loaded) continue;
+    if (model.vertexCount) {
+      positionCopies.emplace_back(model.firstVertex * sizeof(VertexPosition),
+                                  nextVertex * sizeof(VertexPosition),
+                                  model.vertexCount * sizeof(VertexPosition));
+      attributeCopies.emplace_back(
+          model.firstVertex * sizeof(VertexAttributes),
+          nextVertex * sizeof(VertexAttributes),
+          model.vertexCount * sizeof(VertexAttributes));
+    }
+    if (model.indexCount)
+      indexCopies.emplace_back(model.firstIndex * sizeof(Index),
+                               nextIndex * sizeof(Index),
+                               model.indexCount * sizeof(Index));
+    model.firstVertex = nextVertex;
+    model.firstIndex = nextIndex;
+    nextVertex += model.vertexCount;
+    nextIndex += model.indexCount;
+  }
 
-  transfer.copy(transfer.buffer_, buffer_, size,
-                vk::PipelineStageFlagBits::eVertexInput,
-                vk::AccessFlagBits::eIndexRead |
+  if (!positionCopies.empty() || !indexCopies.empty()) {
+    Transfer transfer = gTransferManager->newTransfer(0);
+    // Wait for uploads into the old buffers that haven't run yet
+    vk::MemoryBarrier uploaded(vk::AccessFlagBits::eTransferWrite,
+                               vk::AccessFlagBits::eTransferRead);
+    transfer.cmd_.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                  vk::PipelineStageFlagBits::eTransfer,
+                                  /*dependencyFlags=*/{}, uploaded, {}, {});
+    if (!positionCopies.empty()) {
+      transfer.copy(positionBuffer_, positionBuffer, positionCopies,
+                    vk::PipelineStageFlagBits::eVertexInput,
+                    vk::AccessFlagBits::eVertexAttributeRead);
+      transfer.copy(attributeBuffer_, attributeBuffer, attributeCopies,
+                    vk::PipelineStageFlagBits::eVertexInput,
                     vk::AccessFlagBits::eVertexAttributeRead);
+    }
+    if (!indexCopies.empty())
+      transfer.copy(indexBuffer_, indexBuffer, indexCopies,
+                    vk::PipelineStageFlagBits::eVertexInput,
+                    vk::AccessFlagBits::eIndexRead);
+  }
+
+  if (positionBuffer_)
+    retire([positionBuffer = positionBuffer_, positionMemory = positionMemory_,
+            attributeBuffer = attributeBuffer_,
+            attributeMemory = attributeMemory_, indexBuffer = indexBuffer_,
+            indexMemory = indexMemory_] {
+      gDevice.destroy(positionBuffer);
+      gDevice.free(positionMemory);
+      gDevice.destroy(attributeBuffer);
+      gDevice.free(attributeMemory);
+      gDevice.destroy(indexBuffer);
+      gDevice.free(indexMemory);
+    });
+  positionBuffer_ = positionBuffer;
+  positionMemory_ = positionMemory;
+  attributeBuffer_ = attributeBuffer;
+  attributeMemory_ = attributeMemory;
+  indexBuffer_ = indexBuffer;
+  indexMemory_ = indexMemory;
+  vertices_.reset(vertexCapacity, nextVertex);
+  indices_.reset(indexCapacity, nextIndex);
+  ++generation_;
 }
-VertexBuffers::~VertexBuffers() {
-  gDevice.destroy(buffer_);
-  gDevice.free(memory_);
+
+GeometryHeap::~GeometryHeap() {
+  gDevice.destroy(positionBuffer_);
+  gDevice.free(positionMemory_);
+  gDevice.destroy(attributeBuffer_);
+  gDevice.free(attributeMemory_);
+  gDevice.destroy(indexBuffer_);
+  gDevice.free(indexMemory_);
 }
 
-Textures::Textures(const Gltf &model) {
-  std::vector<Pixels> images = model.getImages();
-  if (images.empty()) return;
-  uint32_t layers = static_cast<uint32_t>(images.size());
-  vk::DeviceSize size = images[0].size() * layers;
-  vk::Extent3D extent = images[0].extent();
+namespace {
+// Whether the image format can be blitted into its own mips
+bool canBlitMips() {
+  vk::FormatFeatureFlags needed =
+      vk::FormatFeatureFlagBits::eBlitSrc |
+      vk::FormatFeatureFlagBits::eBlitDst |
+      vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+  return (gPhysicalDevice.getFormatProperties(vk::Format::eR8G8B8A8Srgb)
+              .optimalTilingFeatures &
+          needed) == needed;
+}
+
+std::pair<vk::Image, vk::DeviceMemory> makeTextureImage(
+    const vk::ImageCreateInfo &create) {
+  vk::Image image = gDevice.createImage(create);
+  vk::MemoryRequirements requirements =
+      gDevice.getImageMemoryRequirements(image);
+  vk::DeviceMemory memory = gDevice.allocateMemory(
+      {requirements.size,
+       getMemoryFor(requirements, vk::MemoryPropertyFlagBits::eDeviceLocal)});
+  gDevice.bindImageMemory(image, memory, /*offset=*/0);
+  return {image, memory};
+}
+
+// One image with a layer for each of the pixels, which all have to be the
+// same size, uploaded and ready to sample. Color layers are sRGB, and the
+// rest only read as data through a linear view.
+std::pair<vk::Image, vk::DeviceMemory> makeTexture(
+    const std::vector<const Pixels *> &layers, const std::vector<bool> &color,
+    MipGeneration mips) {
+  vk::Extent3D extent = layers[0]->extent();
+  uint32_t layerCount = static_cast<uint32_t>(layers.size());
+  uint32_t levels = mips == MipGeneration::kNone ? 1 : mipLevels(extent);
+  auto [image, memory] = makeTextureImage(
+      {vk::ImageCreateFlagBits::eMutableFormat, vk::ImageType::e2D,
+       vk::Format::eR8G8B8A8Srgb, extent, levels, layerCount,
+       vk::SampleCountFlagBits::e1, vk::ImageTiling::eOptimal,
+       vk::ImageUsageFlagBits::eTransferSrc |
+           vk::ImageUsageFlagBits::eTransferDst |
+           vk::ImageUsageFlagBits::eSampled,
+       vk::SharingMode::eExclusive, /*queueFamilyIndices=*/{}});
 
+  // Filtered in parallel, since big textures take a while
+  std::vector<std::vector<unsigned char>> chains(layerCount);
+  if (mips == MipGeneration::kCpu) {
+    std::vector<std::future<std::vector<unsigned char>>> filtering;
+    for (uint32_t layer = 0; layer < layerCount; ++layer)
+      filtering.push_back(std::async(std::launch::async, boxFilterMips,
+                                     std::cref(*layers[layer]), color[layer],
+                                     levels));
+    for (uint32_t layer = 0; layer < layerCount; ++layer)
+      chains[layer] = filtering[layer].get();
+  }
+
+  // Level by level, with the layers of each together. Only the first level
+  // unless the mips were filtered here.
+  uint32_t uploaded = mips == MipGeneration::kCpu ? levels : 1;
+  vk::DeviceSize size = 0;
+  for (uint32_t level = 0; level < uploaded; ++level)
+    size += mipExtent(extent, level).width * mipExtent(extent, level).height *
+            4 * layerCount;
   Transfer transfer = gTransferManager->newTransfer(size);
   char *pointer = transfer.pointer_;
-  for (const Pixels &pixels : images)
-    pointer = std::copy_n(pixels.data_.get(), pixels.size(), pointer);
+  std::vector<vk::BufferImageCopy> copies;
+  size_t mipOffset = 0;
+  for (uint32_t level = 0; level < uploaded; ++level) {
+    copies.emplace_back(
+        /*offset=*/pointer - transfer.pointer_, /*bufferRowLength=*/0,
+        /*bufferImageHeight=*/0,
+        vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, level,
+                                   /*baseLayer=*/0, layerCount),
+        vk::Offset3D(0, 0, 0), mipExtent(extent, level));
+    size_t levelSize =
+        mipExtent(extent, level).width * mipExtent(extent, level).height * 4;
+    for (uint32_t layer = 0; layer < layerCount; ++layer)
+      pointer = std::copy_n(
+          level == 0 ? layers[layer]->data_.get()
+                     : chains[layer].data() + mipOffset,
+          levelSize, pointer);
+    if (level > 0) mipOffset += levelSize;
+  }
+
+  auto barrier = [&](uint32_t level, uint32_t count, vk::AccessFlags srcAccess,
+                     vk::AccessFlags dstAccess, vk::ImageLayout oldLayout,
+                     vk::ImageLayout newLayout, vk::PipelineStageFlags srcStage,
+                     vk::PipelineStageFlags dstStage) {
+    vk::ImageMemoryBarrier imageBarrier(
+        srcAccess, dstAccess, oldLayout, newLayout, VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED, image,
+        {vk::ImageAspectFlagBits::eColor, level, count, /*baseLayer=*/0,
+         layerCount});
+    transfer.cmd_.pipelineBarrier(srcStage, dstStage, /*dependencyFlags=*/{},
+                                  {}, {}, imageBarrier);
+  };
+  barrier(/*level=*/0, levels, /*srcAccess=*/{},
+          vk::AccessFlagBits::eTransferWrite, vk::ImageLayout::eUndefined,
+          vk::ImageLayout::eTransferDstOptimal,
+          vk::PipelineStageFlagBits::eTopOfPipe,
+          vk::PipelineStageFlagBits::eTransfer);
+  transfer.cmd_.copyBufferToImage(transfer.buffer_, image,
+                                  vk::ImageLayout::eTransferDstOptimal, copies);
+
+  if (mips == MipGeneration::kBlit) {
+    // Each level from the one above, which is done being written and becomes
+    // a blit source, and ends up sampled from there
+    for (uint32_t level = 1; level < levels; ++level) {
+      barrier(level - 1, /*count=*/1, vk::AccessFlagBits::eTransferWrite,
+              vk::AccessFlagBits::eTransferRead,
+              vk::ImageLayout::eTransferDstOptimal,
+              vk::ImageLayout::eTransferSrcOptimal,
+              vk::PipelineStageFlagBits::eTransfer,
+              vk::PipelineStageFlagBits::eTransfer);
+      vk::Extent3D from = mipExtent(extent, level - 1);
+      vk::Extent3D to = mipExtent(extent, level);
+      vk::ImageBlit blit(
+          {vk::ImageAspectFlagBits::eColor, level - 1, /*baseLayer=*/0,
+           layerCount},
+          {vk::Offset3D(0, 0, 0),
+           vk::Offset3D(int32_t(from.width), int32_t(from.height), 1)},
+          {vk::ImageAspectFlagBits::eColor, level, /*baseLayer=*/0,
+           layerCount},
+          {vk::Offset3D(0, 0, 0),
+           vk::Offset3D(int32_t(to.width), int32_t(to.height), 1)});
+      transfer.cmd_.blitImage(image, vk::ImageLayout::eTransferSrcOptimal,
+                              image, vk::ImageLayout::eTransferDstOptimal,
+                              blit, vk::Filter::eLinear);
+    }
+    if (levels > 1)
+      barrier(/*level=*/0, levels - 1, vk::AccessFlagBits::eTransferRead,
+              vk::AccessFlagBits::eShaderRead,
+              vk::ImageLayout::eTransferSrcOptimal,
+              vk::ImageLayout::eShaderReadOnlyOptimal,
+              vk::PipelineStageFlagBits::eTransfer,
+              vk::PipelineStageFlagBits::eFragmentShader);
+    barrier(levels - 1, /*count=*/1, vk::AccessFlagBits::eTransferWrite,
+            vk::AccessFlagBits::eShaderRead,
+            vk::ImageLayout::eTransferDstOptimal,
+            vk::ImageLayout::eShaderReadOnlyOptimal,
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eFragmentShader);
+  } else {
+    barrier(/*level=*/0, levels, vk::AccessFlagBits::eTransferWrite,
+            vk::AccessFlagBits::eShaderRead,
+            vk::ImageLayout::eTransferDstOptimal,
+            vk::ImageLayout::eShaderReadOnlyOptimal,
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eFragmentShader);
+  }
+  return {image, memory};
+}
 
-  image_ = gDevice.createImage(
+// A cooked image, every level uploaded as it was compressed
+std::pair<vk::Image, vk::DeviceMemory> makeTexture(const BlockImage &cooked) {
+  const BlockFormat &format = *cooked.format;
+  vk::DeviceSize size = 0;
+  for (uint32_t level = 0; level < cooked.levels; ++level)
+    size += blockLevelSize(format, mipExtent(cooked.extent, level));
+  if (cooked.blocks.size() < size)
+    throw std::runtime_error("Cooked image is truncated");
+
+  auto [image, memory] = makeTextureImage(
       {vk::ImageCreateFlagBits::eMutableFormat, vk::ImageType::e2D,
-       vk::Format::eR8G8B8A8Srgb, extent,
-       /*mipLevels=*/1, layers, vk::SampleCountFlagBits::e1,
-       vk::ImageTiling::eOptimal,
+       format.srgb, cooked.extent, cooked.levels, /*arrayLayers=*/1,
+       vk::SampleCountFlagBits::e1, vk::ImageTiling::eOptimal,
        vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled,
        vk::SharingMode::eExclusive, /*queueFamilyIndices=*/{}});
 
-  uint32_t memoryType = getMemoryFor(gDevice.getImageMemoryRequirements(image_),
-                                     vk::MemoryPropertyFlagBits::eDeviceLocal);
-  memory_ = gDevice.allocateMemory({size, memoryType});
-  gDevice.bindImageMemory(image_, memory_, /*offset=*/0);
+  Transfer transfer = gTransferManager->newTransfer(size);
+  std::copy_n(cooked.blocks.data(), size, transfer.pointer_);
+  std::vector<vk::BufferImageCopy> copies;
+  vk::DeviceSize offset = 0;
+  for (uint32_t level = 0; level < cooked.levels; ++level) {
+    vk::Extent3D extent = mipExtent(cooked.extent, level);
+    copies.emplace_back(offset, /*bufferRowLength=*/0,
+                        /*bufferImageHeight=*/0,
+                        vk::ImageSubresourceLayers(
+                            vk::ImageAspectFlagBits::eColor, level,
+                            /*baseLayer=*/0, /*layerCount=*/1),
+                        vk::Offset3D(0, 0, 0), extent);
+    offset += blockLevelSize(format, extent);
+  }
 
   vk::ImageSubresourceRange wholeImage(vk::ImageAspectFlagBits::eColor,
-                                       /*baseMip=*/0, /*levelCount=*/1,
-                                       /*baseLayer=*/0, layers);
-
+                                       /*baseMip=*/0, cooked.levels,
+                                       /*baseLayer=*/0, /*layerCount=*/1);
   vk::ImageMemoryBarrier toTransferDst(
       /*srcAccess=*/{}, /*dstAccess=*/vk::AccessFlagBits::eTransferWrite,
       /*oldLayout=*/vk::ImageLayout::eUndefined,
       /*newLayout=*/vk::ImageLayout::eTransferDstOptimal,
-      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image_, wholeImage);
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image, wholeImage);
   transfer.cmd_.pipelineBarrier(
       /*srcStage=*/vk::PipelineStageFlagBits::eTopOfPipe,
       /*dstStage=*/vk::PipelineStageFlagBits::eTransfer,
       /*dependencyFlags=*/{}, {}, {}, toTransferDst);
-
-  vk::ImageSubresourceLayers wholeImageLayers(vk::ImageAspectFlagBits::eColor,
-                                              /*mipLevel=*/0, /*baseLayer=*/0,
-                                              layers);
-  vk::BufferImageCopy copy(/*offset=*/0, /*bufferRowLength=*/0,
-                           /*bufferImageHeight=*/0, wholeImageLayers,
-                           vk::Offset3D(0, 0, 0), extent);
-  transfer.cmd_.copyBufferToImage(transfer.buffer_, image_,
-                                  vk::ImageLayout::eTransferDstOptimal, copy);
-
+  transfer.cmd_.copyBufferToImage(transfer.buffer_, image,
+                                  vk::ImageLayout::eTransferDstOptimal, copies);
   vk::ImageMemoryBarrier toShader(
       /*srcAccess=*/vk::AccessFlagBits::eTransferWrite,
       /*dstAccess=*/vk::AccessFlagBits::eShaderRead,
       /*oldLayout=*/vk::ImageLayout::eTransferDstOptimal,
       /*newLayout=*/vk::ImageLayout::eShaderReadOnlyOptimal,
-      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image_, wholeImage);
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image, wholeImage);
   transfer.cmd_.pipelineBarrier(
       /*srcStage=*/vk::PipelineStageFlagBits::eTransfer,
       /*dstStage=*/vk::PipelineStageFlagBits::eFragmentShader,
       /*dependencyFlags=*/{}, {}, {}, toShader);
+  return {image, memory};
+}
+
+vk::ImageView makeTextureView(vk::Image image, vk::ImageViewType type,
+                              vk::Format format, uint32_t layers) {
+  return gDevice.createImageView(
+      {/*flags=*/{}, image, type, format, /*componentMapping=*/{},
+       {vk::ImageAspectFlagBits::eColor, /*baseMip=*/0, VK_REMAINING_MIP_LEVELS,
+        /*baseLayer=*/0, layers}});
+}
+}  // namespace
+
+Textures::Textures(const Gltf &model, bool bindless, MipGeneration mips)
+    : bindless_(bindless), mips_(mips) {
+  if (mips_ == MipGeneration::kBlit && !canBlitMips())
+    mips_ = MipGeneration::kCpu;
+  std::vector<ImageRole> roles = model.imageRoles();
+  if (bindless_) {
+    // Slots are the gltf's image indices. KTX2 and cooked images are
+    // uploaded in blocks if the device has their format, and the rest
+    // decoded. A KTX2 image that can't be used is replaced in its own slot
+    // by its fallback, so fallbacks' slots are left empty.
+    for (uint32_t image = 0; image < roles.size(); ++image) {
+      bool color = roles[image] == ImageRole::kColor;
+      if (model.isOnlyFallback(image)) {
+        slots_.emplace_back();
+        continue;
+      }
+      if (model.isKtx2(image)) {
+        if (std::optional<BlockImage> ktx2 =
+                readKtx2(model.readImage(image))) {
+          add(*ktx2);
+          continue;
+        }
+        uint32_t fallback = model.fallbackImage(image);
+        std::cerr << "KTX2 image " << image
+                  << " is Basis Universal or a format the device can't "
+                     "sample, using image "
+                  << fallback << "\n";
+        add(model.getImage(fallback), color);
+        continue;
+      }
+      const gltf::Image &data = model.data_.images(image);
+      auto cooked = std::find_if(
+          data.compressed().begin(), data.compressed().end(),
+          [](const auto &compressed) {
+            return blockFormatSupported(compressed.format());
+          });
+      if (cooked != data.compressed().end())
+        add(BlockImage{&blockFormat(cooked->format()),
+                       {cooked->width(), cooked->height(), 1},
+                       cooked->levels(),
+                       model.readBufferView(cooked->buffer_view())});
+      else
+        add(model.getImage(image), color);
+    }
+    return;
+  }
 
-  imageView_ = gDevice.createImageView({/*flags=*/{}, image_,
-                                        vk::ImageViewType::e2DArray,
-                                        vk::Format::eR8G8B8A8Srgb,
-                                        /*componentMapping=*/{}, wholeImage});
-  imageViewData_ = gDevice.createImageView(
-      {/*flags=*/{}, image_, vk::ImageViewType::e2DArray,
-       vk::Format::eR8G8B8A8Unorm,
-       /*componentMapping=*/{}, wholeImage});
+  // Every layer has one format, so cooked blocks and KTX2 are only for
+  // bindless, and KTX2 images are swapped for their fallbacks
+  std::vector<Pixels> images;
+  for (uint32_t image = 0; image < roles.size(); ++image)
+    images.push_back(model.getImage(
+        model.isKtx2(image) ? model.fallbackImage(image) : image));
+  if (images.empty()) return;
+  uint32_t layers = static_cast<uint32_t>(images.size());
+  std::vector<const Pixels *> layerPixels;
+  std::vector<bool> color;
+  for (uint32_t image = 0; image < layers; ++image) {
+    layerPixels.push_back(&images[image]);
+    color.push_back(roles[image] == ImageRole::kColor);
+  }
+  std::tie(image_, memory_) = makeTexture(layerPixels, color, mips_);
+  bytes_ += gDevice.getImageMemoryRequirements(image_).size;
+  imageView_ = makeTextureView(image_, vk::ImageViewType::e2DArray,
+                               vk::Format::eR8G8B8A8Srgb, layers);
+  imageViewData_ = makeTextureView(image_, vk::ImageViewType::e2DArray,
+                                   vk::Format::eR8G8B8A8Unorm, layers);
 }
 
 Textures::~Textures() {
@@ -173,16 +655,102 @@ Textures::~Textures() {
   gDevice.destroy(imageViewData_);
   gDevice.destroy(image_);
   gDevice.free(memory_);
+  for (const Texture &texture : slots_) {
+    gDevice.destroy(texture.view);
+    gDevice.destroy(texture.dataView);
+    gDevice.destroy(texture.image);
+    gDevice.free(texture.memory);
+  }
+}
+
+uint32_t Textures::newSlot() {
+  while (!retiredSlots_.empty() &&
+         retiredSlots_.front().first <= gCompletedSerial) {
+    freeSlots_.push_back(retiredSlots_.front().second);
+    retiredSlots_.pop_front();
+  }
+  if (freeSlots_.empty()) {
+    uint32_t slot = static_cast<uint32_t>(slots_.size());
+    if (2 * slot + 2 > gMaxBindlessDescriptors)
+      throw std::runtime_error("Out of bindless texture slots");
+    slots_.emplace_back();
+    return slot;
+  }
+  uint32_t slot = freeSlots_.back();
+  freeSlots_.pop_back();
+  return slot;
+}
+
+uint32_t Textures::add(const Pixels &pixels, bool color) {
+  uint32_t slot = newSlot();
+  Texture &texture = slots_[slot];
+  std::tie(texture.image, texture.memory) =
+      makeTexture({&pixels}, {color}, mips_);
+  bytes_ += gDevice.getImageMemoryRequirements(texture.image).size;
+  texture.view = makeTextureView(texture.image, vk::ImageViewType::e2D,
+                                 vk::Format::eR8G8B8A8Srgb, /*layers=*/1);
+  texture.dataView = makeTextureView(texture.image, vk::ImageViewType::e2D,
+                                     vk::Format::eR8G8B8A8Unorm,
+                                     /*layers=*/1);
+  if (set_) write(slot);
+  return slot;
+}
+
+uint32_t Textures::add(const BlockImage &cooked) {
+  uint32_t slot = newSlot();
+  Texture &texture = slots_[slot];
+  std::tie(texture.image, texture.memory) = makeTexture(cooked);
+  bytes_ += gDevice.getImageMemoryRequirements(texture.image).size;
+  texture.view = makeTextureView(texture.image, vk::ImageViewType::e2D,
+                                 cooked.format->srgb, /*layers=*/1);
+  texture.dataView = makeTextureView(texture.image, vk::ImageViewType::e2D,
+                                     cooked.format->unorm, /*layers=*/1);
+  if (set_) write(slot);
+  return slot;
+}
+
+void Textures::remove(uint32_t slot) {
+  // Its descriptors are left pointing at the destroyed views, which is fine
+  // for a partially bound array as long as no material indexes it
+  retire([texture = slots_[slot]] {
+    gDevice.destroy(texture.view);
+    gDevice.destroy(texture.dataView);
+    gDevice.destroy(texture.image);
+    gDevice.free(texture.memory);
+  });
+  slots_[slot] = {};
+  retiredSlots_.emplace_back(gSubmitSerial + 1, slot);
+}
+
+void Textures::bind(vk::DescriptorSet set) {
+  set_ = set;
+  for (uint32_t slot = 0; slot < slots_.size(); ++slot)
+    if (slots_[slot].image) write(slot);
+}
+
+void Textures::write(uint32_t slot) const {
+  // Update after bind, so recorded command buffers see it without recording
+  // again
+  std::array<vk::DescriptorImageInfo, 2> views = {
+      vk::DescriptorImageInfo(/*sampler=*/nullptr, slots_[slot].view,
+                              vk::ImageLayout::eShaderReadOnlyOptimal),
+      vk::DescriptorImageInfo(/*sampler=*/nullptr, slots_[slot].dataView,
+                              vk::ImageLayout::eShaderReadOnlyOptimal)};
+  gDevice.updateDescriptorSets(
+      vk::WriteDescriptorSet(set_, /*binding=*/10, /*arrayElement=*/2 * slot,
+                             vk::DescriptorType::eSampledImage, views),
+      /*copies=*/{});
 }
 
 DescriptorPool::DescriptorPool(vk::DescriptorSetLayout layout,
-                               const Textures &textures, const Gltf &gltf) {
+                               Textures &textures, const Gltf &gltf) {
   vk::DeviceSize sceneSize = gltf.uniformsSize();
   Transfer transfer = gTransferManager->newTransfer(sceneSize);
   gltf.readUniforms(transfer.pointer_);
 
   scene_ = gDevice.createBuffer({/*flags=*/{}, sceneSize,
                                  vk::BufferUsageFlagBits::eUniformBuffer |
+                                     vk::BufferUsageFlagBits::eStorageBuffer |
                                      vk::BufferUsageFlagBits::eTransferDst,
                                  vk::SharingMode::eExclusive});
   memory_ = gDevice.allocateMemory(
@@ -191,8 +759,10 @@ DescriptorPool::DescriptorPool(vk::DescriptorSetLayout layout,
   gDevice.bindBufferMemory(scene_, memory_, /*offset=*/0);
 
   transfer.copy(transfer.buffer_, scene_, sceneSize,
-                vk::PipelineStageFlagBits::eVertexShader,
-                vk::AccessFlagBits::eUniformRead);
+                vk::PipelineStageFlagBits::eVertexShader |
+                    vk::PipelineStageFlagBits::eFragmentShader,
+                vk::AccessFlagBits::eUniformRead |
+                    vk::AccessFlagBits::eShaderRead);
 
   vk::DeviceSize cameraSize = sizeof(Camera);
   camera_ = gDevice.createBuffer({/*flags=*/{}, cameraSize,
@@ -207,27 +777,29 @@ DescriptorPool::DescriptorPool(vk::DescriptorSetLayout layout,
   mapping_ =
       (char *)gDevice.mapMemory(shared_memory_, /*offset=*/0, cameraSize);
 
-  std::initializer_list<vk::DescriptorPoolSize> sizes = {
+  std::vector<vk::DescriptorPoolSize> sizes = {
       {vk::DescriptorType::eUniformBuffer, /*count=*/1},
-      {vk::DescriptorType::eUniformBufferDynamic, /*count=*/2},
-      {vk::DescriptorType::eCombinedImageSampler, /*count=*/2}};
-  pool_ = gDevice.createDescriptorPool({/*flags=*/{}, /*maxSets=*/1, sizes});
+      {vk::DescriptorType::eStorageBuffer, /*count=*/5}};
+  vk::DescriptorPoolCreateFlags poolFlags;
+  if (textures.bindless_) {
+    sizes.push_back({vk::DescriptorType::eSampledImage,
+                     /*count=*/gMaxBindlessDescriptors});
+    sizes.push_back({vk::DescriptorType::eSampler, /*count=*/1});
+    poolFlags = vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind;
+  } else {
+    sizes.push_back({vk::DescriptorType::eCombinedImageSampler,
+                     /*count=*/2});
+  }
+  pool_ = gDevice.createDescriptorPool({poolFlags, /*maxSets=*/1, sizes});
 
   set_ = gDevice.allocateDescriptorSets({pool_, layout})[0];
 
-  vk::DeviceSize size = uniformSize<Camera>();
   vk::DescriptorBufferInfo cameraBuffer(camera_, /*offset=*/0, cameraSize);
   vk::WriteDescriptorSet writeCamera(set_, /*binding=*/0, /*arrayElement=*/0,
                                      vk::DescriptorType::eUniformBuffer, {},
                                      cameraBuffer,
                                      /*texelBufferView=*/{});
 
-  vk::DescriptorBufferInfo modelBuffer(scene_, /*offset=*/0, size);
-  vk::WriteDescriptorSet writeModel(set_, /*binding=*/1, /*arrayElement=*/0,
-                                    vk::DescriptorType::eUniformBufferDynamic,
-                                    {}, modelBuffer,
-                                    /*texelBufferView=*/{});
-
   vk::DescriptorImageInfo imageInfo(/*sampler=*/nullptr, textures.imageView_,
                                     vk::ImageLayout::eShaderReadOnlyOptimal);
   vk::WriteDescriptorSet writeImage(set_, /*binding=*/2, /*arrayElement=*/0,
@@ -241,14 +813,75 @@ DescriptorPool::DescriptorPool(vk::DescriptorSetLayout layout,
                                    vk::DescriptorType::eCombinedImageSampler,
                                    dataInfo, {},
                                    /*texelBufferView=*/{});
+  std::vector<vk::WriteDescriptorSet> writes = {writeCamera};
+  if (textures.bindless_) {
+    textures.bind(set_);
+  } else {
+    writes.push_back(writeImage);
+    writes.push_back(writeData);
+  }
 
-  size = uniformSize<Uniform>();
-  vk::DescriptorBufferInfo materialBuffer(scene_, /*offset=*/0, size);
-  vk::WriteDescriptorSet writeMaterial(
-      set_, /*binding=*/4, /*arrayElement=*/0,
-      vk::DescriptorType::eUniformBufferDynamic, {}, materialBuffer,
-      /*texelBufferView=*/{});
+  // Instance matrices and materials are both packed and indexed, so the set
+  // is bound once with no dynamic offsets
+  vk::DescriptorBufferInfo modelsBuffer(scene_, /*offset=*/0, VK_WHOLE_SIZE);
+  vk::WriteDescriptorSet writeModels(set_, /*binding=*/6, /*arrayElement=*/0,
+                                     vk::DescriptorType::eStorageBuffer, {},
+                                     modelsBuffer,
+                                     /*texelBufferView=*/{});
+  vk::DescriptorBufferInfo materialsBuffer(scene_, gltf.materialsOffset(),
+                                           VK_WHOLE_SIZE);
+  vk::WriteDescriptorSet writeMaterials(set_, /*binding=*/7,
+                                        /*arrayElement=*/0,
+                                        vk::DescriptorType::eStorageBuffer, {},
+                                        materialsBuffer,
+                                        /*texelBufferView=*/{});
+  writes.push_back(writeModels);
+  writes.push_back(writeMaterials);
+  gDevice.updateDescriptorSets(writes, /*copies=*/{});
+}
+
+void DescriptorPool::setVertices(const GeometryHeap &geometry) {
+  vk::DescriptorBufferInfo positionBuffer(geometry.positionBuffer_,
+                                          /*offset=*/0, VK_WHOLE_SIZE);
+  vk::DescriptorBufferInfo attributeBuffer(geometry.attributeBuffer_,
+                                           /*offset=*/0, VK_WHOLE_SIZE);
   gDevice.updateDescriptorSets(
-      {writeCamera, writeModel, writeImage, writeData, writeMaterial},
+      {vk::WriteDescriptorSet(set_, /*binding=*/8, /*arrayElement=*/0,
+                              vk::DescriptorType::eStorageBuffer, {},
+                              positionBuffer, /*texelBufferView=*/{}),
+       vk::WriteDescriptorSet(set_, /*binding=*/9, /*arrayElement=*/0,
+                              vk::DescriptorType::eStorageBuffer, {},
+                              attributeBuffer, /*texelBufferView=*/{})},
       /*copies=*/{});
 }
+
+void DescriptorPool::updateInstances(
+    const Transforms &transforms,
+    const std::vector<std::pair<uint32_t, uint32_t>> &ranges) {
+  if (ranges.empty()) return;
+  uint32_t count = 0;
+  for (auto [first, end] : ranges) count += end - first;
+  Transfer transfer = gTransferManager->newTransfer(count * sizeof(glm::mat4));
+
+  std::vector<vk::BufferCopy> regions;
+  auto *staged = (glm::mat4 *)transfer.pointer_;
+  for (auto [first, end] : ranges) {
+    regions.emplace_back(
+        /*src=*/(char *)staged - transfer.pointer_,
+        /*dst=*/first * sizeof(glm::mat4), (end - first) * sizeof(glm::mat4));
+    for (uint32_t instance = first; instance < end; ++instance)
+      *staged++ = transforms.world_[transforms.instanceNode_[instance]];
+  }
+
+  // Earlier frames may still be reading the old matrices
+  vk::MemoryBarrier unused(vk::AccessFlagBits::eShaderRead,
+                           vk::AccessFlagBits::eTransferWrite);
+  transfer.cmd_.pipelineBarrier(vk::PipelineStageFlagBits::eVertexShader |
+                                    vk::PipelineStageFlagBits::eComputeShader,
+                                vk::PipelineStageFlagBits::eTransfer,
+                                /*dependencyFlags=*/{}, unused, {}, {});
+  transfer.copy(transfer.buffer_, scene_, regions,
+                vk::PipelineStageFlagBits::eVertexShader |
+                    vk::PipelineStageFlagBits::eComputeShader,
+                vk::AccessFlagBits::eShaderRead);
+}
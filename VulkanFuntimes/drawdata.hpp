@@ -2,47 +2,154 @@
 #define drawdata_hpp
 
 #include "glm/mat4x4.hpp"
+#include <deque>
+#include <map>
+#include <optional>
 
 #include "vulkan/vulkan.hpp"
+#include "compression.hpp"
 #include "gltf.hpp"
+#include "transforms.hpp"
 
+// Mapped for as long as it lives
 struct StagingBuffer {
   vk::Buffer buffer_;
   vk::DeviceMemory memory_;
-  vk::Fence done_;
+  vk::DeviceSize capacity_ = 0;
+  char* mapping_ = nullptr;
 };
 struct Transfer : public StagingBuffer {
   ~Transfer();
   void copy(vk::Buffer from, vk::Buffer to, vk::DeviceSize size,
             vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess);
+  void copy(vk::Buffer from, vk::Buffer to,
+            vk::ArrayProxy<const vk::BufferCopy> regions,
+            vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess);
   vk::CommandBuffer cmd_;
+  vk::Fence done_;
   char* pointer_;
 };
 
+// Staging buffers, command buffers and fences all go back to free lists once
+// their transfer finishes, so steady state transfers create nothing
 struct TransferManager {
   TransferManager();
   ~TransferManager();
   vk::CommandPool transferCommandPool_;
-  std::vector<StagingBuffer> currentBuffers_;
+  struct InFlight {
+    StagingBuffer staging;
+    vk::CommandBuffer cmd;
+    vk::Fence done;
+  };
+  std::vector<InFlight> inFlight_;
+  std::vector<StagingBuffer> freeBuffers_;
+  std::vector<vk::CommandBuffer> freeCommandBuffers_;
+  std::vector<vk::Fence> freeFences_;
+  // A size of 0 gives a transfer with no staging buffer, for GPU-side copies
   Transfer newTransfer(vk::DeviceSize size);
+  // Recycles what finished transfers used. Cheap enough for every frame.
   void collectGarbage();
 };
 extern TransferManager* gTransferManager;
 
-struct VertexBuffers {
-  vk::Buffer buffer_;
-  vk::DeviceMemory memory_;
-  VertexBuffers(const Gltf& model);
-  ~VertexBuffers();
+std::pair<vk::Buffer, vk::DeviceMemory> makeDeviceBuffer(
+    vk::DeviceSize size, vk::BufferUsageFlags usage);
+
+// First fit allocator for ranges of elements in a buffer
+struct RangeAllocator {
+  uint32_t capacity_ = 0;
+  std::map<uint32_t, uint32_t> free_;  // offset -> count
+  std::optional<uint32_t> allocate(uint32_t count);
+  void free(uint32_t offset, uint32_t count);
+  // Everything below used is allocated, and the rest is free
+  void reset(uint32_t capacity, uint32_t used);
 };
 
+// Vertex buffers and one index buffer shared by every loaded model, so they
+// are bound once and models are drawn with firstIndex and vertexOffset.
+// Vertices are split into a position stream and an attribute stream, so
+// passes that only need positions read a quarter of the data.
+struct GeometryHeap {
+  struct Model {
+    bool loaded = false;
+    uint32_t firstVertex = 0, vertexCount = 0;
+    uint32_t firstIndex = 0, indexCount = 0;
+  };
+  vk::Buffer positionBuffer_, attributeBuffer_, indexBuffer_;
+  vk::DeviceMemory positionMemory_, attributeMemory_, indexMemory_;
+  RangeAllocator vertices_, indices_;
+  std::vector<Model> models_;
+  // Changes whenever models move, which invalidates draws made before
+  uint32_t generation_ = 0;
+
+  GeometryHeap() = default;
+  ~GeometryHeap();
+  uint32_t load(const Gltf& model);
+  void unload(uint32_t model);
+  // Moves all models to the start of new buffers with at least this much room
+  // left over
+  void compact(uint32_t extraVertices = 0, uint32_t extraIndices = 0);
+  const Model& model(uint32_t model) const { return models_[model]; }
+};
+
+// Where textures' mip chains are made
+enum class MipGeneration {
+  kNone,  // Only the full size level, for comparing
+  // Blitted down one level at a time on the GPU as they're uploaded. Linear
+  // blits of an sRGB image filter in linear light, which suits colors but
+  // not data. Falls back to kCpu where the format can't be blitted.
+  kBlit,
+  // Box filtered on the CPU at load, colors in linear light and data as it
+  // is. Slower to load.
+  kCpu,
+};
+
+// A gltf's images, which materials index. By default every image is a layer
+// of one array, so they all have to be the first one's size. Bindless
+// textures are each their own image, of any size, in a partially bound
+// descriptor array that can be added to and removed from while frames are in
+// flight. Needs gMaxBindlessDescriptors.
 struct Textures {
   vk::ImageView imageView_;
   vk::ImageView imageViewData_;
   vk::Image image_;
   vk::DeviceMemory memory_;
-  Textures(const Gltf& model);
+
+  bool bindless_;
+  MipGeneration mips_;
+  // Descriptors for slot i are at 2i, viewed as sRGB for colors, and 2i + 1,
+  // viewed as linear for data
+  struct Texture {
+    vk::Image image;
+    vk::DeviceMemory memory;
+    vk::ImageView view, dataView;
+  };
+  std::vector<Texture> slots_;  // Null where free
+  std::vector<uint32_t> freeSlots_;
+  // Removed, with the submit serial they're free after
+  std::deque<std::pair<uint64_t, uint32_t>> retiredSlots_;
+  // Where bindless textures are written, see DescriptorPool
+  vk::DescriptorSet set_;
+  // Device memory of every image, to compare cooked and uncompressed
+  vk::DeviceSize bytes_ = 0;
+
+  explicit Textures(const Gltf& model, bool bindless = false,
+                    MipGeneration mips = MipGeneration::kBlit);
   ~Textures();
+  // Bindless only. Returns the slot materials index it by. Mips of color
+  // textures are filtered in linear light, see MipGeneration.
+  uint32_t add(const Pixels& pixels, bool color = true);
+  // Uploaded with its mips as they are
+  uint32_t add(const BlockImage& cooked);
+  // Frames in flight may still sample it, so the slot is only reused once
+  // they're done
+  void remove(uint32_t slot);
+  // Writes every texture into the set, and later ones as they're added
+  void bind(vk::DescriptorSet set);
+
+ private:
+  uint32_t newSlot();
+  void write(uint32_t slot) const;
 };
 
 struct Camera {
@@ -57,9 +164,19 @@ struct DescriptorPool {
   vk::DeviceMemory shared_memory_;
   vk::Buffer camera_;
   char* mapping_;
-  DescriptorPool(vk::DescriptorSetLayout layout, const Textures& textures,
+  // What was last written to camera_, for culling on the CPU side
+  Camera currentCamera_;
+  // Bindless textures are written into the set from then on
+  DescriptorPool(vk::DescriptorSetLayout layout, Textures& textures,
                  const Gltf& gltf);
   void updateCamera();
+  // Points vertex pulling at the heap's vertices. Has to be called again
+  // when the heap is compacted, before drawing and with nothing in flight.
+  void setVertices(const GeometryHeap& geometry);
+  // Uploads just the instance matrices in ranges, from Transforms::update
+  void updateInstances(
+      const Transforms& transforms,
+      const std::vector<std::pair<uint32_t, uint32_t>>& ranges);
   ~DescriptorPool();
 };
 
@@ -1,5 +1,9 @@
 #include "driver.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 
 GLFWwindow *gWindow = nullptr;
@@ -90,6 +94,21 @@ uint32_t graphicsQueueFamily() {
 vk::Device gDevice;
 uint32_t gGraphicsQueueFamilyIndex = 0;
 vk::Queue gGraphicsQueue;
+vk::PhysicalDeviceFeatures gEnabledFeatures;
+PFN_vkCmdDrawIndexedIndirectCountKHR gCmdDrawIndexedIndirectCount = nullptr;
+uint32_t gMaxBindlessDescriptors = 0;
+
+namespace {
+// Bindless textures index a partially bound sampled image array from
+// material data, and add and remove textures while frames using the array
+// are in flight
+bool bindlessSupported(const vk::PhysicalDeviceDescriptorIndexingFeatures &f) {
+  return f.runtimeDescriptorArray && f.descriptorBindingPartiallyBound &&
+         f.descriptorBindingSampledImageUpdateAfterBind &&
+         f.descriptorBindingUpdateUnusedWhilePending &&
+         f.shaderSampledImageArrayNonUniformIndexing;
+}
+}  // namespace
 
 Device::Device() {
   std::initializer_list<float> priorities = {1.f};
@@ -98,25 +117,231 @@ Device::Device() {
       {/*flags=*/{}, gGraphicsQueueFamilyIndex, priorities}};
 
   std::vector<const char *> extensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
-  for (const auto &ext : gPhysicalDevice.enumerateDeviceExtensionProperties())
+  bool drawIndirectCount = false;
+  bool descriptorIndexing = false, maintenance3 = false;
+  for (const auto &ext : gPhysicalDevice.enumerateDeviceExtensionProperties()) {
     if (ext.extensionName == std::string_view("VK_KHR_portability_subset"))
       extensions.push_back("VK_KHR_portability_subset");
+    if (ext.extensionName ==
+        std::string_view(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME)) {
+      extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+      drawIndirectCount = true;
+    }
+    if (ext.extensionName ==
+        std::string_view(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME))
+      descriptorIndexing = true;
+    if (ext.extensionName ==
+        std::string_view(VK_KHR_MAINTENANCE3_EXTENSION_NAME))
+      maintenance3 = true;
+  }
+
+  // Queried through the instance's get_physical_device_properties2, since
+  // the instance is 1.0
+  vk::PhysicalDeviceDescriptorIndexingFeatures indexingSupported;
+  vk::PhysicalDeviceDescriptorIndexingFeatures indexingEnabled;
+  if (descriptorIndexing && maintenance3) {
+    auto getFeatures2 = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>(
+        gInstance.getProcAddr("vkGetPhysicalDeviceFeatures2KHR"));
+    auto getProperties2 =
+        reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>(
+            gInstance.getProcAddr("vkGetPhysicalDeviceProperties2KHR"));
+    vk::PhysicalDeviceFeatures2 features2;
+    features2.pNext = &indexingSupported;
+    getFeatures2(gPhysicalDevice,
+                 reinterpret_cast<VkPhysicalDeviceFeatures2 *>(&features2));
+    if (bindlessSupported(indexingSupported)) {
+      vk::PhysicalDeviceDescriptorIndexingProperties indexingProperties;
+      vk::PhysicalDeviceProperties2 properties2;
+      properties2.pNext = &indexingProperties;
+      getProperties2(
+          gPhysicalDevice,
+          reinterpret_cast<VkPhysicalDeviceProperties2 *>(&properties2));
+      gMaxBindlessDescriptors = std::min(
+          {indexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+           indexingProperties.maxDescriptorSetUpdateAfterBindSampledImages,
+           // More than any scene needs, and descriptor memory isn't free
+           uint32_t(1 << 14)});
+      extensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+      extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+      indexingEnabled.setRuntimeDescriptorArray(true)
+          .setDescriptorBindingPartiallyBound(true)
+          .setDescriptorBindingSampledImageUpdateAfterBind(true)
+          .setDescriptorBindingUpdateUnusedWhilePending(true)
+          .setShaderSampledImageArrayNonUniformIndexing(true);
+    }
+  }
 
-  vk::PhysicalDeviceFeatures features;
-  features.setSamplerAnisotropy(true);
-  gDevice = gPhysicalDevice.createDevice({/*flags=*/{}, queues,
-                                          /*pEnabledLayerNames=*/{}, extensions,
-                                          &features});
+  vk::PhysicalDeviceFeatures supported = gPhysicalDevice.getFeatures();
+  gEnabledFeatures = vk::PhysicalDeviceFeatures();
+  gEnabledFeatures.setSamplerAnisotropy(true);
+  gEnabledFeatures.setMultiDrawIndirect(supported.multiDrawIndirect);
+  gEnabledFeatures.setDrawIndirectFirstInstance(
+      supported.drawIndirectFirstInstance);
+  gEnabledFeatures.setOcclusionQueryPrecise(supported.occlusionQueryPrecise);
+  gEnabledFeatures.setInheritedQueries(supported.inheritedQueries);
+  gEnabledFeatures.setTextureCompressionBC(supported.textureCompressionBC);
+  gEnabledFeatures.setTextureCompressionETC2(supported.textureCompressionETC2);
+  vk::DeviceCreateInfo deviceCreate(/*flags=*/{}, queues,
+                                    /*pEnabledLayerNames=*/{}, extensions,
+                                    &gEnabledFeatures);
+  if (gMaxBindlessDescriptors) deviceCreate.setPNext(&indexingEnabled);
+  gDevice = gPhysicalDevice.createDevice(deviceCreate);
 
   gGraphicsQueue = gDevice.getQueue(gGraphicsQueueFamilyIndex,
                                     /*queueIndex=*/0);
+  if (drawIndirectCount)
+    gCmdDrawIndexedIndirectCount =
+        reinterpret_cast<PFN_vkCmdDrawIndexedIndirectCountKHR>(
+            gDevice.getProcAddr("vkCmdDrawIndexedIndirectCountKHR"));
 }
 Device::~Device() {
+  gCmdDrawIndexedIndirectCount = nullptr;
+  gMaxBindlessDescriptors = 0;
   gDevice.destroy();
   gDevice = nullptr;
   gGraphicsQueue = nullptr;
 }
 
+namespace {
+
+// Written before the driver's own data. The driver checks its header too,
+// but not the driver version, and may crash on corrupt data instead of
+// rejecting it.
+struct CacheFileHeader {
+  uint32_t magic;
+  uint32_t vendorID, deviceID, driverVersion;
+  uint8_t uuid[VK_UUID_SIZE];
+  uint64_t size;  // Of the data after it
+  uint64_t hash;  // Of the data after it
+};
+constexpr uint32_t kCacheMagic = 0x43505646;  // "FVPC"
+
+// How the driver's data starts, see vkGetPipelineCacheData
+struct DriverCacheHeader {
+  uint32_t headerSize, headerVersion;
+  uint32_t vendorID, deviceID;
+  uint8_t uuid[VK_UUID_SIZE];
+};
+
+uint64_t fnv1a(const char* data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < size; ++i)
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * 0x100000001b3;
+  return hash;
+}
+
+CacheFileHeader deviceCacheHeader() {
+  CacheFileHeader header = {};
+  header.magic = kCacheMagic;
+  header.vendorID = gPhysicalDeviceProperties.vendorID;
+  header.deviceID = gPhysicalDeviceProperties.deviceID;
+  header.driverVersion = gPhysicalDeviceProperties.driverVersion;
+  std::memcpy(header.uuid, gPhysicalDeviceProperties.pipelineCacheUUID.data(),
+              VK_UUID_SIZE);
+  return header;
+}
+
+// The saved cache's data, or empty with the reason it was rejected
+std::vector<char> readPipelineCache(const std::string& path,
+                                    const char** rejected) {
+  std::ifstream file(path, std::ios::ate | std::ios::binary);
+  if (!file.is_open()) {
+    *rejected = "no file";
+    return {};
+  }
+  size_t fileSize = (size_t)file.tellg();
+  CacheFileHeader header, expected = deviceCacheHeader();
+  if (fileSize < sizeof(header)) {
+    *rejected = "truncated";
+    return {};
+  }
+  file.seekg(0);
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (header.magic != kCacheMagic || header.vendorID != expected.vendorID ||
+      header.deviceID != expected.deviceID ||
+      header.driverVersion != expected.driverVersion ||
+      std::memcmp(header.uuid, expected.uuid, VK_UUID_SIZE) != 0) {
+    *rejected = "saved by another device or driver";
+    return {};
+  }
+  if (header.size != fileSize - sizeof(header)) {
+    *rejected = "truncated";
+    return {};
+  }
+  std::vector<char> data(header.size);
+  file.read(data.data(), data.size());
+  if (!file || fnv1a(data.data(), data.size()) != header.hash) {
+    *rejected = "corrupt";
+    return {};
+  }
+
+  // The driver's own header, which it should check as well
+  DriverCacheHeader driverHeader;
+  if (data.size() < sizeof(driverHeader)) {
+    *rejected = "corrupt";
+    return {};
+  }
+  std::memcpy(&driverHeader, data.data(), sizeof(driverHeader));
+  if (driverHeader.headerSize < sizeof(driverHeader) ||
+      driverHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+      driverHeader.vendorID != expected.vendorID ||
+      driverHeader.deviceID != expected.deviceID ||
+      std::memcmp(driverHeader.uuid, expected.uuid, VK_UUID_SIZE) != 0) {
+    *rejected = "corrupt";
+    return {};
+  }
+  return data;
+}
+
+}  // namespace
+
+vk::PipelineCache gPipelineCache;
+
+PipelineCache::PipelineCache(std::string path) : path_(std::move(path)) {
+  const char* rejected = nullptr;
+  std::vector<char> data = readPipelineCache(path_, &rejected);
+  if (!data.empty()) {
+    try {
+      gPipelineCache = gDevice.createPipelineCache(
+          {/*flags=*/{}, data.size(), data.data()});
+      warm_ = true;
+    } catch (const vk::SystemError&) {
+      rejected = "refused by the driver";
+    }
+  }
+  if (!warm_) {
+    std::cerr << "pipeline cache " << path_ << " not loaded: " << rejected
+              << "\n";
+    gPipelineCache = gDevice.createPipelineCache({});
+  }
+}
+
+PipelineCache::~PipelineCache() {
+  save();
+  gDevice.destroy(gPipelineCache);
+  gPipelineCache = nullptr;
+}
+
+void PipelineCache::save() const {
+  std::vector<uint8_t> data = gDevice.getPipelineCacheData(gPipelineCache);
+  CacheFileHeader header = deviceCacheHeader();
+  header.size = data.size();
+  header.hash = fnv1a(reinterpret_cast<const char*>(data.data()), data.size());
+  // Written beside it and then moved over it, so a crash partway leaves the
+  // old one
+  std::string temporary = path_ + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if (!file) {
+      std::cerr << "couldn't write pipeline cache " << temporary << "\n";
+      return;
+    }
+  }
+  std::rename(temporary.c_str(), path_.c_str());
+}
+
 uint32_t getMemoryFor(vk::MemoryRequirements memoryRequirements,
                       vk::MemoryPropertyFlags memFlagRequirements) {
   vk::PhysicalDeviceMemoryProperties memProperties =
@@ -131,13 +356,13 @@ uint32_t getMemoryFor(vk::MemoryRequirements memoryRequirements,
 }
 
 uint64_t gFrame = 0;
-void FpsCount::count() {
-  if (!gFrame || gFrame % kInterval != 0) return;
+bool FpsCount::count() {
+  if (gFrame % kInterval != 0) return false;
   auto end = std::chrono::high_resolution_clock::now();
   auto timeus =
       std::chrono::duration_cast<std::chrono::microseconds>(end - start_);
   auto fps = (kInterval * 1000000) / timeus.count();
   std::cerr << fps << " FPS\n";
   start_ = end;
-  ++gFrame;
+  return true;
 }
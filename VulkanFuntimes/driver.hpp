@@ -29,28 +29,42 @@ struct Surface {
 extern vk::Device gDevice;
 extern uint32_t gGraphicsQueueFamilyIndex;
 extern vk::Queue gGraphicsQueue;
+// Optional features, enabled when the device has them
+extern vk::PhysicalDeviceFeatures gEnabledFeatures;
+extern PFN_vkCmdDrawIndexedIndirectCountKHR gCmdDrawIndexedIndirectCount;
+// How many sampled images a bindless texture array can hold, or 0 without
+// the descriptor indexing it needs
+extern uint32_t gMaxBindlessDescriptors;
 struct Device {
   Device();
   ~Device();
 };
 
+// Every pipeline is created through it. Loaded from a file at startup, if
+// the file is intact and was saved by the same device and driver, and saved
+// back to it at shutdown.
+extern vk::PipelineCache gPipelineCache;
+struct PipelineCache {
+  explicit PipelineCache(std::string path);
+  ~PipelineCache();
+  // Worth calling after creating pipelines too, so a crash doesn't lose them
+  void save() const;
+  std::string path_;
+  // Whether a saved cache was loaded
+  bool warm_ = false;
+};
+
 uint32_t getMemoryFor(vk::MemoryRequirements memoryRequirements,
                       vk::MemoryPropertyFlags memFlagRequirements);
 
-template <class T>
-vk::DeviceSize uniformSize() {
-  static_assert(sizeof(T), "Empty uniform object");
-  vk::DeviceSize align =
-      gPhysicalDeviceProperties.limits.minUniformBufferOffsetAlignment;
-  return ((sizeof(T) + align - 1) / align) * align;
-}
-
+// Frames submitted so far
 extern uint64_t gFrame;
 struct FpsCount {
   static constexpr uint64_t kInterval = 200;
   std::chrono::time_point<std::chrono::high_resolution_clock> start_ =
       std::chrono::high_resolution_clock::now();
-  void count();
+  // Once a frame, after it's submitted. True when it has reported.
+  bool count();
 };
 
 #endif /* driver_hpp */
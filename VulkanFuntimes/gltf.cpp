@@ -2,6 +2,8 @@
 
 #include <google/protobuf/util/json_util.h>
 #include <google/protobuf/util/message_differencer.h>
+#include <algorithm>
+#include <cmath>
 #include <filesystem>
 #include "stb_image.h"
 #include "glm/gtc/type_ptr.hpp"
@@ -9,10 +11,13 @@
 #include "glm/vec3.hpp"
 #include "glm/vec4.hpp"
 #include "glm/gtx/string_cast.hpp"
+#include "glm/geometric.hpp"
 
+#include "compression.hpp"
 #include "driver.hpp"
 #include "mikktspace.hpp"
 #include "util.hpp"
+#include "transforms.hpp"
 
 void Gltf::readJSON(size_t length) {
   std::string buffer(length, '\0');
@@ -75,22 +80,34 @@ Gltf::Gltf(std::filesystem::path path) {
     openBinFile();
     setupVulkanData();
   }
+  setupInstances();
 }
 
 void Gltf::setupVulkanData() {
-  uint64_t offset = 0;
+  uint32_t indexOffset = 0, vertexOffset = 0;
   for (gltf::Mesh& mesh : *data_.mutable_meshes()) {
     for (gltf::Primitive& prim : *mesh.mutable_primitives()) {
       if (!prim.attributes().has_position()) continue;
       const auto& inds = data_.accessors(prim.indices());
       const auto& verts = data_.accessors(prim.attributes().position());
-      prim.set_index_offset(offset);
-      offset += inds.count() * sizeof(Index);
-      prim.set_vertex_offset(offset);
-      offset += verts.count() * sizeof(Vertex);
+      prim.set_index_offset(indexOffset);
+      indexOffset += inds.count();
+      prim.set_vertex_offset(vertexOffset);
+      vertexOffset += verts.count();
     }
   }
-  data_.mutable_buffers(0)->set_alloc_length(offset);
+  for (gltf::Mesh& mesh : *data_.mutable_meshes()) {
+    for (gltf::Primitive& prim : *mesh.mutable_primitives()) {
+      const auto& attrs = prim.attributes();
+      if (!attrs.has_position() || !attrs.has_joints_0() ||
+          !attrs.has_weights_0())
+        continue;
+      prim.set_skinned_vertex_offset(vertexOffset);
+      vertexOffset += data_.accessors(attrs.position()).count();
+    }
+  }
+  data_.mutable_buffers(0)->set_index_count(indexOffset);
+  data_.mutable_buffers(0)->set_vertex_count(vertexOffset);
 }
 
 void Gltf::openBinFile() {
@@ -103,11 +120,7 @@ void Gltf::openBinFile() {
   bufferStart_ = 0;
 }
 
-vk::DeviceSize Gltf::bufferSize() const {
-  return data_.buffers(0).alloc_length();
-}
-
-void Gltf::readBuffers(char* output) const {
+void Gltf::readBuffers(char* vertices, char* indices) const {
   const gltf::Buffer& buf = data_.buffers(0);
   std::ifstream binfile;
   std::ifstream* file;
@@ -143,8 +156,8 @@ void Gltf::readBuffers(char* output) const {
       const auto& attrs = prim.attributes();
       if (!attrs.has_position()) continue;
 
-      Index* inds = (Index*)(output + prim.index_offset());
-      Vertex* verts = (Vertex*)(output + prim.vertex_offset());
+      Index* inds = (Index*)indices + prim.index_offset();
+      Vertex* verts = (Vertex*)vertices + prim.vertex_offset();
       uint32_t nInds = readAttr(prim.indices(), inds);
       readAttr(attrs.position(), BufferRef(verts, &Vertex::position));
       if (attrs.has_normal())
@@ -155,15 +168,118 @@ void Gltf::readBuffers(char* output) const {
         readAttr(attrs.tangent(), BufferRef(verts, &Vertex::tangent));
       else
         makeTangents(nInds, inds, verts);
+      // Starts out in the bind pose
+      if (prim.has_skinned_vertex_offset())
+        std::copy_n(verts, data_.accessors(attrs.position()).count(),
+                    (Vertex*)vertices + prim.skinned_vertex_offset());
     }
   }
 }
 
+uint32_t componentSize(gltf::ComponentType type) {
+  switch (type) {
+    case gltf::BYTE:
+    case gltf::UNSIGNED_BYTE:
+      return 1;
+    case gltf::SHORT:
+    case gltf::UNSIGNED_SHORT:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+std::vector<char> Gltf::readComponents(uint32_t index) const {
+  const gltf::Accessor& accessor = data_.accessors(index);
+  const gltf::BufferView& bufferView =
+      data_.buffer_views(accessor.buffer_view());
+  // Type number = num components
+  uint64_t size = accessor.type() * componentSize(accessor.component_type());
+  uint64_t stride = bufferView.byte_stride() ? bufferView.byte_stride() : size;
+
+  std::vector<char> result(accessor.count() * size);
+  file_.seekg(bufferStart_ + bufferView.byte_offset() + accessor.byte_offset());
+  for (uint32_t i = 0; i < accessor.count(); ++i) {
+    file_.read(&result[i * size], size);
+    if (stride != size) file_.seekg(stride - size, std::ios::cur);
+  }
+  return result;
+}
+
+std::vector<float> Gltf::readFloats(uint32_t index) const {
+  gltf::ComponentType type = data_.accessors(index).component_type();
+  std::vector<char> data = readComponents(index);
+  std::vector<float> result(data.size() / componentSize(type));
+  switch (type) {
+    case gltf::FLOAT:
+      std::copy_n(data.data(), data.size(), (char*)result.data());
+      break;
+    // Only normalized integers can be read as floats. Signed ones have two
+    // values for -1.
+    case gltf::BYTE:
+      for (size_t i = 0; i < result.size(); ++i)
+        result[i] = std::max(((int8_t*)data.data())[i] / 127.f, -1.f);
+      break;
+    case gltf::SHORT:
+      for (size_t i = 0; i < result.size(); ++i)
+        result[i] = std::max(((int16_t*)data.data())[i] / 32767.f, -1.f);
+      break;
+    case gltf::UNSIGNED_BYTE:
+      for (size_t i = 0; i < result.size(); ++i)
+        result[i] = ((uint8_t*)data.data())[i] / 255.f;
+      break;
+    case gltf::UNSIGNED_SHORT:
+      for (size_t i = 0; i < result.size(); ++i)
+        result[i] = ((uint16_t*)data.data())[i] / 65535.f;
+      break;
+    default:
+      throw std::runtime_error("Expected float accessor");
+  }
+  return result;
+}
+
+std::vector<uint32_t> Gltf::readUints(uint32_t index) const {
+  gltf::ComponentType type = data_.accessors(index).component_type();
+  std::vector<char> data = readComponents(index);
+  std::vector<uint32_t> result(data.size() / componentSize(type));
+  switch (type) {
+    case gltf::UNSIGNED_BYTE:
+      std::copy_n((uint8_t*)data.data(), result.size(), result.data());
+      break;
+    case gltf::UNSIGNED_SHORT:
+      std::copy_n((uint16_t*)data.data(), result.size(), result.data());
+      break;
+    case gltf::UNSIGNED_INT:
+      std::copy_n((uint32_t*)data.data(), result.size(), result.data());
+      break;
+    default:
+      throw std::runtime_error("Expected integer accessor");
+  }
+  return result;
+}
+
 void Gltf::save(std::filesystem::path path) {
   std::filesystem::path dir = path;
   dir.remove_filename();
   std::filesystem::create_directories(dir);
 
+  // From where the images are now, before they're moved into the bin
+  struct Cooked {
+    BlockFormatId format;
+    vk::Extent3D extent;
+    std::vector<char> blocks;
+  };
+  std::vector<ImageRole> roles = imageRoles();
+  std::vector<std::vector<Cooked>> cooked(data_.images_size());
+  for (uint32_t image = 0; image < data_.images_size(); ++image) {
+    if (isKtx2(image)) continue;
+    Pixels pixels = getImage(image);
+    for (BlockFormatId format : cookFormats(roles[image], pixels))
+      cooked[image].push_back(
+          {format, pixels.extent(),
+           compressImage(pixels, roles[image], format)});
+  }
+
   std::filesystem::path binpath = path;
   binpath.replace_extension("bin");
   std::ofstream bin(binpath, std::ios::binary | std::ios::out);
@@ -175,6 +291,8 @@ void Gltf::save(std::filesystem::path path) {
     std::ifstream imagedata(imagepath, std::ios::binary | std::ios::in);
     bin << imagedata.rdbuf();
     long long end = bin.tellp();
+    // Without the uri it's only known by its mime type
+    if (imagepath.extension() == ".ktx2") image.set_mime_type("image/ktx2");
     image.clear_uri();
     image.set_buffer_view(data_.buffer_views_size());
     gltf::BufferView* bufferview = data_.add_buffer_views();
@@ -183,6 +301,26 @@ void Gltf::save(std::filesystem::path path) {
     bufferview->set_byte_length(end - start);
     start = end;
   }
+  for (uint32_t index = 0; index < data_.images_size(); ++index) {
+    gltf::Image& image = *data_.mutable_images(index);
+    image.clear_compressed();
+    for (const Cooked& texture : cooked[index]) {
+      bin.write(texture.blocks.data(), texture.blocks.size());
+      long long end = bin.tellp();
+      gltf::Image::Compressed* compressed = image.add_compressed();
+      compressed->set_format(texture.format);
+      compressed->set_width(texture.extent.width);
+      compressed->set_height(texture.extent.height);
+      compressed->set_levels(mipLevels(texture.extent));
+      compressed->set_buffer_view(data_.buffer_views_size());
+      gltf::BufferView* bufferview = data_.add_buffer_views();
+      bufferview->set_buffer(0);
+      bufferview->set_byte_offset(start);
+      bufferview->set_byte_length(end - start);
+      start = end;
+    }
+  }
+  bin.close();
   file_ = std::ifstream(binpath, std::ios::ate | std::ios::binary);
   directory_ = dir;
   data_.mutable_buffers(0)->set_uri(binpath.filename());
@@ -195,73 +333,108 @@ void Gltf::save(std::filesystem::path path) {
     throw std::runtime_error(strerror(errno));
 }
 
+vk::DeviceSize Gltf::materialsOffset() const {
+  // Materials are bound at their own offset
+  vk::DeviceSize align =
+      gPhysicalDeviceProperties.limits.minStorageBufferOffsetAlignment;
+  return (instanceCount() * sizeof(glm::mat4) + align - 1) / align * align;
+}
+
 vk::DeviceSize Gltf::uniformsSize() const {
-  return data_.meshes_size() * uniformSize<glm::mat4>() +
-         data_.materials_size() * uniformSize<Uniform>();
+  // Primitives without a material use the first, so there's always one
+  return materialsOffset() +
+         std::max(data_.materials_size(), 1) * sizeof(Material);
 }
 
-uint32_t Gltf::meshUniformOffset(uint32_t mesh) const {
-  return mesh * static_cast<uint32_t>(uniformSize<glm::mat4>());
+std::pair<glm::vec3, glm::vec3> Gltf::boundingBox(
+    const gltf::Primitive& prim) const {
+  const auto& position = data_.accessors(prim.attributes().position());
+  // Required by the spec, but don't cull anything if it's missing
+  if (position.min_size() != 3 || position.max_size() != 3)
+    return {glm::vec3(0), glm::vec3(INFINITY)};
+  glm::vec3 min(position.min(0), position.min(1), position.min(2));
+  glm::vec3 max(position.max(0), position.max(1), position.max(2));
+  return {(min + max) / 2.f, (max - min) / 2.f};
 }
 
-uint32_t Gltf::materialUniformOffset(uint32_t material) const {
-  return data_.meshes_size() * static_cast<uint32_t>(uniformSize<glm::mat4>()) +
-         material * static_cast<uint32_t>(uniformSize<Uniform>());
+glm::vec4 Gltf::boundingSphere(const gltf::Primitive& prim) const {
+  auto [center, extent] = boundingBox(prim);
+  return glm::vec4(center, glm::length(extent));
 }
 
+// The KTX2 image where there's one, which is swapped for the fallback at
+// load if it can't be used
 template <class T>
 uint32_t texIndex(const gltf::Gltf& data, const T& info) {
-  return data.textures(info.index()).source();
+  const gltf::Texture& texture = data.textures(info.index());
+  if (texture.extensions().khr_texture_basisu().has_source())
+    return texture.extensions().khr_texture_basisu().source();
+  return texture.source();
+}
+
+std::vector<Gltf::FlatNode> Gltf::flattenNodes() const {
+  std::vector<FlatNode> result;
+  std::vector<FlatNode> stack;
+  const auto& roots = data_.scenes(data_.scene()).nodes();
+  for (auto it = roots.rbegin(); it != roots.rend(); ++it)
+    stack.push_back({*it, -1});
+  while (!stack.empty()) {
+    FlatNode flat = stack.back();
+    stack.pop_back();
+    int32_t index = static_cast<int32_t>(result.size());
+    result.push_back(flat);
+    // Reversed so the first child comes out next
+    const auto& children = data_.nodes(flat.node).children();
+    for (auto it = children.rbegin(); it != children.rend(); ++it)
+      stack.push_back({*it, index});
+  }
+  return result;
+}
+
+glm::mat4 Gltf::localMatrix(uint32_t node) const {
+  const gltf::Node& data = data_.nodes(node);
+  glm::mat4 matrix(1.);
+  if (data.matrix_size() == 16)
+    matrix *= glm::make_mat4(data.matrix().data());
+  if (data.translation_size() == 3)
+    matrix =
+        glm::translate(matrix, glm::make_vec3(data.translation().data()));
+  if (data.rotation_size() == 4)
+    matrix *= glm::mat4(glm::make_quat(data.rotation().data()));
+  if (data.scale_size() == 3)
+    matrix = glm::scale(matrix, glm::make_vec3(data.scale().data()));
+  return matrix;
+}
+
+void Gltf::setupInstances() {
+  std::vector<uint32_t> counts(data_.meshes_size());
+  for (const FlatNode& flat : flattenNodes())
+    if (data_.nodes(flat.node).has_mesh())
+      ++counts[data_.nodes(flat.node).mesh()];
+  meshInstances_ = {0};
+  for (uint32_t count : counts)
+    meshInstances_.push_back(meshInstances_.back() + count);
+}
+
+std::vector<glm::mat4> Gltf::instanceMatrices() const {
+  return Transforms(*this).instanceMatrices();
 }
 
 void Gltf::readUniforms(char* output) const {
   std::fill_n(output, uniformsSize(), '\0');
 
-  for (uint32_t root : data_.scenes(data_.scene()).nodes()) {
-    std::vector<uint32_t> nodes = {root};
-    while (data_.nodes(nodes.back()).children_size())
-      nodes.push_back(data_.nodes(nodes.back()).children(0));
-    while (true) {
-      if (data_.nodes(nodes.back()).has_mesh()) {
-        // Apply transforms left (last) to right (first)
-        glm::mat4 result(1.);
-        for (uint32_t node : nodes) {
-          const gltf::Node data = data_.nodes(node);
-          if (data.matrix_size() == 16)
-            result *= glm::make_mat4(data.matrix().data());
-          if (data.translation_size() == 3)
-            result = glm::translate(result,
-                                    glm::make_vec3(data.translation().data()));
-          if (data.rotation_size() == 4)
-            result *= glm::mat4(glm::make_quat(data.rotation().data()));
-          if (data.scale_size() == 3)
-            result = glm::scale(result, glm::make_vec3(data.scale().data()));
-        }
-
-        size_t offset = meshUniformOffset(data_.nodes(nodes.back()).mesh());
-        std::copy_n((char*)&result, sizeof(glm::mat4), output + offset);
-      }
-
-      uint32_t prev = nodes.back();
-      nodes.pop_back();
-      if (nodes.empty()) break;  // End of tree
-
-      auto siblings = data_.nodes(nodes.back()).children();
-      auto it = std::find(siblings.begin(), siblings.end(), prev) + 1;
-      if (it != siblings.end()) {
-        nodes.push_back(*it);
-        while (data_.nodes(nodes.back()).children_size())
-          nodes.push_back(data_.nodes(nodes.back()).children(0));
-      }
-    }
-  }
+  std::vector<glm::mat4> matrices = instanceMatrices();
+  std::copy_n((char*)matrices.data(), matrices.size() * sizeof(glm::mat4),
+              output);
 
-  uint32_t matIndex = 0;
+  auto* materials = (Material*)(output + materialsOffset());
   for (const gltf::Material& mat : data_.materials()) {
     const auto& pbr = mat.pbr_metallic_roughness();
-    Uniform u;
+    Material u;
     if (pbr.base_color_factor_size() == 4)
       u.baseColorFactor_ = glm::make_vec4(pbr.base_color_factor().data());
+    u.metallicFactor_ = pbr.metallic_factor();
+    u.roughnessFactor_ = pbr.roughness_factor();
     if (pbr.has_base_color_texture())
       u.baseColorTexture = texIndex(data_, pbr.base_color_texture());
     if (pbr.has_metallic_roughness_texture())
@@ -269,9 +442,7 @@ void Gltf::readUniforms(char* output) const {
           texIndex(data_, pbr.metallic_roughness_texture());
     if (mat.has_normal_texture())
       u.normalTexture = texIndex(data_, mat.normal_texture());
-
-    size_t offset = materialUniformOffset(matIndex++);
-    std::copy_n((char*)&u, sizeof u, output + offset);
+    *materials++ = u;
   }
 }
 
@@ -300,37 +471,109 @@ constexpr stbi_io_callbacks io_callbacks = {
     [](void* user, int n) { ((StbIoData*)user)->skip(n); },
     [](void* user) { return ((StbIoData*)user)->eof(); }};
 
-std::vector<Pixels> Gltf::getImages() const {
-  std::vector<Pixels> result;
-  for (const gltf::Image& image : data_.images()) {
-    int width, height, channels;
-    unsigned char* data;
-    if (image.has_uri()) {
-      std::filesystem::path path = directory_ / image.uri();
-      //    std::filesystem::path path = "Textures/checker.png";
-      data =
-          stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
-      if (!data)
-        throw std::runtime_error(std::string("stbi_load: ") +
-                                 stbi_failure_reason() + " " + path.string());
-    } else if (image.has_buffer_view()) {
-      const gltf::BufferView& bufferView =
-          data_.buffer_views(image.buffer_view());
-      size_t current = bufferStart_ + bufferView.byte_offset();
-      size_t end = current + bufferView.byte_length();
-      file_.seekg(current);
-      StbIoData ioData = {file_, current, end};
-      data = stbi_load_from_callbacks(&io_callbacks, &ioData, &width, &height,
-                                      &channels, STBI_rgb_alpha);
-      if (!data)
-        throw std::runtime_error(std::string("stbi_load: ") +
-                                 stbi_failure_reason());
-    } else
-      throw std::runtime_error("No image data");
-    result.emplace_back(width, height, data);
+Pixels Gltf::getImage(uint32_t index) const {
+  const gltf::Image& image = data_.images(index);
+  if (isKtx2(index))
+    throw std::runtime_error("KTX2 images can't be decoded to pixels");
+  int width, height, channels;
+  unsigned char* data;
+  if (image.has_uri()) {
+    std::filesystem::path path = directory_ / image.uri();
+    //    std::filesystem::path path = "Textures/checker.png";
+    data =
+        stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+    if (!data)
+      throw std::runtime_error(std::string("stbi_load: ") +
+                               stbi_failure_reason() + " " + path.string());
+  } else if (image.has_buffer_view()) {
+    const gltf::BufferView& bufferView =
+        data_.buffer_views(image.buffer_view());
+    size_t current = bufferStart_ + bufferView.byte_offset();
+    size_t end = current + bufferView.byte_length();
+    file_.seekg(current);
+    StbIoData ioData = {file_, current, end};
+    data = stbi_load_from_callbacks(&io_callbacks, &ioData, &width, &height,
+                                    &channels, STBI_rgb_alpha);
+    if (!data)
+      throw std::runtime_error(std::string("stbi_load: ") +
+                               stbi_failure_reason());
+  } else
+    throw std::runtime_error("No image data");
+  return Pixels(width, height, data);
+}
+
+std::vector<ImageRole> Gltf::imageRoles() const {
+  std::vector<ImageRole> roles(data_.images_size(), ImageRole::kColor);
+  std::vector<bool> color(data_.images_size());
+  for (const gltf::Material& mat : data_.materials()) {
+    const auto& pbr = mat.pbr_metallic_roughness();
+    if (mat.has_normal_texture())
+      roles[texIndex(data_, mat.normal_texture())] = ImageRole::kNormal;
+    if (pbr.has_metallic_roughness_texture())
+      roles[texIndex(data_, pbr.metallic_roughness_texture())] =
+          ImageRole::kData;
+    if (pbr.has_base_color_texture())
+      color[texIndex(data_, pbr.base_color_texture())] = true;
   }
+  for (uint32_t image = 0; image < roles.size(); ++image)
+    if (color[image]) roles[image] = ImageRole::kColor;
+  // Fallbacks are used the same way as the KTX2 image they stand in for
+  for (const gltf::Texture& texture : data_.textures())
+    if (texture.extensions().khr_texture_basisu().has_source() &&
+        texture.has_source())
+      roles[texture.source()] =
+          roles[texture.extensions().khr_texture_basisu().source()];
+  return roles;
+}
+
+std::vector<char> Gltf::readBufferView(uint32_t index) const {
+  const gltf::BufferView& bufferView = data_.buffer_views(index);
+  std::vector<char> result(bufferView.byte_length());
+  file_.seekg(bufferStart_ + bufferView.byte_offset());
+  file_.read(result.data(), result.size());
   return result;
 }
 
+bool Gltf::isKtx2(uint32_t index) const {
+  const gltf::Image& image = data_.images(index);
+  return image.mime_type() == "image/ktx2" ||
+         (image.has_uri() &&
+          std::filesystem::path(image.uri()).extension() == ".ktx2");
+}
+
+std::vector<char> Gltf::readImage(uint32_t index) const {
+  const gltf::Image& image = data_.images(index);
+  if (image.has_buffer_view()) return readBufferView(image.buffer_view());
+  if (!image.has_uri()) throw std::runtime_error("No image data");
+  std::filesystem::path path = directory_ / image.uri();
+  std::ifstream file(path, std::ios::ate | std::ios::binary);
+  if (!file) throw std::runtime_error("Can't open " + path.string());
+  std::vector<char> result(file.tellg());
+  file.seekg(0);
+  file.read(result.data(), result.size());
+  return result;
+}
+
+uint32_t Gltf::fallbackImage(uint32_t ktx2Image) const {
+  for (const gltf::Texture& texture : data_.textures())
+    if (texture.extensions().khr_texture_basisu().has_source() &&
+        texture.extensions().khr_texture_basisu().source() == ktx2Image &&
+        texture.has_source())
+      return texture.source();
+  throw std::runtime_error(
+      "KTX2 image isn't raw BC or ETC the device supports, Basis Universal "
+      "isn't transcoded, and it has no fallback");
+}
+
+bool Gltf::isOnlyFallback(uint32_t image) const {
+  bool fallback = false;
+  for (const gltf::Texture& texture : data_.textures()) {
+    if (!texture.has_source() || texture.source() != image) continue;
+    if (!texture.extensions().khr_texture_basisu().has_source()) return false;
+    fallback = true;
+  }
+  return fallback;
+}
+
 Pixels::Pixels(int w, int h, unsigned char* d)
     : width_(w), height_(h), data_(d, stbi_image_free) {}
@@ -5,11 +5,20 @@
 #include <vulkan/vulkan.hpp>
 #include <filesystem>
 #include <fstream>
+#include "glm/vec3.hpp"
 #include "glm/vec4.hpp"
+#include "glm/mat4x4.hpp"
 
-struct Uniform {
+// Matches Material in shading.glsl. Packed in a storage buffer, so padded to
+// the std430 array stride.
+struct alignas(16) Material {
+  // For textures a material doesn't have, which the fallback pipeline checks
+  // for since its constants can't say
+  static constexpr uint32_t kNoTexture = UINT32_MAX;
   glm::vec4 baseColorFactor_ = glm::vec4(1);
-  uint32_t baseColorTexture, normalTexture, metallicRoughnessTexture;
+  uint32_t baseColorTexture = kNoTexture, normalTexture = kNoTexture,
+           metallicRoughnessTexture = kNoTexture;
+  float metallicFactor_ = 1, roughnessFactor_ = 1;
 };
 
 struct Pixels {
@@ -21,19 +30,68 @@ struct Pixels {
   vk::Extent3D extent() const { return {width_, height_, 1}; }
 };
 
+// What materials use an image for, which decides how it's filtered and
+// compressed
+enum class ImageRole {
+  kColor,   // Base color, in sRGB
+  kNormal,  // Tangent space normals, of which only x and y are needed
+  kData,    // Metallic roughness, linear
+};
+
 struct Gltf {
   Gltf(std::filesystem::path path);
+  // Also block compresses every image into the formats compression.hpp
+  // picks for its role, which takes a while for big textures
   void save(std::filesystem::path path);
 
-  vk::DeviceSize bufferSize() const;
-  void readBuffers(char* output) const;
+  uint32_t vertexCount() const { return data_.buffers(0).vertex_count(); }
+  uint32_t indexCount() const { return data_.buffers(0).index_count(); }
+  void readBuffers(char* vertices, char* indices) const;
+  // All components of an accessor, tightly packed. Integer components read
+  // as floats are normalized.
+  std::vector<float> readFloats(uint32_t accessor) const;
+  std::vector<uint32_t> readUints(uint32_t accessor) const;
   vk::DeviceSize uniformsSize() const;
   void readUniforms(char* output) const;
-  std::vector<Pixels> getImages() const;
+  Pixels getImage(uint32_t image) const;
+  // Per image. Used as base color anywhere makes it color.
+  std::vector<ImageRole> imageRoles() const;
+  std::vector<char> readBufferView(uint32_t bufferView) const;
+  // KTX2 images are never decoded to Pixels, see readKtx2
+  bool isKtx2(uint32_t image) const;
+  // The file as it's stored, from its uri or buffer view
+  std::vector<char> readImage(uint32_t image) const;
+  // The image a texture names besides a KTX2 one, for when it can't be used
+  uint32_t fallbackImage(uint32_t ktx2Image) const;
+  // Whether textures only name it as a KTX2 image's fallback, so it's only
+  // needed if that can't be used
+  bool isOnlyFallback(uint32_t image) const;
   uint32_t meshCount() const { return data_.meshes_size(); }
-  uint32_t meshUniformOffset(uint32_t mesh) const;
+  // Every node with a mesh is an instance of it. Instances are grouped by
+  // mesh, and their matrices packed at the start of the uniforms, with the
+  // materials packed after them.
+  uint32_t instanceCount() const { return meshInstances_.back(); }
+  uint32_t firstInstance(uint32_t mesh) const { return meshInstances_[mesh]; }
+  uint32_t instanceCount(uint32_t mesh) const {
+    return meshInstances_[mesh + 1] - meshInstances_[mesh];
+  }
   uint32_t materialCount() const { return data_.materials_size(); }
-  uint32_t materialUniformOffset(uint32_t material) const;
+  vk::DeviceSize materialsOffset() const;
+  // World transform of each instance, from the nodes above it
+  std::vector<glm::mat4> instanceMatrices() const;
+  // The scene's nodes depth first, so parents come before their children and
+  // every subtree is contiguous
+  struct FlatNode {
+    uint32_t node;
+    int32_t parent;  // Index into the flat nodes, -1 for roots
+  };
+  std::vector<FlatNode> flattenNodes() const;
+  glm::mat4 localMatrix(uint32_t node) const;
+  // Center and half extents, from the position accessor's min and max
+  std::pair<glm::vec3, glm::vec3> boundingBox(
+      const gltf::Primitive& prim) const;
+  // Center and radius, around the bounding box
+  glm::vec4 boundingSphere(const gltf::Primitive& prim) const;
   
   gltf::Gltf data_;
   std::filesystem::path directory_;
@@ -41,9 +99,13 @@ struct Gltf {
   long long bufferStart_;
   
 private:
+  // Where each mesh's instances start, and the total at the end
+  std::vector<uint32_t> meshInstances_;
+  std::vector<char> readComponents(uint32_t accessor) const;
   void readJSON(size_t length);
   void openBinFile();
   void setupVulkanData();
+  void setupInstances();
 };
 
 #endif /* gltf_hpp */
@@ -1,4 +1,6 @@
+#include <chrono>
 #include <iostream>
+#include <memory>
 
 #include "driver.hpp"
 #include "swapchain.hpp"
@@ -6,6 +8,12 @@
 #include "rendering.hpp"
 #include "util.hpp"
 #include "gltf.hpp"
+#include "culling.hpp"
+#include "occlusion.hpp"
+#include "transforms.hpp"
+#include "animation.hpp"
+#include "skinning.hpp"
+#include "workers.hpp"
 
 void mainApp() {
   std::ios_base::sync_with_stdio(false);
@@ -16,6 +24,7 @@ void mainApp() {
   Swapchain swapchain;
   RenderPass renderPass;
   FpsCount fpsCount;
+  PipelineCache pipelineCache("pipelines.cache");
 
 //    Gltf gltffile("models/MetalRough/MetalRoughSpheres.gltf");
   //  Gltf gltffile("models/2CylinderEngine/2CylinderEngine.gltf");
@@ -24,65 +33,171 @@ void mainApp() {
 //      "/Users/dan/Projects/VulkanFuntimes/Resources/models/DamagedHelmet.glpb");
   // Gltf gltffile("models/viking_room/scene.gltf");
 
-  Pipeline pipeline1(gltffile);
+  // Fetches vertices in the vertex shader instead of through vertex input
+  constexpr bool kVertexPulling = false;
+  // Draws depth before shading, for scenes with lots of overdraw. Compare the
+  // overdraw it prints with and without.
+  constexpr bool kDepthPrepass = false;
+  // Binds textures as one descriptor array of separate images where the
+  // device has descriptor indexing, so they needn't all be the same size
+  bool bindless = gMaxBindlessDescriptors > 0;
+  auto pipelineStart = std::chrono::high_resolution_clock::now();
+  Pipeline pipeline1(gltffile,
+                     /*indirect=*/gEnabledFeatures.drawIndirectFirstInstance,
+                     kVertexPulling, kDepthPrepass, bindless);
+  std::cerr << "fallback pipelines created in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::high_resolution_clock::now() - pipelineStart)
+                   .count()
+            << "us from a " << (pipelineCache.warm_ ? "warm" : "cold")
+            << " cache\n";
 
   TransferManager transferManager;
-  VertexBuffers vertexBuffers1(gltffile);
-  Textures textures1(gltffile);
+  GeometryHeap geometryHeap;
+  uint32_t model1 = geometryHeap.load(gltffile);
+  // Compare the frame time of minified textures with kNone
+  constexpr MipGeneration kMips = MipGeneration::kBlit;
+  auto texturesStart = std::chrono::high_resolution_clock::now();
+  Textures textures1(gltffile, bindless, kMips);
+  std::cerr << "textures loaded in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::high_resolution_clock::now() - texturesStart)
+                   .count()
+            << "us, " << textures1.bytes_ / 1024 << "KiB\n";
   DescriptorPool descriptorPool1(pipeline1.descriptorSetLayout_, textures1,
                                  gltffile);
+  descriptorPool1.setVertices(geometryHeap);
+  DrawList drawList1(gltffile, geometryHeap.model(model1));
+  Transforms transforms1(gltffile);
+  Animations animations1(gltffile);
+  Skinning skinning1(gltffile, geometryHeap, model1);
+  IndirectDraws indirectDraws1(drawList1, descriptorPool1);
+
+  Semaphores semaphores;
+  DepthStencil depthStencil;
+  Framebuffers framebuffers;
+  // Record large scenes' draws and rasterize occluders in parallel
+  Workers workers;
+  CommandPool commandPool(/*recordingThreads=*/workers.size());
+  OverdrawQueries overdrawQueries;
+  // Only indirect draws can be culled on the GPU
+  std::unique_ptr<GpuCulling> gpuCulling;
+  std::unique_ptr<CpuCulling> cpuCulling;
+  // Only pays off in scenes with big occluders in front of many draws, see
+  // the stats it prints
+  constexpr bool kSoftwareOcclusion = true;
+  std::unique_ptr<SoftwareOcclusion> occlusion;
+  if (pipeline1.indirect_) {
+    gpuCulling = std::make_unique<GpuCulling>(indirectDraws1, descriptorPool1);
+  } else {
+    cpuCulling = std::make_unique<CpuCulling>(transforms1.instanceMatrices(),
+                                              drawList1);
+    if (kSoftwareOcclusion)
+      occlusion = std::make_unique<SoftwareOcclusion>(
+          gltffile, geometryHeap.model(model1), drawList1, *cpuCulling);
+  }
+
+  // Every pipeline has been made by now
+  pipelineCache.save();
 
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::microseconds recordTime{0};
+  uint32_t recordedFrames = 0;
   while (!glfwWindowShouldClose(gWindow)) {
-    swapchain.resizeToWindow();
-    Semaphores semaphores;
-    DepthStencil depthStencil;
-    Framebuffers framebuffers;
-    CommandPool commandPool;
-    gWindowSizeChanged = false;
-    std::cerr << "resize " << gSwapchainExtent.width << "x"
-              << gSwapchainExtent.height << "\n";
-
-    vk::Semaphore imageAvailableSemaphore = swapchain.getFirstImage();
-    while (!glfwWindowShouldClose(gWindow) && !gWindowSizeChanged) {
-      // Pause while the window is in the background
-      while (!glfwGetWindowAttrib(gWindow, GLFW_FOCUSED)) {
-        std::cerr << "pausing\n";
-        glfwWaitEvents();
-      }
-
-      if (gInFlightFences[gSwapchainCurrentImage]) {
-        throwFail("waitForFences",
-                  gDevice.waitForFences(gInFlightFences[gSwapchainCurrentImage],
-                                        /*waitAll=*/false,
-                                        /*timeout=*/UINT64_MAX));
-        gDevice.resetFences(gInFlightFences[gSwapchainCurrentImage]);
-      }
-
-      descriptorPool1.updateCamera();
-
-      CommandBuffer commandBuffer1(pipeline1, descriptorPool1, vertexBuffers1,
-                                   gltffile);
-
-      vk::Semaphore renderFinishedSemaphore =
-          gRenderFinishedSemaphores[gSwapchainCurrentImage];
-      vk::PipelineStageFlags waitDestStage(
-          vk::PipelineStageFlagBits::eColorAttachmentOutput);
-      vk::SubmitInfo submit(/*wait=*/imageAvailableSemaphore, waitDestStage,
-                            commandBuffer1.buf_,
-                            /*signal=*/renderFinishedSemaphore);
-
-      gInFlightFences[gSwapchainCurrentImage] =
-          gFrameFences[gSwapchainCurrentImage];
-      gGraphicsQueue.submit({submit}, gInFlightFences[gSwapchainCurrentImage]);
-
-      imageAvailableSemaphore = swapchain.getNextImage(renderFinishedSemaphore);
-
-      glfwPollEvents();
-      fpsCount.count();
-      if (gFrame % 100 == 0) transferManager.collectGarbage();
+    // Pause while the window is in the background
+    while (!glfwGetWindowAttrib(gWindow, GLFW_FOCUSED)) {
+      std::cerr << "pausing\n";
+      glfwWaitEvents();
+    }
+
+    if (gWindowSizeChanged) {
+      // Nothing is waited for here, old objects are retired instead
+      gWindowSizeChanged = false;
+      swapchain.resizeToWindow();
+      semaphores.resizeToSwapchain();
+      depthStencil.resizeToSwapchain();
+      if (gpuCulling) gpuCulling->resizeToSwapchain();
+      framebuffers.resizeToSwapchain();
+      commandPool.resizeToSwapchain();
+      overdrawQueries.resizeToSwapchain();
+      std::cerr << "resize " << gSwapchainExtent.width << "x"
+                << gSwapchainExtent.height << "\n";
+    }
+
+    vk::Semaphore imageAvailableSemaphore = swapchain.acquireImage();
+    if (!imageAvailableSemaphore) continue;
+
+    waitForImage(gSwapchainCurrentImage);
+    overdrawQueries.collect(gSwapchainCurrentImage);
+
+    animations1.update(std::chrono::duration<float>(
+                           std::chrono::steady_clock::now() - start)
+                           .count(),
+                       transforms1);
+    // Only what moved since the last frame is recomputed and uploaded
+    auto changed = transforms1.update();
+    if (!changed.empty()) {
+      descriptorPool1.updateInstances(transforms1, changed);
+      if (cpuCulling)
+        cpuCulling->update(transforms1.instanceMatrices(), drawList1);
+    }
+
+    descriptorPool1.updateCamera();
+    // Skinned once here for every pass that draws the skinned meshes
+    skinning1.update(transforms1);
+    if (cpuCulling) cpuCulling->cull(descriptorPool1.currentCamera_);
+    // Before recording, so only what survives is recorded
+    if (occlusion)
+      occlusion->cull(descriptorPool1.currentCamera_, transforms1,
+                      *cpuCulling, workers);
+
+    // Variants still compiling are drawn with the fallback meanwhile, and
+    // saved once they're all done so a crash doesn't lose them
+    if (pipeline1.update(drawList1)) pipelineCache.save();
+    // Reused as it was when nothing it was recorded from changed
+    auto recordStart = std::chrono::high_resolution_clock::now();
+    CommandBuffer commandBuffer1(pipeline1, descriptorPool1, geometryHeap,
+                                 drawList1, indirectDraws1, gpuCulling.get(),
+                                 cpuCulling.get(), &overdrawQueries, &workers);
+    if (commandBuffer1.recorded_) {
+      recordTime = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::high_resolution_clock::now() - recordStart);
+      ++recordedFrames;
+    }
+
+    vk::Semaphore renderFinishedSemaphore =
+        gRenderFinishedSemaphores[gSwapchainCurrentImage];
+    vk::PipelineStageFlags waitDestStage(
+        vk::PipelineStageFlagBits::eColorAttachmentOutput);
+    vk::SubmitInfo submit(/*wait=*/imageAvailableSemaphore, waitDestStage,
+                          commandBuffer1.buf_,
+                          /*signal=*/renderFinishedSemaphore);
+    submitFrame(gSwapchainCurrentImage, submit);
+
+    swapchain.presentImage(renderFinishedSemaphore);
+
+    glfwPollEvents();
+    if (fpsCount.count()) {
+      std::cerr << recordedFrames << "/" << FpsCount::kInterval
+                << " frames recorded, last in " << recordTime.count()
+                << "us with up to " << workers.size() << " threads\n";
+      recordedFrames = 0;
+      std::cerr << overdrawQueries.overdraw_ << " shaded samples per pixel"
+                << (pipeline1.depthPrepass_ ? " after depth prepass\n"
+                                            : "\n");
+      if (cpuCulling)
+        std::cerr << cpuCulling->stats_.visible << "/"
+                  << cpuCulling->stats_.tested << " draws visible\n";
+      if (occlusion)
+        std::cerr << occlusion->stats_.occluded << "/"
+                  << occlusion->stats_.tested << " draws occluded in "
+                  << occlusion->stats_.rasterTime.count() << "+"
+                  << occlusion->stats_.testTime.count() << "us\n";
     }
-    gGraphicsQueue.waitIdle();
+    transferManager.collectGarbage();
   }
+  gGraphicsQueue.waitIdle();
+  collectAllRetired();
 }
 
 int main(int argc, const char *argv[]) {
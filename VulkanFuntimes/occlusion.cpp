@@ -0,0 +1,238 @@
+#include "occlusion.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+SoftwareOcclusion::SoftwareOcclusion(const Gltf& gltf,
+                                     const GeometryHeap::Model& geometry,
+                                     const DrawList& draws,
+                                     const CpuCulling& culling)
+    : depth_(kWidth * kHeight), blockDepth_(kBlocksX * kBlocksY) {
+  // Biggest in world space first, skipping anything without bounds
+  std::vector<uint32_t> order(culling.size_);
+  std::iota(order.begin(), order.end(), 0);
+  order.erase(std::remove_if(order.begin(), order.end(),
+                             [&](uint32_t i) {
+                               return !std::isfinite(culling.radius_[i]);
+                             }),
+              order.end());
+  std::sort(order.begin(), order.end(), [&](uint32_t l, uint32_t r) {
+    return culling.radius_[l] > culling.radius_[r];
+  });
+
+  std::vector<Vertex> vertices(gltf.vertexCount());
+  std::vector<Index> indices(gltf.indexCount());
+  gltf.readBuffers((char*)vertices.data(), (char*)indices.data());
+  uint32_t triangles = 0;
+  for (uint32_t i : order) {
+    uint32_t drawTriangles = draws.indexCount_[i] / 3 * draws.instanceCount_[i];
+    if (triangles + drawTriangles > kMaxTriangles) continue;
+    triangles += drawTriangles;
+    const Index* inds = &indices[draws.firstIndex_[i] - geometry.firstIndex];
+    const Vertex* verts =
+        &vertices[draws.vertexOffset_[i] - int32_t(geometry.firstVertex)];
+    uint32_t first = static_cast<uint32_t>(vertices_.size());
+    uint32_t count = draws.indexCount_[i] / 3 * 3;
+    for (uint32_t j = 0; j < count; ++j)
+      vertices_.push_back(verts[inds[j]].position);
+    for (uint32_t instance = 0; instance < draws.instanceCount_[i];
+         ++instance)
+      occluders_.push_back({draws.firstInstance_[i] + instance, first, count});
+  }
+}
+
+void SoftwareOcclusion::cull(const Camera& camera,
+                             const Transforms& transforms,
+                             CpuCulling& culling, Workers& workers) {
+  auto start = std::chrono::high_resolution_clock::now();
+  glm::mat4 viewProj = camera.proj * camera.eye;
+  screen_.clear();
+  for (const Occluder& occluder : occluders_) {
+    // Instances move with animation, so the model space vertices go through
+    // this frame's matrix
+    glm::mat4 modelViewProj =
+        viewProj *
+        transforms.world_[transforms.instanceNode_[occluder.instance]];
+    for (uint32_t i = occluder.first; i < occluder.first + occluder.count;
+         i += 3) {
+      glm::vec3 screen[3];
+      bool inFront = true;
+      for (int v = 0; v < 3; ++v) {
+        glm::vec4 clip = modelViewProj * glm::vec4(vertices_[i + v], 1);
+        // Triangles through the near plane are dropped instead of clipped,
+        // which only means they hide less
+        inFront = inFront && clip.z >= 0;
+        screen[v] = glm::vec3((clip.x / clip.w * .5f + .5f) * kWidth,
+                              (clip.y / clip.w * .5f + .5f) * kHeight,
+                              clip.z / clip.w);
+      }
+      if (inFront) screen_.push_back({screen[0], screen[1], screen[2]});
+    }
+  }
+
+  std::fill(depth_.begin(), depth_.end(), 1.f);
+  workers.run(kTilesX * kTilesY, [&](uint32_t tile) {
+    rasterizeTile(tile % kTilesX, tile / kTilesX);
+  });
+  auto rasterized = std::chrono::high_resolution_clock::now();
+
+  uint32_t tested = static_cast<uint32_t>(culling.visible_.size());
+  auto hidden = [&](uint32_t i) {
+    return occluded(
+        viewProj,
+        glm::vec3(culling.centerX_[i], culling.centerY_[i],
+                  culling.centerZ_[i]),
+        glm::vec3(culling.extentX_[i], culling.extentY_[i],
+                  culling.extentZ_[i]));
+  };
+  culling.visible_.erase(std::remove_if(culling.visible_.begin(),
+                                        culling.visible_.end(), hidden),
+                         culling.visible_.end());
+  auto end = std::chrono::high_resolution_clock::now();
+
+  stats_.tested = tested;
+  stats_.occluded = tested - static_cast<uint32_t>(culling.visible_.size());
+  stats_.rasterTime = std::chrono::duration_cast<std::chrono::microseconds>(
+      rasterized - start);
+  stats_.testTime =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - rasterized);
+}
+
+void SoftwareOcclusion::rasterizeTile(uint32_t tileX, uint32_t tileY) {
+  int minX = tileX * kTileWidth, maxX = minX + kTileWidth - 1;
+  int minY = tileY * kTileHeight, maxY = minY + kTileHeight - 1;
+
+  for (const ScreenTriangle& tri : screen_) {
+    glm::vec3 a = tri.a, b = tri.b, c = tri.c;
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (area == 0) continue;
+    // Occluders are seen from both sides
+    if (area < 0) {
+      std::swap(b, c);
+      area = -area;
+    }
+
+    float left = std::min({a.x, b.x, c.x}), right = std::max({a.x, b.x, c.x});
+    float top = std::min({a.y, b.y, c.y}), bottom = std::max({a.y, b.y, c.y});
+    if (right < minX || left > maxX + 1 || bottom < minY || top > maxY + 1)
+      continue;
+    // Starts on a multiple of 4 so spans stay inside the tile
+    int x0 = int(std::max(float(minX), left)) & ~3;
+    int x1 = int(std::min(float(maxX), right));
+    int y0 = int(std::max(float(minY), top));
+    int y1 = int(std::min(float(maxY), bottom));
+
+    // Edge functions, positive inside, opposite a, b and c
+    glm::vec3 edges[3];
+    auto edge = [](glm::vec3 p, glm::vec3 q) {
+      float dx = q.x - p.x, dy = q.y - p.y;
+      return glm::vec3(-dy, dx, dy * p.x - dx * p.y);
+    };
+    edges[0] = edge(b, c);
+    edges[1] = edge(c, a);
+    edges[2] = edge(a, b);
+    // Depth is linear in screen space
+    glm::vec3 depth =
+        (edges[0] * a.z + edges[1] * b.z + edges[2] * c.z) / area;
+
+    for (int y = y0; y <= y1; ++y) {
+      float py = y + .5f;
+      float* row = &depth_[y * kWidth];
+#if defined(__SSE__)
+      __m128 zero = _mm_setzero_ps();
+      __m128 rowEdges[3], rowSteps[3];
+      for (int e = 0; e < 3; ++e) {
+        rowEdges[e] = _mm_set1_ps(edges[e].y * py + edges[e].z);
+        rowSteps[e] = _mm_set1_ps(edges[e].x);
+      }
+      __m128 rowDepth = _mm_set1_ps(depth.y * py + depth.z);
+      __m128 depthStep = _mm_set1_ps(depth.x);
+      for (int x = x0; x <= x1; x += 4) {
+        __m128 px = _mm_add_ps(_mm_set1_ps(x + .5f),
+                               _mm_set_ps(3.f, 2.f, 1.f, 0.f));
+        __m128 inside = _mm_cmpeq_ps(zero, zero);
+        for (int e = 0; e < 3; ++e)
+          inside = _mm_and_ps(
+              inside,
+              _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(rowSteps[e], px), rowEdges[e]),
+                           zero));
+        __m128 z = _mm_add_ps(_mm_mul_ps(depthStep, px), rowDepth);
+        __m128 old = _mm_loadu_ps(row + x);
+        __m128 nearer = _mm_min_ps(old, z);
+        _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer),
+                                         _mm_andnot_ps(inside, old)));
+      }
+#else
+      for (int x = x0; x <= x1; ++x) {
+        float px = x + .5f;
+        bool inside = true;
+        for (int e = 0; e < 3; ++e)
+          inside = inside && edges[e].x * px + edges[e].y * py + edges[e].z >= 0;
+        float z = depth.x * px + depth.y * py + depth.z;
+        if (inside) row[x] = std::min(row[x], z);
+      }
+#endif
+    }
+  }
+
+  for (uint32_t blockY = minY / kBlockSize; blockY <= maxY / kBlockSize;
+       ++blockY)
+    for (uint32_t blockX = minX / kBlockSize; blockX <= maxX / kBlockSize;
+         ++blockX) {
+      float farthest = 0;
+      for (uint32_t y = blockY * kBlockSize; y < (blockY + 1) * kBlockSize; ++y)
+        for (uint32_t x = blockX * kBlockSize; x < (blockX + 1) * kBlockSize;
+             ++x)
+          farthest = std::max(farthest, depth_[y * kWidth + x]);
+      blockDepth_[blockY * kBlocksX + blockX] = farthest;
+    }
+}
+
+bool SoftwareOcclusion::occluded(const glm::mat4& viewProj, glm::vec3 center,
+                                 glm::vec3 extent) const {
+  if (!std::isfinite(extent.x + extent.y + extent.z)) return false;
+
+  // Screen rectangle and nearest depth of the box's corners
+  float left = INFINITY, right = -INFINITY, top = INFINITY,
+        bottom = -INFINITY, nearest = INFINITY;
+  for (int corner = 0; corner < 8; ++corner) {
+    glm::vec3 sign(corner & 1 ? 1 : -1, corner & 2 ? 1 : -1,
+                   corner & 4 ? 1 : -1);
+    glm::vec4 clip = viewProj * glm::vec4(center + extent * sign, 1);
+    if (clip.z < 0) return false;  // Reaches past the near plane
+    float x = (clip.x / clip.w * .5f + .5f) * kWidth;
+    float y = (clip.y / clip.w * .5f + .5f) * kHeight;
+    left = std::min(left, x);
+    right = std::max(right, x);
+    top = std::min(top, y);
+    bottom = std::max(bottom, y);
+    nearest = std::min(nearest, clip.z / clip.w);
+  }
+  if (right < 0 || left >= kWidth || bottom < 0 || top >= kHeight)
+    return false;
+  // Occluders only cover pixels whose centers they touch, so the rectangle
+  // grows by a pixel to see through gaps narrower than one
+  int x0 = int(std::max(0.f, left - 1));
+  int x1 = int(std::min(kWidth - 1.f, right + 1));
+  int y0 = int(std::max(0.f, top - 1));
+  int y1 = int(std::min(kHeight - 1.f, bottom + 1));
+
+  // Only look at the pixels of blocks that aren't all in front of the box
+  constexpr int blockSize = kBlockSize;
+  for (int blockY = y0 / blockSize; blockY <= y1 / blockSize; ++blockY)
+    for (int blockX = x0 / blockSize; blockX <= x1 / blockSize; ++blockX) {
+      if (blockDepth_[blockY * kBlocksX + blockX] < nearest) continue;
+      int blockTop = std::max(y0, blockY * blockSize);
+      int blockBottom = std::min(y1, (blockY + 1) * blockSize - 1);
+      int blockLeft = std::max(x0, blockX * blockSize);
+      int blockRight = std::min(x1, (blockX + 1) * blockSize - 1);
+      for (int y = blockTop; y <= blockBottom; ++y)
+        for (int x = blockLeft; x <= blockRight; ++x)
+          if (depth_[y * kWidth + x] >= nearest) return false;
+    }
+  return true;
+}
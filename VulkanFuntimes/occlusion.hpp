@@ -0,0 +1,62 @@
+#ifndef occlusion_hpp
+#define occlusion_hpp
+
+#include <chrono>
+#include "glm/mat4x4.hpp"
+#include "glm/vec3.hpp"
+
+#include "culling.hpp"
+#include "gltf.hpp"
+#include "rendering.hpp"
+#include "transforms.hpp"
+#include "workers.hpp"
+
+// A low resolution depth buffer rasterized on the CPU from the biggest draws
+// in the scene. Draws CpuCulling found in the frustum are tested against it
+// before recording. Screen tiles are rasterized in parallel on the workers.
+struct SoftwareOcclusion {
+  static constexpr uint32_t kWidth = 256, kHeight = 144;
+  static constexpr uint32_t kTilesX = 4, kTilesY = 2;
+  static constexpr uint32_t kTileWidth = kWidth / kTilesX;
+  static constexpr uint32_t kTileHeight = kHeight / kTilesY;
+  // Each block keeps the farthest depth in it
+  static constexpr uint32_t kBlockSize = 8;
+  static constexpr uint32_t kBlocksX = kWidth / kBlockSize;
+  static constexpr uint32_t kBlocksY = kHeight / kBlockSize;
+  // Occluders are picked biggest first up to this many triangles
+  static constexpr uint32_t kMaxTriangles = 1 << 15;
+
+  SoftwareOcclusion(const Gltf& gltf, const GeometryHeap::Model& geometry,
+                    const DrawList& draws, const CpuCulling& culling);
+  // Removes draws hidden behind the occluders from culling.visible_
+  void cull(const Camera& camera, const Transforms& transforms,
+            CpuCulling& culling, Workers& workers);
+
+  // Model space, three vertices per triangle, shared by a mesh's instances
+  std::vector<glm::vec3> vertices_;
+  struct Occluder {
+    uint32_t instance;
+    uint32_t first, count;  // Into vertices_
+  };
+  std::vector<Occluder> occluders_;
+  std::vector<float> depth_;
+  std::vector<float> blockDepth_;
+
+  // From the last cull
+  struct Stats {
+    uint32_t tested, occluded;
+    std::chrono::microseconds rasterTime, testTime;
+  } stats_ = {};
+
+ private:
+  // x and y in pixels, z is depth
+  struct ScreenTriangle {
+    glm::vec3 a, b, c;
+  };
+  std::vector<ScreenTriangle> screen_;
+  void rasterizeTile(uint32_t tileX, uint32_t tileY);
+  bool occluded(const glm::mat4& viewProj, glm::vec3 center,
+                glm::vec3 extent) const;
+};
+
+#endif /* occlusion_hpp */
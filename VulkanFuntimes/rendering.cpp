@@ -2,6 +2,12 @@
 
 #include <fstream>
 #include <chrono>
+#include <algorithm>
+#include <tuple>
+#include <numeric>
+#include <cmath>
+#include <future>
+#include <array>
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include "glm/vec2.hpp"
 #include "glm/vec3.hpp"
@@ -11,6 +17,8 @@
 #include "util.hpp"
 #include "driver.hpp"
 #include "swapchain.hpp"
+#include "culling.hpp"
+#include "workers.hpp"
 
 vk::ShaderModule readShader(const std::string &filename) {
   std::ifstream file(filename, std::ios::ate | std::ios::binary);
@@ -23,7 +31,106 @@ vk::ShaderModule readShader(const std::string &filename) {
   return gDevice.createShaderModule({vk::ShaderModuleCreateFlags(), buffer});
 }
 
-Pipeline::Pipeline(const Gltf &model) {
+uint32_t pipelineKey(const Gltf &gltf, uint32_t material) {
+  if (material >= gltf.data_.materials_size()) return 0;
+  const gltf::Material &data = gltf.data_.materials(material);
+  uint32_t key = 0;
+  if (data.double_sided()) key |= kDoubleSided;
+  const auto &pbr = data.pbr_metallic_roughness();
+  if (!pbr.has_base_color_texture()) key |= kNoBaseColorTexture;
+  if (!data.has_normal_texture()) key |= kNoNormalTexture;
+  if (!pbr.has_metallic_roughness_texture())
+    key |= kNoMetallicRoughnessTexture;
+  if (data.alpha_mode() == gltf::Material::BLEND) key |= kAlphaBlend;
+  return key;
+}
+
+Pipeline::Pipeline(const Gltf &model, bool indirect, bool vertexPulling,
+                   bool depthPrepass, bool bindless)
+    : indirect_(indirect),
+      vertexPulling_(vertexPulling),
+      depthPrepass_(depthPrepass),
+      bindless_(bindless) {
+  vk::SamplerCreateInfo samplerCreate(/*flags=*/{}, vk::Filter::eLinear,
+                                      vk::Filter::eLinear,
+                                      vk::SamplerMipmapMode::eLinear);
+  samplerCreate.setAnisotropyEnable(true);
+  // Every mip Textures made
+  samplerCreate.setMaxLod(VK_LOD_CLAMP_NONE);
+  samplerCreate.setMaxAnisotropy(
+      gPhysicalDeviceProperties.limits.maxSamplerAnisotropy);
+  sampler_ = gDevice.createSampler(samplerCreate);
+
+  std::vector<vk::DescriptorSetLayoutBinding> bindings = {
+      {/*binding=*/0, vk::DescriptorType::eUniformBuffer,
+       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eVertex,
+       /*immutableSamplers=*/nullptr},
+      {/*binding=*/5, vk::DescriptorType::eStorageBuffer,
+       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eVertex,
+       /*immutableSamplers=*/nullptr},
+      {/*binding=*/6, vk::DescriptorType::eStorageBuffer,
+       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eVertex,
+       /*immutableSamplers=*/nullptr},
+      {/*binding=*/7, vk::DescriptorType::eStorageBuffer,
+       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eFragment,
+       /*immutableSamplers=*/nullptr},
+      {/*binding=*/8, vk::DescriptorType::eStorageBuffer,
+       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eVertex,
+       /*immutableSamplers=*/nullptr},
+      {/*binding=*/9, vk::DescriptorType::eStorageBuffer,
+       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eVertex,
+       /*immutableSamplers=*/nullptr},
+  };
+  // Textures can be added while the set is bound, see Textures
+  std::vector<vk::DescriptorBindingFlags> bindingFlags(bindings.size());
+  vk::DescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsCreate;
+  vk::DescriptorSetLayoutCreateInfo layoutCreate;
+  if (bindless_) {
+    bindings.push_back({/*binding=*/10, vk::DescriptorType::eSampledImage,
+                        gMaxBindlessDescriptors,
+                        vk::ShaderStageFlagBits::eFragment,
+                        /*immutableSamplers=*/nullptr});
+    bindingFlags.push_back(
+        vk::DescriptorBindingFlagBits::ePartiallyBound |
+        vk::DescriptorBindingFlagBits::eUpdateAfterBind |
+        vk::DescriptorBindingFlagBits::eUpdateUnusedWhilePending);
+    bindings.push_back({/*binding=*/11, vk::DescriptorType::eSampler,
+                        vk::ShaderStageFlagBits::eFragment,
+                        /*immutableSamplers=*/sampler_});
+    bindingFlags.emplace_back();
+    bindingFlagsCreate.setBindingFlags(bindingFlags);
+    layoutCreate.setFlags(
+        vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool);
+    layoutCreate.setPNext(&bindingFlagsCreate);
+  } else {
+    bindings.push_back({/*binding=*/2,
+                        vk::DescriptorType::eCombinedImageSampler,
+                        vk::ShaderStageFlagBits::eFragment,
+                        /*immutableSamplers=*/sampler_});
+    bindings.push_back({/*binding=*/3,
+                        vk::DescriptorType::eCombinedImageSampler,
+                        vk::ShaderStageFlagBits::eFragment,
+                        /*immutableSamplers=*/sampler_});
+  }
+  layoutCreate.setBindings(bindings);
+  descriptorSetLayout_ = gDevice.createDescriptorSetLayout(layoutCreate);
+
+  // Direct draws push their material index
+  vk::PushConstantRange drawConstants(vk::ShaderStageFlagBits::eVertex,
+                                      /*offset=*/0, sizeof(uint32_t));
+  layout_ = gDevice.createPipelineLayout(
+      {/*flags=*/{}, descriptorSetLayout_, drawConstants});
+
+  // Kept for compiling variants
+  vert_ = readShader(vertexPulling ? "pulled.vert" : "triangle.vert");
+  frag_ = readShader(bindless ? "bindless.frag" : "test.frag");
+  depth_ = readShader("depth.vert");
+
+  // The fallback has to be ready before the first frame
+  variants_[0] = compile(/*key=*/0);
+}
+
+PipelineVariant Pipeline::compile(uint32_t key) const {
   // Dynamic viewport
   vk::Viewport viewport;
   vk::Rect2D scissor;
@@ -33,91 +140,159 @@ Pipeline::Pipeline(const Gltf &model) {
                         vk::DynamicState::eScissor};
   vk::PipelineDynamicStateCreateInfo dynamicState(/*flags=*/{}, dynamicStates);
 
-  // Fixed function stuff
+  // Fixed function stuff. Positions and attributes are separate streams.
+  vk::VertexInputBindingDescription positionBinding(/*binding=*/0,
+                                                    sizeof(VertexPosition));
+  vk::VertexInputAttributeDescription position(
+      /*location=*/0, /*binding=*/0, vk::Format::eR32G32B32Sfloat,
+      /*offset=*/0);
   std::initializer_list<vk::VertexInputBindingDescription> vertexBindings = {
-      {0, sizeof(Vertex)}};
+      positionBinding, {/*binding=*/1, sizeof(VertexAttributes)}};
   std::initializer_list<vk::VertexInputAttributeDescription> attributes = {
-      {/*location=*/0, /*binding=*/0, vk::Format::eR32G32B32Sfloat,
-       offsetof(Vertex, position)},
-      {1, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, normal)},
-      {2, 0, vk::Format::eR32G32B32A32Sfloat, offsetof(Vertex, tangent)},
-      {3, 0, vk::Format::eR32G32Sfloat, offsetof(Vertex, texcoord)}};
-  vk::PipelineVertexInputStateCreateInfo vertexInputs{
-      /*flags=*/{}, vertexBindings, attributes};
+      position,
+      {1, 1, vk::Format::eR32G32B32Sfloat, offsetof(VertexAttributes, normal)},
+      {2, 1, vk::Format::eR32G32B32A32Sfloat,
+       offsetof(VertexAttributes, tangent)},
+      {3, 1, vk::Format::eR32G32Sfloat, offsetof(VertexAttributes, texcoord)}};
+  // Vertex pulling has no vertex input
+  vk::PipelineVertexInputStateCreateInfo vertexInputs;
+  if (!vertexPulling_)
+    vertexInputs.setVertexBindingDescriptions(vertexBindings)
+        .setVertexAttributeDescriptions(attributes);
+  // Depth only passes read just the positions
+  vk::PipelineVertexInputStateCreateInfo positionInputs(
+      /*flags=*/{}, positionBinding, position);
 
   vk::PipelineInputAssemblyStateCreateInfo inputAssembly{
       /*flags=*/{}, /*topology=*/vk::PrimitiveTopology::eTriangleList};
   vk::PipelineRasterizationStateCreateInfo rasterization(
       /*flags=*/{}, /*depthClampEnable=*/false,
       /*rasterizerDiscardEnable=*/false, vk::PolygonMode::eFill,
-      vk::CullModeFlagBits::eBack, vk::FrontFace::eCounterClockwise,
+      (key & kDoubleSided) ? vk::CullModeFlagBits::eNone
+                           : vk::CullModeFlagBits::eBack,
+      vk::FrontFace::eCounterClockwise,
       /*depthBiasEnable=*/false, {}, {}, {}, /*lineWidth=*/1);
+  // Blended surfaces don't hide what's drawn after them
+  bool blend = key & kAlphaBlend;
   vk::PipelineDepthStencilStateCreateInfo depthStencil(
-      /*flags=*/{}, /*depthTestEnable=*/true, /*depthWriteEnable=*/true,
+      /*flags=*/{}, /*depthTestEnable=*/true, /*depthWriteEnable=*/!blend,
       vk::CompareOp::eLess);
+  // After a depth prepass only the nearest fragments are shaded
+  vk::PipelineDepthStencilStateCreateInfo depthEqual(
+      /*flags=*/{}, /*depthTestEnable=*/true, /*depthWriteEnable=*/false,
+      vk::CompareOp::eEqual);
   vk::PipelineMultisampleStateCreateInfo multisample;
   vk::PipelineColorBlendAttachmentState colorBlend1;
   colorBlend1.colorWriteMask = ~vk::ColorComponentFlags();  // All
+  if (blend)
+    colorBlend1.setBlendEnable(true)
+        .setSrcColorBlendFactor(vk::BlendFactor::eSrcAlpha)
+        .setDstColorBlendFactor(vk::BlendFactor::eOneMinusSrcAlpha)
+        .setSrcAlphaBlendFactor(vk::BlendFactor::eOne)
+        .setDstAlphaBlendFactor(vk::BlendFactor::eOneMinusSrcAlpha);
   vk::PipelineColorBlendStateCreateInfo colorBlend(
       /*flags=*/{}, /*logicOpEnable=*/false, /*logicOp=*/{}, colorBlend1);
+  vk::PipelineColorBlendAttachmentState noColor;
+  vk::PipelineColorBlendStateCreateInfo depthOnlyBlend(
+      /*flags=*/{}, /*logicOpEnable=*/false, /*logicOp=*/{}, noColor);
 
-  vk::SamplerCreateInfo samplerCreate(/*flags=*/{}, vk::Filter::eLinear,
-                                      vk::Filter::eLinear,
-                                      vk::SamplerMipmapMode::eLinear);
-  samplerCreate.setAnisotropyEnable(true);
-  samplerCreate.setMaxAnisotropy(
-      gPhysicalDeviceProperties.limits.maxSamplerAnisotropy);
-  sampler_ = gDevice.createSampler(samplerCreate);
-
-  std::initializer_list<vk::DescriptorSetLayoutBinding> bindings = {
-      {/*binding=*/0, vk::DescriptorType::eUniformBuffer,
-       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eVertex,
-       /*immutableSamplers=*/nullptr},
-      {/*binding=*/1, vk::DescriptorType::eUniformBufferDynamic,
-       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eVertex,
-       /*immutableSamplers=*/nullptr},
-      {/*binding=*/2, vk::DescriptorType::eCombinedImageSampler,
-       vk::ShaderStageFlagBits::eFragment,
-       /*immutableSamplers=*/sampler_},
-      {/*binding=*/3, vk::DescriptorType::eCombinedImageSampler,
-       vk::ShaderStageFlagBits::eFragment,
-       /*immutableSamplers=*/sampler_},
-      {/*binding=*/4, vk::DescriptorType::eUniformBufferDynamic,
-       /*descriptorCount=*/1, vk::ShaderStageFlagBits::eFragment,
-       /*immutableSamplers=*/nullptr},
-  };
-  descriptorSetLayout_ =
-      gDevice.createDescriptorSetLayout({/*flags=*/{}, bindings});
-
-  layout_ = gDevice.createPipelineLayout(
-      {/*flags=*/{}, descriptorSetLayout_, /*pushConstants=*/{}});
-
-  vk::ShaderModule vert = readShader("triangle.vert");
-  vk::ShaderModule frag = readShader("test.frag");
+  VkBool32 indirectConstant = indirect_;
+  vk::SpecializationMapEntry indirectEntry(/*constantID=*/0, /*offset=*/0,
+                                           sizeof(VkBool32));
+  vk::SpecializationInfo specialization(indirectEntry, sizeof(VkBool32),
+                                        &indirectConstant);
+  // In shading.glsl's constant_id order
+  std::array<VkBool32, 4> materialConstants = {
+      !(key & kNoBaseColorTexture), !(key & kNoNormalTexture),
+      !(key & kNoMetallicRoughnessTexture), bool(key & kDoubleSided)};
+  std::array<vk::SpecializationMapEntry, 4> materialEntries;
+  for (uint32_t i = 0; i < materialEntries.size(); ++i)
+    materialEntries[i] = {/*constantID=*/i, i * uint32_t(sizeof(VkBool32)),
+                          sizeof(VkBool32)};
+  vk::SpecializationInfo materialSpecialization(
+      materialEntries, sizeof(materialConstants), materialConstants.data());
 
   std::initializer_list<vk::PipelineShaderStageCreateInfo> stages = {
-      {/*flags=*/{}, vk::ShaderStageFlagBits::eVertex, vert, /*pName=*/"main"},
-      {/*flags=*/{}, vk::ShaderStageFlagBits::eFragment, frag,
-       /*pName=*/"main"}};
+      {/*flags=*/{}, vk::ShaderStageFlagBits::eVertex, vert_,
+       /*pName=*/"main", &specialization},
+      {/*flags=*/{}, vk::ShaderStageFlagBits::eFragment, frag_,
+       /*pName=*/"main", &materialSpecialization}};
+  std::initializer_list<vk::PipelineShaderStageCreateInfo> depthStages = {
+      {/*flags=*/{}, vk::ShaderStageFlagBits::eVertex, depth_,
+       /*pName=*/"main", &specialization}};
 
+  std::vector<vk::GraphicsPipelineCreateInfo> creates = {
+      {/*flags=*/{}, stages, &vertexInputs, &inputAssembly,
+       /*tesselation=*/{}, &viewportState, &rasterization, &multisample,
+       &depthStencil, &colorBlend, &dynamicState, layout_, gRenderPass,
+       /*subpass=*/0, /*basePipeline=*/{}}};
+  // Blended variants are left out of depth passes, and are tested against
+  // the prepass's depth like any other
+  if (!blend) {
+    creates.push_back({/*flags=*/{}, depthStages, &positionInputs,
+                       &inputAssembly, /*tesselation=*/{}, &viewportState,
+                       &rasterization, &multisample, &depthStencil,
+                       &depthOnlyBlend, &dynamicState, layout_, gRenderPass,
+                       /*subpass=*/0, /*basePipeline=*/{}});
+    creates.push_back({/*flags=*/{}, stages, &vertexInputs, &inputAssembly,
+                       /*tesselation=*/{}, &viewportState, &rasterization,
+                       &multisample, &depthEqual, &colorBlend, &dynamicState,
+                       layout_, gRenderPass, /*subpass=*/0,
+                       /*basePipeline=*/{}});
+  }
   vk::ResultValue<std::vector<vk::Pipeline>> pipelines_or =
-      gDevice.createGraphicsPipelines(
-          /*pipelineCache=*/nullptr,
-          {{/*flags=*/{}, stages, &vertexInputs, &inputAssembly,
-            /*tesselation=*/{}, &viewportState, &rasterization, &multisample,
-            &depthStencil, &colorBlend, &dynamicState, layout_, gRenderPass,
-            /*subpass=*/0, /*basePipeline=*/{}}});
-
-  gDevice.destroy(vert);
-  gDevice.destroy(frag);
+      gDevice.createGraphicsPipelines(gPipelineCache, creates);
 
   throwFail("vkCreateGraphicsPipelines", pipelines_or.result);
-  if (pipelines_or.value.empty())
+  if (pipelines_or.value.size() < creates.size())
     throw std::runtime_error("No pipeline returned???");
-  pipeline_ = pipelines_or.value[0];
+  PipelineVariant variant;
+  variant.pipeline = pipelines_or.value[0];
+  if (blend) {
+    variant.equal = variant.pipeline;
+  } else {
+    variant.depth = pipelines_or.value[1];
+    variant.equal = pipelines_or.value[2];
+  }
+  return variant;
 }
+
+bool Pipeline::update(const DrawList &draws) {
+  bool finished = false;
+  for (auto it = compiling_.begin(); it != compiling_.end();) {
+    if (it->second.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready) {
+      ++it;
+      continue;
+    }
+    variants_[it->first] = it->second.get();
+    it = compiling_.erase(it);
+    finished = true;
+  }
+  for (const DrawList::PipelineRun &run : draws.pipelineRuns_)
+    if (!variants_.count(run.key) && !compiling_.count(run.key))
+      compiling_[run.key] = std::async(std::launch::async,
+                                       [this, key = run.key] {
+                                         return compile(key);
+                                       });
+  return finished && compiling_.empty();
+}
+
+const PipelineVariant &Pipeline::variant(uint32_t key) const {
+  auto it = variants_.find(key);
+  return it != variants_.end() ? it->second : variants_.at(0);
+}
+
 Pipeline::~Pipeline() {
-  gDevice.destroy(pipeline_);
+  for (auto &[key, compiling] : compiling_) variants_[key] = compiling.get();
+  for (const auto &[key, variant] : variants_) {
+    gDevice.destroy(variant.pipeline);
+    gDevice.destroy(variant.depth);
+    if (variant.equal != variant.pipeline) gDevice.destroy(variant.equal);
+  }
+  gDevice.destroy(vert_);
+  gDevice.destroy(frag_);
+  gDevice.destroy(depth_);
   gDevice.destroy(layout_);
   gDevice.destroy(sampler_);
   gDevice.destroy(descriptorSetLayout_);
@@ -145,8 +320,8 @@ Camera getCamera() {
 }
 
 void DescriptorPool::updateCamera() {
-  Camera camera = getCamera();
-  std::copy_n((char *)&camera, sizeof(Camera), mapping_);
+  currentCamera_ = getCamera();
+  std::copy_n((char *)&currentCamera_, sizeof(Camera), mapping_);
 }
 
 DescriptorPool::~DescriptorPool() {
@@ -158,56 +333,540 @@ DescriptorPool::~DescriptorPool() {
   gDevice.destroy(pool_);
 }
 
-std::vector<vk::CommandPool> gCommandPools;
-CommandPool::CommandPool() {
-  for (int i = 0; i < gSwapchainImageCount; ++i)
-    gCommandPools.push_back(
-        gDevice.createCommandPool({vk::CommandPoolCreateFlagBits::eTransient,
-                                   gGraphicsQueueFamilyIndex}));
+DrawList::DrawList(const Gltf &gltf, const GeometryHeap::Model &geometry) {
+  struct Packet {
+    uint64_t key;
+    uint32_t indexCount, firstIndex, vertexOffset;
+    uint32_t mesh, material;
+    glm::vec4 bounds;
+    glm::vec3 extent;
+  };
+  std::vector<Packet> packets;
+  // Materials and meshes each get 16 bits of the key, and wider indices
+  // would spill into the next field
+  if (gltf.materialCount() > 1 << 16 || gltf.meshCount() > 1 << 16)
+    throw std::runtime_error("Too many materials or meshes for draw keys");
+  uint64_t primitive = 0;
+  for (uint32_t mesh = 0; mesh < gltf.meshCount(); ++mesh) {
+    // Meshes outside the scene aren't drawn
+    if (!gltf.instanceCount(mesh)) continue;
+    for (const auto &prim : gltf.data_.meshes(mesh).primitives()) {
+      if (!prim.attributes().has_position()) continue;
+      uint64_t pipeline = pipelineKey(gltf, prim.material());
+      uint64_t key = pipeline << 56 | uint64_t(prim.material()) << 40 |
+                     uint64_t(mesh) << 24 | (primitive++ & 0xffffff);
+      glm::vec4 bounds = gltf.boundingSphere(prim);
+      glm::vec3 extent = gltf.boundingBox(prim).second;
+      // Skinned vertices are drawn from where Skinning writes them, and can
+      // move anywhere, so they're never culled
+      uint32_t vertexOffset = prim.vertex_offset();
+      if (prim.has_skinned_vertex_offset()) {
+        vertexOffset = prim.skinned_vertex_offset();
+        bounds.w = INFINITY;
+        extent = glm::vec3(INFINITY);
+      }
+      packets.push_back({key, gltf.data_.accessors(prim.indices()).count(),
+                         geometry.firstIndex + prim.index_offset(),
+                         geometry.firstVertex + vertexOffset, mesh,
+                         prim.material(), bounds, extent});
+    }
+  }
+  std::sort(packets.begin(), packets.end(),
+            [](const Packet &l, const Packet &r) { return l.key < r.key; });
+
+  for (const Packet &packet : packets) {
+    key_.push_back(packet.key);
+    pipeline_.push_back(packet.key >> 56);
+    material_.push_back(packet.material);
+    indexCount_.push_back(packet.indexCount);
+    firstIndex_.push_back(packet.firstIndex);
+    vertexOffset_.push_back(static_cast<int32_t>(packet.vertexOffset));
+    mesh_.push_back(packet.mesh);
+    firstInstance_.push_back(gltf.firstInstance(packet.mesh));
+    instanceCount_.push_back(gltf.instanceCount(packet.mesh));
+    bounds_.push_back(packet.bounds);
+    extents_.push_back(packet.extent);
+    uint32_t pipeline = pipeline_.back();
+    if (pipelineRuns_.empty() || pipelineRuns_.back().key != pipeline)
+      pipelineRuns_.push_back(
+          {pipeline, static_cast<uint32_t>(key_.size() - 1), 0});
+    ++pipelineRuns_.back().count;
+  }
+}
+
+IndirectDraws::IndirectDraws(const DrawList &draws,
+                             const DescriptorPool &descriptorPool) {
+  update(draws);
+  vk::DescriptorBufferInfo drawDataBuffer(drawData_, /*offset=*/0,
+                                          VK_WHOLE_SIZE);
+  gDevice.updateDescriptorSets(
+      vk::WriteDescriptorSet(descriptorPool.set_, /*binding=*/5,
+                             /*arrayElement=*/0,
+                             vk::DescriptorType::eStorageBuffer, {},
+                             drawDataBuffer, /*texelBufferView=*/{}),
+      /*copies=*/{});
+}
+
+void IndirectDraws::update(const DrawList &draws) {
+  uint32_t instances = std::accumulate(draws.instanceCount_.begin(),
+                                       draws.instanceCount_.end(), 0u);
+  if (!commands_) {
+    capacity_ = std::max<uint32_t>(draws.size(), 1);
+    instanceCapacity_ = std::max<uint32_t>(instances, 1);
+    std::tie(commands_, commandsMemory_) = makeDeviceBuffer(
+        capacity_ * sizeof(vk::DrawIndexedIndirectCommand),
+        vk::BufferUsageFlagBits::eIndirectBuffer |
+            vk::BufferUsageFlagBits::eStorageBuffer);
+    std::tie(drawData_, drawDataMemory_) =
+        makeDeviceBuffer(instanceCapacity_ * sizeof(DrawData),
+                         vk::BufferUsageFlagBits::eStorageBuffer);
+    std::tie(count_, countMemory_) = makeDeviceBuffer(
+        sizeof(uint32_t), vk::BufferUsageFlagBits::eIndirectBuffer);
+    std::tie(bounds_, boundsMemory_) =
+        makeDeviceBuffer(capacity_ * sizeof(glm::vec4),
+                         vk::BufferUsageFlagBits::eStorageBuffer);
+    std::tie(culled_, culledMemory_) = makeDeviceBuffer(
+        capacity_ * sizeof(vk::DrawIndexedIndirectCommand),
+        vk::BufferUsageFlagBits::eIndirectBuffer |
+            vk::BufferUsageFlagBits::eStorageBuffer);
+    // There are never more runs than draws
+    std::tie(culledCount_, culledCountMemory_) = makeDeviceBuffer(
+        capacity_ * sizeof(uint32_t),
+        vk::BufferUsageFlagBits::eIndirectBuffer |
+            vk::BufferUsageFlagBits::eStorageBuffer);
+    std::tie(runs_, runsMemory_) =
+        makeDeviceBuffer(capacity_ * sizeof(glm::uvec2),
+                         vk::BufferUsageFlagBits::eStorageBuffer);
+    std::tie(visibility_, visibilityMemory_) =
+        makeDeviceBuffer(capacity_ * sizeof(uint32_t),
+                         vk::BufferUsageFlagBits::eStorageBuffer);
+  }
+  // The draw data descriptor is in use by frames in flight, so can't be
+  // pointed at a bigger buffer
+  if (draws.size() > capacity_ || instances > instanceCapacity_)
+    throw std::runtime_error("Too many draws for indirect buffer");
+  size_ = static_cast<uint32_t>(draws.size());
+
+  vk::DeviceSize commandsSize = size_ * sizeof(vk::DrawIndexedIndirectCommand);
+  vk::DeviceSize drawDataSize = instances * sizeof(DrawData);
+  vk::DeviceSize boundsSize = size_ * sizeof(glm::vec4);
+  vk::DeviceSize runsSize = size_ * sizeof(glm::uvec2);
+  Transfer transfer = gTransferManager->newTransfer(
+      commandsSize + drawDataSize + boundsSize + runsSize + sizeof(uint32_t));
+  auto *commands = (vk::DrawIndexedIndirectCommand *)transfer.pointer_;
+  auto *drawData = (DrawData *)(transfer.pointer_ + commandsSize);
+  auto *bounds =
+      (glm::vec4 *)(transfer.pointer_ + commandsSize + drawDataSize);
+  // Each instance of each draw gets its own draw data
+  uint32_t instance = 0;
+  for (uint32_t i = 0; i < size_; ++i) {
+    commands[i] = vk::DrawIndexedIndirectCommand(
+        draws.indexCount_[i], draws.instanceCount_[i], draws.firstIndex_[i],
+        draws.vertexOffset_[i], /*firstInstance=*/instance);
+    for (uint32_t j = 0; j < draws.instanceCount_[i]; ++j)
+      drawData[instance++] = {draws.firstInstance_[i] + j, draws.material_[i]};
+    bounds[i] = draws.bounds_[i];
+  }
+  vk::DeviceSize runsOffset = commandsSize + drawDataSize + boundsSize;
+  auto *runs = (glm::uvec2 *)(transfer.pointer_ + runsOffset);
+  for (uint32_t run = 0; run < draws.pipelineRuns_.size(); ++run) {
+    const DrawList::PipelineRun &pipelineRun = draws.pipelineRuns_[run];
+    std::fill_n(runs + pipelineRun.first, pipelineRun.count,
+                glm::uvec2(run, pipelineRun.first));
+  }
+  vk::DeviceSize countOffset = runsOffset + runsSize;
+  std::copy_n((char *)&size_, sizeof(uint32_t),
+              transfer.pointer_ + countOffset);
+
+  // Earlier frames may still be reading the old contents
+  vk::MemoryBarrier unused(
+      vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead,
+      vk::AccessFlagBits::eTransferWrite);
+  transfer.cmd_.pipelineBarrier(vk::PipelineStageFlagBits::eDrawIndirect |
+                                    vk::PipelineStageFlagBits::eVertexShader |
+                                    vk::PipelineStageFlagBits::eComputeShader,
+                                vk::PipelineStageFlagBits::eTransfer,
+                                /*dependencyFlags=*/{}, unused, {}, {});
+  if (size_) {
+    transfer.copy(transfer.buffer_, commands_,
+                  vk::BufferCopy(/*src=*/0, /*dst=*/0, commandsSize),
+                  vk::PipelineStageFlagBits::eDrawIndirect |
+                      vk::PipelineStageFlagBits::eComputeShader,
+                  vk::AccessFlagBits::eIndirectCommandRead |
+                      vk::AccessFlagBits::eShaderRead);
+    transfer.copy(transfer.buffer_, drawData_,
+                  vk::BufferCopy(/*src=*/commandsSize, /*dst=*/0, drawDataSize),
+                  vk::PipelineStageFlagBits::eVertexShader |
+                      vk::PipelineStageFlagBits::eComputeShader,
+                  vk::AccessFlagBits::eShaderRead);
+    transfer.copy(transfer.buffer_, bounds_,
+                  vk::BufferCopy(/*src=*/commandsSize + drawDataSize,
+                                 /*dst=*/0, boundsSize),
+                  vk::PipelineStageFlagBits::eComputeShader,
+                  vk::AccessFlagBits::eShaderRead);
+    transfer.copy(transfer.buffer_, runs_,
+                  vk::BufferCopy(/*src=*/runsOffset, /*dst=*/0, runsSize),
+                  vk::PipelineStageFlagBits::eComputeShader,
+                  vk::AccessFlagBits::eShaderRead);
+  }
+  transfer.copy(transfer.buffer_, count_,
+                vk::BufferCopy(/*src=*/countOffset, /*dst=*/0,
+                               sizeof(uint32_t)),
+                vk::PipelineStageFlagBits::eDrawIndirect,
+                vk::AccessFlagBits::eIndirectCommandRead);
+  // Nothing has been seen yet, so the first frame draws everything in the
+  // second culling pass
+  transfer.cmd_.fillBuffer(visibility_, /*offset=*/0, VK_WHOLE_SIZE, 0);
+  vk::BufferMemoryBarrier cleared(
+      vk::AccessFlagBits::eTransferWrite,
+      vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+      gGraphicsQueueFamilyIndex, gGraphicsQueueFamilyIndex, visibility_,
+      /*offset=*/0, VK_WHOLE_SIZE);
+  transfer.cmd_.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                vk::PipelineStageFlagBits::eComputeShader,
+                                /*dependencyFlags=*/{}, {}, cleared, {});
+}
+
+IndirectDraws::~IndirectDraws() {
+  gDevice.destroy(commands_);
+  gDevice.free(commandsMemory_);
+  gDevice.destroy(drawData_);
+  gDevice.free(drawDataMemory_);
+  gDevice.destroy(count_);
+  gDevice.free(countMemory_);
+  gDevice.destroy(bounds_);
+  gDevice.free(boundsMemory_);
+  gDevice.destroy(culled_);
+  gDevice.free(culledMemory_);
+  gDevice.destroy(culledCount_);
+  gDevice.free(culledCountMemory_);
+  gDevice.destroy(visibility_);
+  gDevice.free(visibilityMemory_);
+  gDevice.destroy(runs_);
+  gDevice.free(runsMemory_);
+}
+
+bool RecordedState::operator==(const RecordedState &other) const {
+  auto tie = [](const RecordedState &s) {
+    return std::tie(s.pipeline, s.readyVariants, s.depthPrepass, s.set,
+                    s.geometryGeneration, s.draws, s.drawCount,
+                    s.indirectCount, s.proj, s.queries, s.visible);
+  };
+  return tie(*this) == tie(other);
+}
+
+RecyclingCommandPool::RecyclingCommandPool()
+    : pool_(gDevice.createCommandPool(
+          {vk::CommandPoolCreateFlagBits::eTransient,
+           gGraphicsQueueFamilyIndex})) {}
+
+void RecyclingCommandPool::destroy() { gDevice.destroy(pool_); }
+
+void RecyclingCommandPool::reset() {
+  // Everything allocated goes back to the initial state, ready to record
+  gDevice.resetCommandPool(pool_);
+  usedPrimaries_ = usedSecondaries_ = 0;
+}
+
+vk::CommandBuffer RecyclingCommandPool::get(vk::CommandBufferLevel level) {
+  bool primary = level == vk::CommandBufferLevel::ePrimary;
+  std::vector<vk::CommandBuffer> &buffers =
+      primary ? primaries_ : secondaries_;
+  size_t &used = primary ? usedPrimaries_ : usedSecondaries_;
+  if (used == buffers.size())
+    buffers.push_back(gDevice.allocateCommandBuffers({pool_, level, 1})[0]);
+  return buffers[used++];
+}
+
+std::vector<RecyclingCommandPool> gCommandPools;
+std::vector<std::vector<RecyclingCommandPool>> gRecordingPools;
+std::vector<RecordedFrame> gRecordedFrames;
+void CommandPool::resizeToSwapchain() {
+  // Recorded again with the next pool reset
+  gRecordedFrames.assign(gSwapchainImageCount, {});
+  for (size_t i = gCommandPools.size(); i < gSwapchainImageCount; ++i) {
+    gCommandPools.emplace_back();
+    gRecordingPools.emplace_back(recordingThreads_);
+  }
 }
 CommandPool::~CommandPool() {
-  for (vk::CommandPool pool : gCommandPools) gDevice.destroy(pool);
+  for (RecyclingCommandPool &pool : gCommandPools) pool.destroy();
   gCommandPools.clear();
+  for (auto &pools : gRecordingPools)
+    for (RecyclingCommandPool &pool : pools) pool.destroy();
+  gRecordingPools.clear();
+}
+
+OverdrawQueries::OverdrawQueries() {
+  precise_ = gEnabledFeatures.occlusionQueryPrecise;
+  resizeToSwapchain();
+}
+OverdrawQueries::~OverdrawQueries() { gDevice.destroy(pool_); }
+
+void OverdrawQueries::resizeToSwapchain() {
+  if (pool_) retire([pool = pool_] { gDevice.destroy(pool); });
+  pool_ = gDevice.createQueryPool({/*flags=*/{}, vk::QueryType::eOcclusion,
+                                   gSwapchainImageCount * kPerImage});
+  used_.assign(gSwapchainImageCount, 0);
+}
+
+void OverdrawQueries::reset(vk::CommandBuffer buf) {
+  buf.resetQueryPool(pool_, gSwapchainCurrentImage * kPerImage, kPerImage);
+  used_[gSwapchainCurrentImage] = 0;
+}
+
+void OverdrawQueries::begin(vk::CommandBuffer buf) {
+  uint32_t query = gSwapchainCurrentImage * kPerImage +
+                   used_[gSwapchainCurrentImage];
+  buf.beginQuery(pool_, query,
+                 precise_ ? vk::QueryControlFlagBits::ePrecise
+                          : vk::QueryControlFlags());
+}
+
+void OverdrawQueries::end(vk::CommandBuffer buf) {
+  buf.endQuery(pool_, gSwapchainCurrentImage * kPerImage +
+                          used_[gSwapchainCurrentImage]++);
+}
+
+void OverdrawQueries::collect(uint32_t image) {
+  if (!used_[image]) return;
+  std::array<uint64_t, kPerImage> samples = {};
+  vk::Result result = gDevice.getQueryPoolResults(
+      pool_, image * kPerImage, used_[image], sizeof(samples), samples.data(),
+      sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+  if (result != vk::Result::eSuccess) return;
+  uint64_t total = std::accumulate(samples.begin(), samples.end(), 0ull);
+  overdraw_ = float(total) /
+              (gSwapchainExtent.width * gSwapchainExtent.height);
 }
 
 CommandBuffer::CommandBuffer(const Pipeline &pipeline,
                              const DescriptorPool &descriptorPool,
-                             const VertexBuffers &vertices, const Gltf &gltf) {
-  vk::CommandPool pool = gCommandPools[gSwapchainCurrentImage];
-  if (gFrame % 100 == 0) gDevice.resetCommandPool(pool);
-  buf_ = gDevice.allocateCommandBuffers(
-      {pool, vk::CommandBufferLevel::ePrimary, 1})[0];
+                             const GeometryHeap &geometry,
+                             const DrawList &draws,
+                             const IndirectDraws &indirect,
+                             GpuCulling *gpuCulling,
+                             const CpuCulling *cpuCulling,
+                             OverdrawQueries *overdraw, Workers *workers) {
+  RecordedState state;
+  state.pipeline = &pipeline;
+  state.readyVariants = pipeline.readyVariants();
+  state.depthPrepass = pipeline.depthPrepass_;
+  state.set = descriptorPool.set_;
+  state.geometryGeneration = geometry.generation_;
+  state.draws = &draws;
+  state.drawCount = draws.size();
+  state.indirectCount = indirect.size_;
+  if (gpuCulling) state.proj = descriptorPool.currentCamera_.proj;
+  if (overdraw) state.queries = overdraw->pool_;
+  if (cpuCulling) state.visible = cpuCulling->visible_;
+  RecordedFrame &recordedFrame = gRecordedFrames[gSwapchainCurrentImage];
+  if (recordedFrame.buf && recordedFrame.state == state) {
+    buf_ = recordedFrame.buf;
+    return;
+  }
+  recorded_ = true;
+
+  // The image's last frame has finished, so whatever was recorded for it
+  // can be recorded over
+  RecyclingCommandPool &pool = gCommandPools[gSwapchainCurrentImage];
+  std::vector<RecyclingCommandPool> &recordingPools =
+      gRecordingPools[gSwapchainCurrentImage];
+  pool.reset();
+  for (RecyclingCommandPool &recordingPool : recordingPools)
+    recordingPool.reset();
+  buf_ = pool.get(vk::CommandBufferLevel::ePrimary);
+  recordedFrame = {std::move(state), buf_};
 
   buf_.begin(vk::CommandBufferBeginInfo());
-  buf_.setViewport(/*index=*/0, gViewport);
-  buf_.setScissor(/*index=*/0, gScissor);
+  if (overdraw) overdraw->reset(buf_);
+  // Everything is indexed, so one binding lasts every pass
+  buf_.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline.layout_,
+                          /*firstSet=*/0, descriptorPool.set_,
+                          /*dynamicOffsets=*/{});
   std::initializer_list<vk::ClearValue> clearValues = {
       vk::ClearColorValue(std::array<float, 4>{0, 0, 0, 1}),
       vk::ClearDepthStencilValue(1.f, 0)};
-  buf_.beginRenderPass(
-      {gRenderPass, gFramebuffers[gSwapchainCurrentImage], /*renderArea=*/
-       vk::Rect2D(/*offset=*/{0, 0}, gSwapchainExtent), clearValues},
-      vk::SubpassContents::eInline);
-  buf_.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline.pipeline_);
-  for (uint32_t mesh = 0; mesh < gltf.meshCount(); ++mesh) {
-    for (const auto &prim : gltf.data_.meshes(mesh).primitives()) {
-      buf_.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
-                              pipeline.layout_,
-                              /*firstSet=*/0, descriptorPool.set_,
-                              {gltf.meshUniformOffset(mesh),
-                               gltf.materialUniformOffset(prim.material())});
-
-      buf_.bindVertexBuffers(/*binding=*/0, vertices.buffer_,
-                             prim.vertex_offset());
-      buf_.bindIndexBuffer(vertices.buffer_, prim.index_offset(),
-                           vk::IndexType::eUint16);
-      const auto &inds = gltf.data_.accessors(prim.indices());
-      buf_.drawIndexed(inds.count(), /*instanceCount=*/1,
-                       /*firstIndex=*/0,
-                       /*vertexOffset=*/0,
-                       /*firstInstance=*/0);
+  // Dynamic and bound state, which secondary command buffers don't inherit
+  auto bindState = [&](vk::CommandBuffer cmd) {
+    cmd.setViewport(/*index=*/0, gViewport);
+    cmd.setScissor(/*index=*/0, gScissor);
+    // The depth pipeline reads the position stream even when pulling
+    if (!pipeline.vertexPulling_ || pipeline.depthPrepass_)
+      cmd.bindVertexBuffers(
+          /*firstBinding=*/0,
+          {geometry.positionBuffer_, geometry.attributeBuffer_},
+          /*offsets=*/{vk::DeviceSize(0), vk::DeviceSize(0)});
+    cmd.bindIndexBuffer(geometry.indexBuffer_, /*offset=*/0, kIndexType);
+  };
+  auto beginRenderPass = [&](vk::RenderPass renderPass,
+                             vk::SubpassContents contents =
+                                 vk::SubpassContents::eInline) {
+    buf_.beginRenderPass(
+        {renderPass, gFramebuffers[gSwapchainCurrentImage], /*renderArea=*/
+         vk::Rect2D(/*offset=*/{0, 0}, gSwapchainExtent), clearValues},
+        contents);
+    if (contents == vk::SubpassContents::eInline) bindState(buf_);
+  };
+  // Binds the variant for a run of draws with the same pipeline key. False
+  // if the variant isn't drawn in this pass.
+  auto bindVariant = [&](vk::CommandBuffer cmd, uint32_t key, bool shade) {
+    const PipelineVariant &variant = pipeline.variant(key);
+    vk::Pipeline pipe = variant.depth;
+    if (shade) pipe = pipeline.depthPrepass_ ? variant.equal : variant.pipeline;
+    if (pipe) cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, pipe);
+    return bool(pipe);
+  };
+  // With a depth prepass everything is drawn twice in the same subpass,
+  // first to depth only and then shaded where the depth is equal, so hidden
+  // fragments are never shaded. draw is told whether it's shading.
+  auto drawPasses = [&](auto &&draw) {
+    if (pipeline.depthPrepass_) draw(/*shade=*/false);
+    if (overdraw) overdraw->begin(buf_);
+    draw(/*shade=*/true);
+    if (overdraw) overdraw->end(buf_);
+  };
+  constexpr uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand);
+  // Indirect draws in draw list order, a run at a time
+  auto drawRuns = [&](bool shade, auto &&drawIndirect) {
+    for (uint32_t run = 0; run < draws.pipelineRuns_.size(); ++run) {
+      const DrawList::PipelineRun &pipelineRun = draws.pipelineRuns_[run];
+      if (bindVariant(buf_, pipelineRun.key, shade))
+        drawIndirect(run, pipelineRun.first, pipelineRun.count);
     }
+  };
+
+  if (gpuCulling) {
+    // Draw what was visible last frame, then test everything else against
+    // the depth that left
+    gpuCulling->cull(buf_, /*late=*/false);
+    auto draw = [&](bool shade) {
+      drawRuns(shade, [&](uint32_t run, uint32_t first, uint32_t count) {
+        gpuCulling->draw(buf_, run, first, count);
+      });
+    };
+    beginRenderPass(gEarlyRenderPass);
+    drawPasses(draw);
+    buf_.endRenderPass();
+    gpuCulling->buildPyramid(buf_);
+    gpuCulling->cull(buf_, /*late=*/true);
+    beginRenderPass(gLateRenderPass);
+    drawPasses(draw);
+    buf_.endRenderPass();
+    buf_.end();
+    return;
+  }
+
+  if (pipeline.indirect_) {
+    beginRenderPass(gRenderPass);
+    drawPasses([&](bool shade) {
+      // A single run can use the count buffer
+      if (draws.pipelineRuns_.size() == 1 && gCmdDrawIndexedIndirectCount &&
+          gEnabledFeatures.multiDrawIndirect) {
+        if (bindVariant(buf_, draws.pipelineRuns_[0].key, shade))
+          gCmdDrawIndexedIndirectCount(buf_, indirect.commands_, /*offset=*/0,
+                                       indirect.count_, /*countOffset=*/0,
+                                       /*maxDrawCount=*/indirect.size_,
+                                       stride);
+        return;
+      }
+      drawRuns(shade, [&](uint32_t, uint32_t first, uint32_t count) {
+        if (gEnabledFeatures.multiDrawIndirect)
+          buf_.drawIndexedIndirect(indirect.commands_, first * stride, count,
+                                   stride);
+        else
+          for (uint32_t i = first; i < first + count; ++i)
+            buf_.drawIndexedIndirect(indirect.commands_, i * stride,
+                                     /*drawCount=*/1, stride);
+      });
+    });
+    buf_.endRenderPass();
+    buf_.end();
+    return;
   }
+
+  size_t drawCount = cpuCulling ? cpuCulling->visible_.size() : draws.size();
+  auto drawRange = [&](vk::CommandBuffer cmd, size_t begin, size_t end,
+                       bool shade) {
+    // Only bind and push what differs from the previous draw, and depth
+    // doesn't need the material at all
+    uint32_t key = UINT32_MAX, material = UINT32_MAX;
+    bool drawn = false;
+    for (size_t visible = begin; visible < end; ++visible) {
+      size_t i = cpuCulling ? cpuCulling->visible_[visible] : visible;
+      if (draws.pipeline_[i] != key) {
+        key = draws.pipeline_[i];
+        drawn = bindVariant(cmd, key, shade);
+      }
+      if (!drawn) continue;
+      if (shade && draws.material_[i] != material) {
+        material = draws.material_[i];
+        cmd.pushConstants(pipeline.layout_, vk::ShaderStageFlagBits::eVertex,
+                          /*offset=*/0, sizeof(uint32_t), &material);
+      }
+      // Instances index the packed matrices directly
+      cmd.drawIndexed(draws.indexCount_[i], draws.instanceCount_[i],
+                      draws.firstIndex_[i], draws.vertexOffset_[i],
+                      draws.firstInstance_[i]);
+    }
+  };
+
+  uint32_t chunks = 1;
+  if (workers)
+    chunks = static_cast<uint32_t>(std::min<size_t>(
+        {workers->size(), recordingPools.size(),
+         std::max<size_t>(drawCount / kMinDrawsPerThread, 1)}));
+  if (chunks == 1) {
+    beginRenderPass(gRenderPass);
+    drawPasses([&](bool shade) { drawRange(buf_, 0, drawCount, shade); });
+    buf_.endRenderPass();
+    buf_.end();
+    return;
+  }
+
+  // Each chunk's depth and shading are separate secondaries, so all of the
+  // depth is drawn before anything is shaded. The overdraw query stays
+  // active across the shading ones only if the device can inherit it.
+  bool queried = overdraw && gEnabledFeatures.inheritedQueries;
+  vk::CommandBufferInheritanceInfo inheritance(
+      gRenderPass, /*subpass=*/0, gFramebuffers[gSwapchainCurrentImage],
+      /*occlusionQueryEnable=*/false);
+  vk::CommandBufferInheritanceInfo queriedInheritance = inheritance;
+  if (queried)
+    queriedInheritance.setOcclusionQueryEnable(true).setQueryFlags(
+        overdraw->precise_ ? vk::QueryControlFlagBits::ePrecise
+                           : vk::QueryControlFlags());
+  std::vector<vk::CommandBuffer> depth(chunks), shaded(chunks);
+  workers->run(chunks, [&](uint32_t chunk) {
+    // Only this thread touches the chunk's pool
+    RecyclingCommandPool &recordingPool = recordingPools[chunk];
+    size_t begin = drawCount * chunk / chunks;
+    size_t end = drawCount * (chunk + 1) / chunks;
+    auto record = [&](bool shade,
+                      const vk::CommandBufferInheritanceInfo &inherited) {
+      vk::CommandBuffer cmd =
+          recordingPool.get(vk::CommandBufferLevel::eSecondary);
+      // Not one time, since the primary may be submitted again
+      cmd.begin({vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+                 &inherited});
+      cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                             pipeline.layout_, /*firstSet=*/0,
+                             descriptorPool.set_, /*dynamicOffsets=*/{});
+      bindState(cmd);
+      drawRange(cmd, begin, end, shade);
+      cmd.end();
+      return cmd;
+    };
+    if (pipeline.depthPrepass_)
+      depth[chunk] = record(/*shade=*/false, inheritance);
+    shaded[chunk] = record(/*shade=*/true, queriedInheritance);
+  });
+
+  beginRenderPass(gRenderPass, vk::SubpassContents::eSecondaryCommandBuffers);
+  if (pipeline.depthPrepass_) buf_.executeCommands(depth);
+  if (queried) overdraw->begin(buf_);
+  buf_.executeCommands(shaded);
+  if (queried) overdraw->end(buf_);
   buf_.endRenderPass();
   buf_.end();
 }
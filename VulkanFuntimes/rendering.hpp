@@ -1,6 +1,8 @@
 #ifndef rendering_hpp
 #define rendering_hpp
 
+#include <future>
+#include <map>
 #include "vulkan/vulkan.hpp"
 #include "drawdata.hpp"
 
@@ -11,26 +13,238 @@ struct Vertex {
   glm::vec2 texcoord;
   glm::vec4 tangent;
 };
+// Vertex split into the geometry heap's two streams
+using VertexPosition = glm::vec3;
+struct VertexAttributes {
+  glm::vec3 normal;
+  glm::vec2 texcoord;
+  glm::vec4 tangent;
+};
 
+// Material properties that need their own pipeline, as bits of a pipeline
+// key. Every vertex is in the geometry heap's one format, so only materials
+// make variants. The texture bits only take work out of shading.glsl through
+// its specialization constants, so the fallback shades any material. Draws
+// are sorted by key, so blended ones go last.
+enum PipelineKeyBits : uint32_t {
+  kDoubleSided = 1 << 0,         // Not culled, back faces lit from behind
+  kNoBaseColorTexture = 1 << 1,  // Base color is the constant factor
+  kNoNormalTexture = 1 << 2,     // Shaded with the interpolated normal
+  kNoMetallicRoughnessTexture = 1 << 3,
+  kAlphaBlend = 1 << 4,  // Blended over what's behind, writing no depth
+};
+uint32_t pipelineKey(const Gltf& gltf, uint32_t material);
+
+// The pipelines draws with one pipeline key are drawn with
+struct PipelineVariant {
+  vk::Pipeline pipeline;
+  // Writes only depth and reads only the position stream, for depth passes.
+  // Never pulls vertices. Null for blended variants, which aren't in depth
+  // passes.
+  vk::Pipeline depth;
+  // pipeline without depth writes and only shading equal depth, for after
+  // a depth prepass. The same as pipeline for blended variants.
+  vk::Pipeline equal;
+};
+
+struct DrawList;
+// Pipeline variants by key, compiled in the background the first time a draw
+// list needs them. Until they're ready their draws use the fallback, key 0,
+// which is compiled up front.
 struct Pipeline {
   vk::DescriptorSetLayout descriptorSetLayout_;
   vk::PipelineLayout layout_;
   vk::Sampler sampler_;
-  vk::Pipeline pipeline_;
-  Pipeline(const Gltf& model);
+  // Draws come from IndirectDraws and find their data by instance index
+  bool indirect_;
+  // The vertex shader fetches vertices from the geometry heap itself, see
+  // DescriptorPool::setVertices
+  bool vertexPulling_;
+  // Lays down depth with each variant's depth pipeline before shading with
+  // its equal one. Costs a second geometry pass, so only pays off in scenes
+  // with overdraw and expensive shading.
+  bool depthPrepass_;
+  // Textures come from an array of any number of images, each its own size,
+  // which Textures has to be made bindless for too. Needs
+  // gMaxBindlessDescriptors.
+  bool bindless_;
+  Pipeline(const Gltf& model, bool indirect, bool vertexPulling = false,
+           bool depthPrepass = false, bool bindless = false);
   ~Pipeline();
+  // Starts compiling the variants the draws need, and picks up the ones that
+  // finished. Once a frame, before recording. True when the last of the
+  // compiles just finished, which is when the cache is worth saving.
+  bool update(const DrawList& draws);
+  // The variant for the key if it's ready, otherwise the fallback. Safe to
+  // call from recording threads.
+  const PipelineVariant& variant(uint32_t key) const;
+  size_t readyVariants() const { return variants_.size(); }
+
+ private:
+  // On any thread
+  PipelineVariant compile(uint32_t key) const;
+  vk::ShaderModule vert_, frag_, depth_;
+  std::map<uint32_t, PipelineVariant> variants_;
+  std::map<uint32_t, std::future<PipelineVariant>> compiling_;
+};
+
+constexpr vk::IndexType kIndexType =
+    sizeof(Index) == 2 ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+
+// The scene's draws flattened out of the gltf data once at load, and sorted by
+// state so that draws which can share bindings are next to each other. Has to
+// be rebuilt when the geometry heap's generation changes.
+struct DrawList {
+  DrawList(const Gltf& gltf, const GeometryHeap::Model& geometry);
+  size_t size() const { return key_.size(); }
+  // pipeline << 56 | material << 40 | mesh << 24 | primitive
+  std::vector<uint64_t> key_;
+  std::vector<uint32_t> pipeline_;
+  std::vector<uint32_t> material_;
+  std::vector<uint32_t> indexCount_;
+  std::vector<uint32_t> firstIndex_;
+  std::vector<int32_t> vertexOffset_;
+  std::vector<uint32_t> mesh_;
+  // Into the gltf's instance matrices
+  std::vector<uint32_t> firstInstance_;
+  std::vector<uint32_t> instanceCount_;
+  // Bounding sphere in model space, center and radius
+  std::vector<glm::vec4> bounds_;
+  // Half extents of the bounding box around the same center
+  std::vector<glm::vec3> extents_;
+  // Consecutive draws with the same pipeline key
+  struct PipelineRun {
+    uint32_t key, first, count;
+  };
+  std::vector<PipelineRun> pipelineRuns_;
+};
+
+// Per instance data for indirect draws, indexed by instance index
+struct DrawData {
+  uint32_t model, material;
+};
+
+// A DrawList turned into indirect draw commands in device memory. Only needs
+// to be updated when the draw list changes.
+struct IndirectDraws {
+  vk::Buffer commands_;
+  vk::Buffer drawData_;
+  vk::Buffer count_;
+  vk::DeviceMemory commandsMemory_, drawDataMemory_, countMemory_;
+  // For GpuCulling, which writes the draws that survive into culled_. When
+  // compacting, each pipeline run is compacted into its own range of it
+  // with its own count, and runs_ has each draw's run and the run's start.
+  vk::Buffer bounds_, culled_, culledCount_, visibility_, runs_;
+  vk::DeviceMemory boundsMemory_, culledMemory_, culledCountMemory_,
+      visibilityMemory_, runsMemory_;
+  uint32_t size_ = 0, capacity_ = 0, instanceCapacity_ = 0;
+  IndirectDraws(const DrawList& draws, const DescriptorPool& descriptorPool);
+  ~IndirectDraws();
+  void update(const DrawList& draws);
 };
 
-extern std::vector<vk::CommandPool> gCommandPools;
+vk::ShaderModule readShader(const std::string& filename);
+Camera getCamera();
+
+// Everything a frame's command buffer is recorded from besides the contents
+// of buffers, which change without recording again. The camera only matters
+// through what CPU culling left visible and the projection GPU culling
+// pushes.
+struct RecordedState {
+  const Pipeline* pipeline = nullptr;
+  // Draws move off the fallback as variants become ready
+  size_t readyVariants = 0;
+  bool depthPrepass = false;
+  vk::DescriptorSet set;
+  uint32_t geometryGeneration = 0;
+  const DrawList* draws = nullptr;
+  size_t drawCount = 0;
+  uint32_t indirectCount = 0;
+  glm::mat4 proj = glm::mat4(1);
+  vk::QueryPool queries;
+  std::vector<uint32_t> visible;
+  bool operator==(const RecordedState& other) const;
+};
+
+// The command buffer last recorded for a swapchain image, resubmitted while
+// its state still matches
+struct RecordedFrame {
+  RecordedState state;
+  vk::CommandBuffer buf;
+};
+
+// Keeps its command buffers when reset and hands them out again, so steady
+// state frames allocate nothing
+struct RecyclingCommandPool {
+  vk::CommandPool pool_;
+  std::vector<vk::CommandBuffer> primaries_, secondaries_;
+  size_t usedPrimaries_ = 0, usedSecondaries_ = 0;
+  RecyclingCommandPool();
+  void destroy();
+  // Only once nothing from it is in flight
+  void reset();
+  vk::CommandBuffer get(vk::CommandBufferLevel level);
+};
+
+extern std::vector<RecyclingCommandPool> gCommandPools;
+// Per swapchain image, one per recording thread for secondary command buffers
+extern std::vector<std::vector<RecyclingCommandPool>> gRecordingPools;
+extern std::vector<RecordedFrame> gRecordedFrames;
 struct CommandPool {
-  CommandPool();
+  explicit CommandPool(uint32_t recordingThreads = 1)
+      : recordingThreads_(recordingThreads) {
+    resizeToSwapchain();
+  }
   ~CommandPool();
+  // Only ever grows, so nothing in flight is destroyed. Forgets every
+  // recorded frame, since they draw to the old framebuffers.
+  void resizeToSwapchain();
+  uint32_t recordingThreads_;
+};
+
+// Measures overdraw with occlusion queries around the shading draws, which
+// count the samples that pass the depth test. Precise where the device
+// supports it, otherwise any nonzero count may be reported.
+struct OverdrawQueries {
+  // The GPU culling path shades in two render passes
+  static constexpr uint32_t kPerImage = 2;
+  OverdrawQueries();
+  ~OverdrawQueries();
+  void resizeToSwapchain();
+  // Recording, for the current swapchain image. Begin and end have to be
+  // inside one subpass.
+  void reset(vk::CommandBuffer buf);
+  void begin(vk::CommandBuffer buf);
+  void end(vk::CommandBuffer buf);
+  // Reads the image's last frame, so only after waitForImage
+  void collect(uint32_t image);
+
+  vk::QueryPool pool_;
+  bool precise_;
+  std::vector<uint32_t> used_;  // Per image
+  // Shaded samples per pixel in the last frame collected
+  float overdraw_ = 0;
 };
 
+struct GpuCulling;
+struct CpuCulling;
+struct Workers;
 struct CommandBuffer {
+  // Fewer direct draws than this per thread are recorded on one thread
+  static constexpr size_t kMinDrawsPerThread = 256;
   vk::CommandBuffer buf_;
+  // False when the image's last command buffer was reused as it was
+  bool recorded_ = false;
+  // Direct draws are split into contiguous chunks, each recorded into
+  // secondary command buffers on its own worker, and executed in order.
+  // Has to be made after waitForImage, since recording again resets what
+  // was recorded for the image.
   CommandBuffer(const Pipeline& pipeline, const DescriptorPool& descriptorPool,
-                const VertexBuffers& vertices, const Gltf& gltf);
+                const GeometryHeap& geometry, const DrawList& draws,
+                const IndirectDraws& indirect, GpuCulling* gpuCulling = nullptr,
+                const CpuCulling* cpuCulling = nullptr,
+                OverdrawQueries* overdraw = nullptr,
+                Workers* workers = nullptr);
 };
 
 #endif /* rendering_hpp */
@@ -0,0 +1,189 @@
+#include "skinning.hpp"
+
+#include <tuple>
+#include "glm/gtc/type_ptr.hpp"
+#include "glm/matrix.hpp"
+
+#include "driver.hpp"
+#include "swapchain.hpp"
+#include "culling.hpp"
+
+Skinning::Skinning(const Gltf& gltf, const GeometryHeap& geometry,
+                   uint32_t model)
+    : geometry_(geometry), model_(model) {
+  // A mesh is skinned by the first node that has both
+  std::vector<int32_t> meshSkin(gltf.meshCount(), -1);
+  std::vector<int32_t> skinNode(gltf.data_.skins_size(), -1);
+  for (uint32_t node = 0; node < gltf.data_.nodes_size(); ++node) {
+    const gltf::Node& data = gltf.data_.nodes(node);
+    if (!data.has_mesh() || !data.has_skin()) continue;
+    if (meshSkin[data.mesh()] < 0) meshSkin[data.mesh()] = data.skin();
+    if (skinNode[data.skin()] < 0) skinNode[data.skin()] = node;
+  }
+
+  firstJoint_ = {0};
+  for (uint32_t skin = 0; skin < gltf.data_.skins_size(); ++skin) {
+    const gltf::Skin& data = gltf.data_.skins(skin);
+    skinNode_.push_back(skinNode[skin] < 0 ? 0 : skinNode[skin]);
+    std::vector<float> inverseBind;
+    if (data.has_inverse_bind_matrices())
+      inverseBind = gltf.readFloats(data.inverse_bind_matrices());
+    for (uint32_t joint = 0; joint < data.joints_size(); ++joint) {
+      jointNode_.push_back(data.joints(joint));
+      inverseBind_.push_back((joint + 1) * 16 <= inverseBind.size()
+                                 ? glm::make_mat4(&inverseBind[joint * 16])
+                                 : glm::mat4(1));
+    }
+    firstJoint_.push_back(static_cast<uint32_t>(jointNode_.size()));
+  }
+
+  std::vector<SkinVertex> skinVertices;
+  for (uint32_t mesh = 0; mesh < gltf.meshCount(); ++mesh) {
+    int32_t skin = meshSkin[mesh];
+    // Skinned primitives that nothing skins stay in the bind pose
+    if (skin < 0 || firstJoint_[skin] == firstJoint_[skin + 1]) continue;
+    for (const auto& prim : gltf.data_.meshes(mesh).primitives()) {
+      if (!prim.has_skinned_vertex_offset()) continue;
+      const auto& attrs = prim.attributes();
+      uint32_t count = gltf.data_.accessors(attrs.position()).count();
+      std::vector<uint32_t> joints = gltf.readUints(attrs.joints_0());
+      std::vector<float> weights = gltf.readFloats(attrs.weights_0());
+      if (joints.size() < count * 4 || weights.size() < count * 4)
+        throw std::runtime_error("Expected VEC4 joints and weights");
+
+      primitives_.push_back({prim.vertex_offset(),
+                             prim.skinned_vertex_offset(),
+                             static_cast<uint32_t>(skinVertices.size()),
+                             count});
+      for (uint32_t i = 0; i < count; ++i)
+        skinVertices.push_back(
+            {glm::make_vec4(&joints[i * 4]) + firstJoint_[skin],
+             glm::make_vec4(&weights[i * 4])});
+    }
+  }
+  if (primitives_.empty()) return;
+
+  vk::DeviceSize skinVerticesSize = skinVertices.size() * sizeof(SkinVertex);
+  std::tie(skinVertices_, skinVerticesMemory_) = makeDeviceBuffer(
+      skinVerticesSize, vk::BufferUsageFlagBits::eStorageBuffer);
+  std::tie(joints_, jointsMemory_) =
+      makeDeviceBuffer(jointNode_.size() * sizeof(glm::mat4),
+                       vk::BufferUsageFlagBits::eStorageBuffer);
+  Transfer transfer = gTransferManager->newTransfer(skinVerticesSize);
+  std::copy_n((char*)skinVertices.data(), skinVerticesSize, transfer.pointer_);
+  transfer.copy(transfer.buffer_, skinVertices_, skinVerticesSize,
+                vk::PipelineStageFlagBits::eComputeShader,
+                vk::AccessFlagBits::eShaderRead);
+
+  auto storage = [](uint32_t binding) {
+    return vk::DescriptorSetLayoutBinding(
+        binding, vk::DescriptorType::eStorageBuffer,
+        /*descriptorCount=*/1, vk::ShaderStageFlagBits::eCompute,
+        /*immutableSamplers=*/nullptr);
+  };
+  std::initializer_list<vk::DescriptorSetLayoutBinding> bindings = {
+      storage(0),  // positions
+      storage(1),  // attributes
+      storage(2),  // skin vertices
+      storage(3),  // joint matrices
+  };
+  setLayout_ = gDevice.createDescriptorSetLayout({/*flags=*/{}, bindings});
+  vk::PushConstantRange constants(vk::ShaderStageFlagBits::eCompute,
+                                  /*offset=*/0, sizeof(SkinConstants));
+  layout_ =
+      gDevice.createPipelineLayout({/*flags=*/{}, setLayout_, constants});
+  pipeline_ = makeComputePipeline("skin.comp", layout_);
+}
+
+Skinning::~Skinning() {
+  gDevice.destroy(pipeline_);
+  gDevice.destroy(layout_);
+  gDevice.destroy(setLayout_);
+  gDevice.destroy(pool_);
+  gDevice.destroy(skinVertices_);
+  gDevice.free(skinVerticesMemory_);
+  gDevice.destroy(joints_);
+  gDevice.free(jointsMemory_);
+}
+
+void Skinning::writeDescriptors() {
+  // Frames in flight may still be using the old set
+  if (pool_) retire([pool = pool_] { gDevice.destroy(pool); });
+  vk::DescriptorPoolSize size(vk::DescriptorType::eStorageBuffer,
+                              /*count=*/4);
+  pool_ = gDevice.createDescriptorPool({/*flags=*/{}, /*maxSets=*/1, size});
+  set_ = gDevice.allocateDescriptorSets({pool_, setLayout_})[0];
+  generation_ = geometry_.generation_;
+
+  std::vector<vk::DescriptorBufferInfo> buffers = {
+      {geometry_.positionBuffer_, /*offset=*/0, VK_WHOLE_SIZE},
+      {geometry_.attributeBuffer_, /*offset=*/0, VK_WHOLE_SIZE},
+      {skinVertices_, /*offset=*/0, VK_WHOLE_SIZE},
+      {joints_, /*offset=*/0, VK_WHOLE_SIZE}};
+  std::vector<vk::WriteDescriptorSet> writes;
+  for (uint32_t binding = 0; binding < buffers.size(); ++binding)
+    writes.emplace_back(set_, binding, /*arrayElement=*/0,
+                        /*descriptorCount=*/1,
+                        vk::DescriptorType::eStorageBuffer,
+                        /*imageInfo=*/nullptr, &buffers[binding]);
+  gDevice.updateDescriptorSets(writes, /*copies=*/{});
+}
+
+void Skinning::update(const Transforms& transforms) {
+  if (primitives_.empty()) return;
+  if (!pool_ || generation_ != geometry_.generation_) writeDescriptors();
+
+  auto world = [&](uint32_t node) {
+    uint32_t i = transforms.flatIndex_[node];
+    return i == UINT32_MAX ? glm::mat4(1) : transforms.world_[i];
+  };
+  vk::DeviceSize jointsSize = jointNode_.size() * sizeof(glm::mat4);
+  Transfer transfer = gTransferManager->newTransfer(jointsSize);
+  auto* joints = (glm::mat4*)transfer.pointer_;
+  for (uint32_t skin = 0; skin < skinNode_.size(); ++skin) {
+    glm::mat4 toMesh = glm::inverse(world(skinNode_[skin]));
+    for (uint32_t joint = firstJoint_[skin]; joint < firstJoint_[skin + 1];
+         ++joint)
+      joints[joint] = multiply(multiply(toMesh, world(jointNode_[joint])),
+                               inverseBind_[joint]);
+  }
+
+  // Earlier frames may still be reading the joints and skinned vertices, as
+  // attributes or, when pulling vertices, from the vertex shader
+  vk::MemoryBarrier unused(vk::AccessFlagBits::eShaderRead |
+                               vk::AccessFlagBits::eVertexAttributeRead,
+                           vk::AccessFlagBits::eTransferWrite |
+                               vk::AccessFlagBits::eShaderWrite);
+  transfer.cmd_.pipelineBarrier(vk::PipelineStageFlagBits::eVertexInput |
+                                    vk::PipelineStageFlagBits::eVertexShader |
+                                    vk::PipelineStageFlagBits::eComputeShader,
+                                vk::PipelineStageFlagBits::eTransfer |
+                                    vk::PipelineStageFlagBits::eComputeShader,
+                                /*dependencyFlags=*/{}, unused, {}, {});
+  transfer.copy(transfer.buffer_, joints_, jointsSize,
+                vk::PipelineStageFlagBits::eComputeShader,
+                vk::AccessFlagBits::eShaderRead);
+
+  uint32_t firstVertex = geometry_.model(model_).firstVertex;
+  transfer.cmd_.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline_);
+  transfer.cmd_.bindDescriptorSets(vk::PipelineBindPoint::eCompute, layout_,
+                                   /*firstSet=*/0, set_,
+                                   /*dynamicOffsets=*/{});
+  for (SkinConstants constants : primitives_) {
+    constants.source += firstVertex;
+    constants.target += firstVertex;
+    transfer.cmd_.pushConstants(layout_, vk::ShaderStageFlagBits::eCompute,
+                                /*offset=*/0, sizeof(SkinConstants),
+                                &constants);
+    transfer.cmd_.dispatch((constants.count + 63) / 64, 1, 1);
+  }
+
+  // Read as vertex attributes, or as storage buffers when pulled
+  vk::MemoryBarrier skinned(vk::AccessFlagBits::eShaderWrite,
+                            vk::AccessFlagBits::eVertexAttributeRead |
+                                vk::AccessFlagBits::eShaderRead);
+  transfer.cmd_.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                vk::PipelineStageFlagBits::eVertexInput |
+                                    vk::PipelineStageFlagBits::eVertexShader,
+                                /*dependencyFlags=*/{}, skinned, {}, {});
+}
@@ -0,0 +1,65 @@
+#ifndef skinning_hpp
+#define skinning_hpp
+
+#include <vector>
+#include "vulkan/vulkan.hpp"
+#include "glm/mat4x4.hpp"
+#include "glm/vec4.hpp"
+
+#include "drawdata.hpp"
+#include "gltf.hpp"
+#include "transforms.hpp"
+
+// Matches the SkinVertex in skin.comp
+struct SkinVertex {
+  glm::uvec4 joints;  // Into the joint matrices of all skins
+  glm::vec4 weights;
+};
+
+// Matches the push constants in skin.comp
+struct SkinConstants {
+  uint32_t source, target;  // Vertices, from the start of the model
+  uint32_t first;           // Into the skin vertices
+  uint32_t count;
+};
+
+// Skins a gltf's skinned primitives on the GPU once a frame. Joint matrices
+// are computed on the CPU, one batch per skin, and a compute pass writes the
+// skinned vertices into each primitive's second copy in the geometry heap,
+// which every pass that draws the primitive reads.
+struct Skinning {
+  Skinning(const Gltf& gltf, const GeometryHeap& geometry, uint32_t model);
+  ~Skinning();
+  // Skins with this frame's transforms. Submitted before the frame's
+  // command buffer, so has to be called before it's recorded.
+  void update(const Transforms& transforms);
+
+  const GeometryHeap& geometry_;
+  uint32_t model_;
+  // Per skin, the node with the skinned mesh. Joints are transformed into
+  // its space, since its instance matrix is still applied when drawn.
+  std::vector<uint32_t> skinNode_;
+  // Where each skin's joints start, and the total at the end
+  std::vector<uint32_t> firstJoint_;
+  // Per joint
+  std::vector<uint32_t> jointNode_;
+  std::vector<glm::mat4> inverseBind_;
+  // One dispatch each
+  std::vector<SkinConstants> primitives_;
+
+  vk::Buffer skinVertices_, joints_;
+  vk::DeviceMemory skinVerticesMemory_, jointsMemory_;
+  vk::DescriptorSetLayout setLayout_;
+  vk::PipelineLayout layout_;
+  vk::Pipeline pipeline_;
+  // Points at the geometry heap's vertex streams, so is remade whenever the
+  // heap is compacted
+  vk::DescriptorPool pool_;
+  vk::DescriptorSet set_;
+  uint32_t generation_ = 0;
+
+ private:
+  void writeDescriptors();
+};
+
+#endif /* skinning_hpp */
@@ -4,6 +4,7 @@
 #include "driver.hpp"
 #include "rendering.hpp"
 #include "GLFW/glfw3.h"
+#include <deque>
 
 vk::SwapchainKHR gSwapchain;
 uint32_t gSwapchainImageCount;
@@ -20,9 +21,31 @@ vk::Extent2D windowExtent() {
   return vk::Extent2D(width, height);
 }
 
+uint64_t gSubmitSerial = 0;
+uint64_t gCompletedSerial = 0;
+std::deque<std::pair<uint64_t, std::function<void()>>> gRetired;
+
+void retire(std::function<void()> destroy) {
+  gRetired.emplace_back(gSubmitSerial + 1, std::move(destroy));
+}
+
+void collectRetired() {
+  while (!gRetired.empty() && gRetired.front().first <= gCompletedSerial) {
+    gRetired.front().second();
+    gRetired.pop_front();
+  }
+}
+
+void collectAllRetired() {
+  gCompletedSerial = UINT64_MAX;
+  collectRetired();
+  gCompletedSerial = gSubmitSerial;
+}
+
 void Swapchain::resizeToWindow() {
-  if (gSwapchainExtent == windowExtent()) return;
-  destroy();
+  // Suboptimal only matters once the size changes
+  if (!outOfDate_ && gSwapchainExtent == windowExtent()) return;
+  outOfDate_ = false;
 
   gSwapchainExtent = windowExtent();
   gViewport =
@@ -36,6 +59,9 @@ void Swapchain::resizeToWindow() {
   // the application to be able to eventually aquire one of them
   uint32_t requestedImages = kMaxImagesInFlight + caps.minImageCount - 1;
 
+  // Passing the old swapchain lets the presentation engine hand its resources
+  // over, and lets frames already queued for it finish presenting
+  vk::SwapchainKHR oldSwapchain = gSwapchain;
   gSwapchain = gDevice.createSwapchainKHR(
       {/*flags=*/{}, gSurface, requestedImages, kPresentFormat,
        vk::ColorSpaceKHR::eSrgbNonlinear, gSwapchainExtent,
@@ -43,7 +69,13 @@ void Swapchain::resizeToWindow() {
        vk::SharingMode::eExclusive, /*queueFamilyIndices=*/{},
        vk::SurfaceTransformFlagBitsKHR::eIdentity,
        vk::CompositeAlphaFlagBitsKHR::eOpaque, vk::PresentModeKHR::eFifo,
-       /*clipped=*/true});
+       /*clipped=*/true, oldSwapchain});
+
+  if (oldSwapchain)
+    retire([oldSwapchain, imageViews = std::move(gSwapchainImageViews)] {
+      for (vk::ImageView imageView : imageViews) gDevice.destroy(imageView);
+      gDevice.destroy(oldSwapchain);
+    });
 
   gSwapchainImages = gDevice.getSwapchainImagesKHR(gSwapchain);
   gSwapchainImageCount = (uint32_t)gSwapchainImages.size();
@@ -66,34 +98,40 @@ void checkResizeOrThrowFail(const char *context, vk::Result result) {
     throwFail(context, result);
 }
 
-vk::Semaphore Swapchain::getFirstImage() {
+vk::Semaphore Swapchain::acquireImage() {
   frameNum_ = (frameNum_ + 1) % kMaxImagesInFlight;
   vk::Semaphore imageAvailableSemaphore = gImageAvailableSemaphores[frameNum_];
-  vk::ResultValue<uint32_t> imageIndex_or = gDevice.acquireNextImageKHR(
-      gSwapchain, UINT64_MAX, imageAvailableSemaphore,
-      /*fence=*/nullptr);
+  vk::ResultValue<uint32_t> imageIndex_or(vk::Result::eErrorOutOfDateKHR, 0);
+  try {
+    imageIndex_or = gDevice.acquireNextImageKHR(gSwapchain, UINT64_MAX,
+                                                imageAvailableSemaphore,
+                                                /*fence=*/nullptr);
+  } catch (const vk::OutOfDateKHRError &) {
+  }
   checkResizeOrThrowFail("acquireNextImageKHR", imageIndex_or.result);
+  // Suboptimal still acquires an image, which has to be presented
+  if (imageIndex_or.result == vk::Result::eErrorOutOfDateKHR) {
+    outOfDate_ = true;
+    return nullptr;
+  }
 
   gSwapchainCurrentImage = imageIndex_or.value;
   return imageAvailableSemaphore;
 }
-vk::Semaphore Swapchain::getNextImage(vk::Semaphore renderFinishedSemaphore) {
-  frameNum_ = (frameNum_ + 1) % kMaxImagesInFlight;
-  vk::Semaphore imageAvailableSemaphore = gImageAvailableSemaphores[frameNum_];
-  vk::ResultValue<uint32_t> imageIndex_or = gDevice.acquireNextImageKHR(
-      gSwapchain, UINT64_MAX, imageAvailableSemaphore,
-      /*fence=*/nullptr);
-  checkResizeOrThrowFail("acquireNextImageKHR", imageIndex_or.result);
-
-  checkResizeOrThrowFail("presentKHR", gGraphicsQueue.presentKHR(
-                                           {renderFinishedSemaphore, gSwapchain,
-                                            gSwapchainCurrentImage}));
-
-  gSwapchainCurrentImage = imageIndex_or.value;
-  return imageAvailableSemaphore;
+void Swapchain::presentImage(vk::Semaphore renderFinishedSemaphore) {
+  vk::Result result;
+  try {
+    result = gGraphicsQueue.presentKHR(
+        {renderFinishedSemaphore, gSwapchain, gSwapchainCurrentImage});
+  } catch (const vk::OutOfDateKHRError &) {
+    result = vk::Result::eErrorOutOfDateKHR;
+  }
+  if (result == vk::Result::eErrorOutOfDateKHR) outOfDate_ = true;
+  checkResizeOrThrowFail("presentKHR", result);
 }
 
-void Swapchain::destroy() {
+Swapchain::~Swapchain() {
+  collectAllRetired();
   for (vk::ImageView imageView : gSwapchainImageViews)
     gDevice.destroy(imageView);
   gSwapchainImages.clear();
@@ -103,20 +141,39 @@ void Swapchain::destroy() {
 }
 
 vk::ImageView gDepthStencilImageView;
+vk::ImageView gDepthImageView;
+
+void DepthStencil::resizeToSwapchain() {
+  if (image_) {
+    retire([image = image_, imageView = gDepthStencilImageView,
+            depthView = gDepthImageView] {
+      gDevice.destroy(imageView);
+      gDevice.destroy(depthView);
+      gDevice.destroy(image);
+    });
+  }
 
-DepthStencil::DepthStencil() {
   vk::Extent3D extent(gSwapchainExtent, 1);
   image_ = gDevice.createImage(
       {/*flags=*/{}, vk::ImageType::e2D, kDepthStencilFormat, extent,
        /*mipLevels=*/1, /*arrayLayers=*/1, vk::SampleCountFlagBits::e1,
        vk::ImageTiling::eOptimal,
-       vk::ImageUsageFlagBits::eDepthStencilAttachment,
+       vk::ImageUsageFlagBits::eDepthStencilAttachment |
+           vk::ImageUsageFlagBits::eSampled,
        vk::SharingMode::eExclusive, /*queueFamilyIndices=*/{}});
 
-  uint32_t memoryType = getMemoryFor(gDevice.getImageMemoryRequirements(image_),
-                                     vk::MemoryPropertyFlagBits::eDeviceLocal);
-  memory_ =
-      gDevice.allocateMemory({extent.width * extent.height * 8, memoryType});
+  // The old image can alias the same memory, since frames are ordered against
+  // each other's depth accesses by the render pass's external dependency
+  vk::MemoryRequirements requirements =
+      gDevice.getImageMemoryRequirements(image_);
+  if (requirements.size > capacity_) {
+    if (memory_)
+      retire([memory = memory_] { gDevice.free(memory); });
+    uint32_t memoryType =
+        getMemoryFor(requirements, vk::MemoryPropertyFlagBits::eDeviceLocal);
+    memory_ = gDevice.allocateMemory({requirements.size, memoryType});
+    capacity_ = requirements.size;
+  }
   gDevice.bindImageMemory(image_, memory_, /*offset=*/0);
 
   vk::ImageSubresourceRange wholeImage(
@@ -127,22 +184,29 @@ DepthStencil::DepthStencil() {
   gDepthStencilImageView = gDevice.createImageView(
       {/*flags=*/{}, image_, vk::ImageViewType::e2D, kDepthStencilFormat,
        /*componentMapping=*/{}, wholeImage});
+  wholeImage.aspectMask = vk::ImageAspectFlagBits::eDepth;
+  gDepthImageView = gDevice.createImageView(
+      {/*flags=*/{}, image_, vk::ImageViewType::e2D, kDepthStencilFormat,
+       /*componentMapping=*/{}, wholeImage});
 }
 DepthStencil::~DepthStencil() {
   gDevice.destroy(gDepthStencilImageView);
+  gDevice.destroy(gDepthImageView);
   gDevice.destroy(image_);
   gDevice.free(memory_);
 }
 
 std::vector<vk::Fence> gFrameFences;
 std::vector<vk::Fence> gInFlightFences;
+std::vector<uint64_t> gInFlightSerials;
 std::vector<vk::Semaphore> gImageAvailableSemaphores;
 std::vector<vk::Semaphore> gRenderFinishedSemaphores;
 
-Semaphores::Semaphores() {
-  for (size_t i = 0; i < gSwapchainImageCount; ++i) {
+void Semaphores::resizeToSwapchain() {
+  for (size_t i = gFrameFences.size(); i < gSwapchainImageCount; ++i) {
     gFrameFences.push_back(gDevice.createFence({}));
     gInFlightFences.push_back(nullptr);
+    gInFlightSerials.push_back(0);
     gRenderFinishedSemaphores.push_back(gDevice.createSemaphore({}));
     gImageAvailableSemaphores.push_back(gDevice.createSemaphore({}));
   }
@@ -153,13 +217,39 @@ Semaphores::~Semaphores() {
   for (vk::Semaphore sem : gImageAvailableSemaphores) gDevice.destroy(sem);
   gFrameFences.clear();
   gInFlightFences.clear();
+  gInFlightSerials.clear();
   gRenderFinishedSemaphores.clear();
   gImageAvailableSemaphores.clear();
 }
 
+void waitForImage(uint32_t image) {
+  if (!gInFlightFences[image]) return;
+  throwFail("waitForFences",
+            gDevice.waitForFences(gInFlightFences[image],
+                                  /*waitAll=*/false,
+                                  /*timeout=*/UINT64_MAX));
+  gDevice.resetFences(gInFlightFences[image]);
+  gInFlightFences[image] = nullptr;
+  // The queue finishes submissions in order, so everything before is done too
+  gCompletedSerial = std::max(gCompletedSerial, gInFlightSerials[image]);
+  collectRetired();
+}
+
+void submitFrame(uint32_t image, const vk::SubmitInfo &submit) {
+  gInFlightFences[image] = gFrameFences[image];
+  gInFlightSerials[image] = ++gSubmitSerial;
+  gGraphicsQueue.submit({submit}, gInFlightFences[image]);
+  ++gFrame;
+}
+
 std::vector<vk::Framebuffer> gFramebuffers;
 
-Framebuffers::Framebuffers() {
+void Framebuffers::resizeToSwapchain() {
+  if (!gFramebuffers.empty())
+    retire([framebuffers = std::move(gFramebuffers)] {
+      for (vk::Framebuffer fb : framebuffers) gDevice.destroy(fb);
+    });
+  gFramebuffers.clear();
   for (vk::ImageView imageView : gSwapchainImageViews) {
     auto attachments = {imageView, gDepthStencilImageView};
     gFramebuffers.push_back(gDevice.createFramebuffer(
@@ -173,21 +263,32 @@ Framebuffers::~Framebuffers() {
 }
 
 vk::RenderPass gRenderPass;
+vk::RenderPass gEarlyRenderPass;
+vk::RenderPass gLateRenderPass;
 
-RenderPass::RenderPass() {
+// The first pass of a frame clears the attachments, and the last one leaves
+// the image ready to present. Passes in between keep depth for compute.
+vk::RenderPass makeRenderPass(bool first, bool last) {
   std::initializer_list<vk::AttachmentDescription> attachments = {
       {/*flags=*/{}, kPresentFormat, vk::SampleCountFlagBits::e1,
-       vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eStore,
+       first ? vk::AttachmentLoadOp::eClear : vk::AttachmentLoadOp::eLoad,
+       vk::AttachmentStoreOp::eStore,
        /*stencil*/ vk::AttachmentLoadOp::eDontCare,
        vk::AttachmentStoreOp::eDontCare,
-       /*initialLayout=*/vk::ImageLayout::eUndefined,
-       /*finalLayout=*/vk::ImageLayout::ePresentSrcKHR},
+       /*initialLayout=*/first ? vk::ImageLayout::eUndefined
+                               : vk::ImageLayout::eColorAttachmentOptimal,
+       /*finalLayout=*/last ? vk::ImageLayout::ePresentSrcKHR
+                           : vk::ImageLayout::eColorAttachmentOptimal},
       {/*flags=*/{}, kDepthStencilFormat, vk::SampleCountFlagBits::e1,
-       vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eDontCare,
-       /*stencil*/ vk::AttachmentLoadOp::eClear,
-       vk::AttachmentStoreOp::eDontCare,
-       /*initialLayout=*/vk::ImageLayout::eUndefined,
-       /*finalLayout=*/vk::ImageLayout::eDepthStencilAttachmentOptimal}};
+       first ? vk::AttachmentLoadOp::eClear : vk::AttachmentLoadOp::eLoad,
+       last ? vk::AttachmentStoreOp::eDontCare : vk::AttachmentStoreOp::eStore,
+       /*stencil*/
+       first ? vk::AttachmentLoadOp::eClear : vk::AttachmentLoadOp::eLoad,
+       last ? vk::AttachmentStoreOp::eDontCare : vk::AttachmentStoreOp::eStore,
+       /*initialLayout=*/first ? vk::ImageLayout::eUndefined
+                               : vk::ImageLayout::eDepthStencilReadOnlyOptimal,
+       /*finalLayout=*/last ? vk::ImageLayout::eDepthStencilAttachmentOptimal
+                           : vk::ImageLayout::eDepthStencilReadOnlyOptimal}};
 
   vk::AttachmentReference colorRef(
       /*attachment=*/0, vk::ImageLayout::eColorAttachmentOptimal);
@@ -198,23 +299,44 @@ RenderPass::RenderPass() {
       /*flags=*/{}, vk::PipelineBindPoint::eGraphics,
       /*inputAttachments=*/{}, colorRef, /*resolveAttachments=*/{},
       &depthStencilRef);
-  // Don't write to the image until the presenter is done with it
-  std::initializer_list<vk::SubpassDependency> dependencies = {
+  std::vector<vk::SubpassDependency> dependencies = {
+      // Don't write to the image until the presenter or the previous pass is
+      // done with it
       {/*src=*/VK_SUBPASS_EXTERNAL, /*dstSubpass=*/0,
        /*src=*/vk::PipelineStageFlagBits::eColorAttachmentOutput,
        /*dst=*/vk::PipelineStageFlagBits::eColorAttachmentOutput,
-       /*src=*/vk::AccessFlags(),
-       /*dst=*/vk::AccessFlagBits::eColorAttachmentWrite},
-      // Don't touch the depth buffer until the previous frame is done with it
+       /*src=*/first ? vk::AccessFlags()
+                     : vk::AccessFlagBits::eColorAttachmentWrite,
+       /*dst=*/vk::AccessFlagBits::eColorAttachmentRead |
+           vk::AccessFlagBits::eColorAttachmentWrite},
+      // Don't touch the depth buffer until the previous frame or pass, and
+      // compute reading it, are done with it
       {/*src=*/VK_SUBPASS_EXTERNAL, /*dstSubpass=*/0,
-       vk::PipelineStageFlagBits::eLateFragmentTests,
+       vk::PipelineStageFlagBits::eLateFragmentTests |
+           vk::PipelineStageFlagBits::eComputeShader,
        vk::PipelineStageFlagBits::eEarlyFragmentTests,
-       vk::AccessFlagBits::eDepthStencilAttachmentRead |
-           vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+       vk::AccessFlagBits::eDepthStencilAttachmentWrite,
        vk::AccessFlagBits::eDepthStencilAttachmentRead |
            vk::AccessFlagBits::eDepthStencilAttachmentWrite}};
-  gRenderPass = gDevice.createRenderPass(
+  if (!last)
+    // Compute reads depth after the pass
+    dependencies.emplace_back(
+        /*srcSubpass=*/0, /*dstSubpass=*/VK_SUBPASS_EXTERNAL,
+        vk::PipelineStageFlagBits::eLateFragmentTests,
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        vk::AccessFlagBits::eShaderRead);
+  return gDevice.createRenderPass(
       {/*flags=*/{}, attachments, subpass, dependencies});
 }
-RenderPass::~RenderPass() { gDevice.destroy(gRenderPass); }
 
+RenderPass::RenderPass() {
+  gRenderPass = makeRenderPass(/*first=*/true, /*last=*/true);
+  gEarlyRenderPass = makeRenderPass(/*first=*/true, /*last=*/false);
+  gLateRenderPass = makeRenderPass(/*first=*/false, /*last=*/true);
+}
+RenderPass::~RenderPass() {
+  gDevice.destroy(gRenderPass);
+  gDevice.destroy(gEarlyRenderPass);
+  gDevice.destroy(gLateRenderPass);
+}
@@ -2,6 +2,7 @@
 #define swapchain_hpp
 
 #include "vulkan/vulkan.hpp"
+#include <functional>
 
 constexpr vk::Format kPresentFormat = vk::Format::eB8G8R8A8Srgb;
 constexpr vk::Format kDepthStencilFormat = vk::Format::eD32SfloatS8Uint;
@@ -18,39 +19,69 @@ extern vk::Rect2D gScissor;
 
 struct Swapchain {
   Swapchain() { resizeToWindow(); }
-  ~Swapchain() { destroy(); }
+  ~Swapchain();
   uint32_t frameNum_ = 0;
+  // Set when acquiring or presenting reported the swapchain out of date, so
+  // it's recreated even if the window is the same size
+  bool outOfDate_ = false;
+  // Recreates the swapchain if the window changed size or it's out of date
   void resizeToWindow();
-  void destroy();
-  vk::Semaphore getFirstImage();
-  vk::Semaphore getNextImage(vk::Semaphore renderFinishedSemaphore);
+  // Returns null if the swapchain is out of date and has to be recreated
+  vk::Semaphore acquireImage();
+  void presentImage(vk::Semaphore renderFinishedSemaphore);
 };
 
+// Objects that frames in flight may still be using are retired instead of
+// destroyed, and destroyed once the next frame submitted after that is done.
+// That also covers any transfers queued in between.
+extern uint64_t gSubmitSerial;
+extern uint64_t gCompletedSerial;
+void retire(std::function<void()> destroy);
+void collectRetired();
+// Only once the queue is idle
+void collectAllRetired();
+
+// Depth aspect only, for sampling
+extern vk::ImageView gDepthImageView;
+
 struct DepthStencil {
   vk::DeviceMemory memory_;
+  vk::DeviceSize capacity_ = 0;
   vk::Image image_;
-  DepthStencil();
+  DepthStencil() { resizeToSwapchain(); }
   ~DepthStencil();
+  void resizeToSwapchain();
 };
 
 extern std::vector<vk::Fence> gFrameFences;
 extern std::vector<vk::Fence> gInFlightFences;
+extern std::vector<uint64_t> gInFlightSerials;
 extern std::vector<vk::Semaphore> gImageAvailableSemaphores;
 extern std::vector<vk::Semaphore> gRenderFinishedSemaphores;
 
 struct Semaphores {
-  Semaphores();
+  Semaphores() { resizeToSwapchain(); }
   ~Semaphores();
+  // Only ever grows, so nothing in flight is destroyed
+  void resizeToSwapchain();
 };
 
+void waitForImage(uint32_t image);
+void submitFrame(uint32_t image, const vk::SubmitInfo& submit);
+
 extern std::vector<vk::Framebuffer> gFramebuffers;
 
 struct Framebuffers {
-  Framebuffers();
+  Framebuffers() { resizeToSwapchain(); }
   ~Framebuffers();
+  void resizeToSwapchain();
 };
 
 extern vk::RenderPass gRenderPass;
+// Compatible with gRenderPass, for frames drawn in two passes with compute in
+// between. Depth is left in eDepthStencilReadOnlyOptimal for the compute.
+extern vk::RenderPass gEarlyRenderPass;
+extern vk::RenderPass gLateRenderPass;
 struct RenderPass {
   RenderPass();
   ~RenderPass();
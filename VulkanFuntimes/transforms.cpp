@@ -0,0 +1,110 @@
+#include "transforms.hpp"
+
+#include <algorithm>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+glm::mat4 multiply(const glm::mat4& a, const glm::mat4& b) {
+#if defined(__SSE__)
+  // Each column of the result is the columns of a weighted by a column of b
+  __m128 a0 = _mm_loadu_ps(&a[0][0]);
+  __m128 a1 = _mm_loadu_ps(&a[1][0]);
+  __m128 a2 = _mm_loadu_ps(&a[2][0]);
+  __m128 a3 = _mm_loadu_ps(&a[3][0]);
+  glm::mat4 result;
+  for (int column = 0; column < 4; ++column) {
+    __m128 sum = _mm_mul_ps(a0, _mm_set1_ps(b[column][0]));
+    sum = _mm_add_ps(sum, _mm_mul_ps(a1, _mm_set1_ps(b[column][1])));
+    sum = _mm_add_ps(sum, _mm_mul_ps(a2, _mm_set1_ps(b[column][2])));
+    sum = _mm_add_ps(sum, _mm_mul_ps(a3, _mm_set1_ps(b[column][3])));
+    _mm_storeu_ps(&result[column][0], sum);
+  }
+  return result;
+#else
+  return a * b;
+#endif
+}
+
+Transforms::Transforms(const Gltf& gltf)
+    : flatIndex_(gltf.data_.nodes_size(), UINT32_MAX),
+      instanceNode_(gltf.instanceCount()) {
+  std::vector<Gltf::FlatNode> nodes = gltf.flattenNodes();
+  uint32_t size = static_cast<uint32_t>(nodes.size());
+  parent_.resize(size);
+  subtreeEnd_.resize(size);
+  local_.resize(size);
+  world_.resize(size);
+  dirty_.resize(size);
+  instance_.resize(size, UINT32_MAX);
+
+  // Instances are numbered in flat order within each mesh
+  std::vector<uint32_t> next(gltf.meshCount());
+  for (uint32_t mesh = 0; mesh < gltf.meshCount(); ++mesh)
+    next[mesh] = gltf.firstInstance(mesh);
+  for (uint32_t i = 0; i < size; ++i) {
+    const gltf::Node& node = gltf.data_.nodes(nodes[i].node);
+    flatIndex_[nodes[i].node] = i;
+    parent_[i] = nodes[i].parent;
+    subtreeEnd_[i] = i + 1;
+    local_[i] = gltf.localMatrix(nodes[i].node);
+    if (node.has_mesh()) {
+      instance_[i] = next[node.mesh()]++;
+      instanceNode_[instance_[i]] = i;
+    }
+  }
+  // Children are after their parents, so their ends are final first
+  for (uint32_t i = size; i-- > 0;)
+    if (parent_[i] >= 0)
+      subtreeEnd_[parent_[i]] =
+          std::max(subtreeEnd_[parent_[i]], subtreeEnd_[i]);
+
+  for (uint32_t i = 0; i < size; ++i)
+    if (parent_[i] < 0) dirty_[i] = true;
+  update();
+}
+
+void Transforms::setLocal(uint32_t node, const glm::mat4& local) {
+  uint32_t i = flatIndex_[node];
+  if (i == UINT32_MAX) return;  // Not in the scene
+  local_[i] = local;
+  dirty_[i] = true;
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> Transforms::update() {
+  std::vector<uint32_t> changed;
+  uint32_t size = static_cast<uint32_t>(parent_.size());
+  for (uint32_t i = 0; i < size;) {
+    if (!dirty_[i]) {
+      ++i;
+      continue;
+    }
+    // Everything under a dirty node, in one pass since parents come first
+    uint32_t end = subtreeEnd_[i];
+    for (uint32_t j = i; j < end; ++j) {
+      dirty_[j] = false;
+      world_[j] = parent_[j] < 0 ? local_[j]
+                                 : multiply(world_[parent_[j]], local_[j]);
+      if (instance_[j] != UINT32_MAX) changed.push_back(instance_[j]);
+    }
+    i = end;
+  }
+
+  // Instances are grouped by mesh, not by subtree
+  std::sort(changed.begin(), changed.end());
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  for (uint32_t instance : changed) {
+    if (!ranges.empty() && ranges.back().second == instance)
+      ++ranges.back().second;
+    else
+      ranges.emplace_back(instance, instance + 1);
+  }
+  return ranges;
+}
+
+std::vector<glm::mat4> Transforms::instanceMatrices() const {
+  std::vector<glm::mat4> result(instanceNode_.size());
+  for (uint32_t instance = 0; instance < instanceNode_.size(); ++instance)
+    result[instance] = world_[instanceNode_[instance]];
+  return result;
+}
@@ -0,0 +1,36 @@
+#ifndef transforms_hpp
+#define transforms_hpp
+
+#include <utility>
+#include <vector>
+#include "glm/mat4x4.hpp"
+
+#include "gltf.hpp"
+
+// a * b, with SSE where it's available
+glm::mat4 multiply(const glm::mat4& a, const glm::mat4& b);
+
+// The gltf node tree flattened depth first, with local and world matrices
+// in arrays indexed by flat node. A node's subtree is the flat nodes from it
+// up to subtreeEnd_, so changing a node only recomputes that range.
+struct Transforms {
+  explicit Transforms(const Gltf& gltf);
+  // Marks the node and everything under it for the next update
+  void setLocal(uint32_t node, const glm::mat4& local);
+  // Recomputes the world matrices of dirty subtrees, and returns the ranges
+  // of instance matrices that changed, as [first, end)
+  std::vector<std::pair<uint32_t, uint32_t>> update();
+  std::vector<glm::mat4> instanceMatrices() const;
+
+  std::vector<uint32_t> flatIndex_;  // By gltf node
+  std::vector<int32_t> parent_;
+  std::vector<uint32_t> subtreeEnd_;
+  std::vector<glm::mat4> local_, world_;
+  std::vector<uint8_t> dirty_;
+  // Instance of each flat node, UINT32_MAX if it has no mesh
+  std::vector<uint32_t> instance_;
+  // Flat node of each instance
+  std::vector<uint32_t> instanceNode_;
+};
+
+#endif /* transforms_hpp */
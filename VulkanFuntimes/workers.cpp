@@ -0,0 +1,49 @@
+#include "workers.hpp"
+
+Workers::Workers(uint32_t threads) {
+  for (uint32_t i = 0; i < threads; ++i)
+    threads_.emplace_back([this] { work(); });
+}
+
+Workers::~Workers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& thread : threads_) thread.join();
+}
+
+void Workers::run(uint32_t count, const std::function<void(uint32_t)>& task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_ = &task;
+  next_ = 0;
+  count_ = count;
+  finished_ = 0;
+  ++generation_;
+  wake_.notify_all();
+  runTasks(lock);
+  done_.wait(lock, [&] { return finished_ == count_; });
+  task_ = nullptr;
+}
+
+void Workers::work() {
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [&] { return quit_ || generation_ != seen; });
+    if (quit_) return;
+    seen = generation_;
+    runTasks(lock);
+  }
+}
+
+void Workers::runTasks(std::unique_lock<std::mutex>& lock) {
+  while (next_ < count_) {
+    uint32_t i = next_++;
+    lock.unlock();
+    (*task_)(i);
+    lock.lock();
+    if (++finished_ == count_) done_.notify_all();
+  }
+}
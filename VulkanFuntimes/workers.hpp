@@ -0,0 +1,38 @@
+#ifndef workers_hpp
+#define workers_hpp
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads started once that wait to run parallel loops, so per frame work
+// doesn't pay for starting threads
+struct Workers {
+  // Plus the thread that calls run, which works too
+  explicit Workers(
+      uint32_t threads = std::max(std::thread::hardware_concurrency(), 1u) -
+                         1);
+  ~Workers();
+  uint32_t size() const { return static_cast<uint32_t>(threads_.size()) + 1; }
+  // Calls task(i) for every i below count, spread over the workers and the
+  // calling thread. Returns once all have finished.
+  void run(uint32_t count, const std::function<void(uint32_t)>& task);
+
+ private:
+  void work();
+  // Runs tasks until there are none left to start. Called locked.
+  void runTasks(std::unique_lock<std::mutex>& lock);
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable wake_, done_;
+  const std::function<void(uint32_t)>* task_ = nullptr;
+  uint32_t next_ = 0, count_ = 0, finished_ = 0;
+  uint64_t generation_ = 0;  // Of run calls, so workers wake once each
+  bool quit_ = false;
+};
+
+#endif /* workers_hpp */